@@ -0,0 +1,14 @@
+;; Batched GPIO access in JL.
+
+(define leds 0x3C)      ; GPIO 2-5
+
+(gpio-init-mask leds)
+
+; Walk a single lit LED across the group in one call.
+(gpio-write-seq leds (list 0x04 0x08 0x10 0x20 0x10 0x08 0x04 0x00))
+
+; Toggle the outer pair, then clear everything.
+(gpio-xor-mask 0x24)
+(gpio-clr-mask leds)
+
+(print (gpio-get-all) "\n")
@@ -0,0 +1,26 @@
+;;; A prelude to put in flash with jlrom (see the JL_PRELUDE option).
+;;; Nothing here is parsed at boot or uses RAM.
+
+(define LED 25)
+(define HIGH 1)
+(define LOW 0)
+(define greeting "Pico-JL")
+
+(defmacro when (c e) `(if ,c ,e nil))
+
+(define square (lambda (x) (* x x)))
+
+(define sum (lambda (lst)
+   (if lst (+ (head lst) (sum (rest lst))) 0)))
+
+(define range (lambda (a b)
+   (if (< a b) (cons a (range (+ a 1) b)) nil)))
+
+(define blink-mask (lambda (pins)
+   (begin
+      (define mask 0)
+      (map (lambda (p) (set! mask (| mask (<< 1 p)))) pins)
+      mask)))
+
+(define clamp (lambda (x lo hi)
+   (when (>= x lo) (if (> x hi) hi x))))
@@ -0,0 +1,26 @@
+;; A control loop run against the simulator (build with JL_SIMULATOR).
+;; Every millisecond the LED on GPIO 2 follows the button on GPIO 0, and
+;; anything received on the UART is echoed back.
+
+(define led 0x04)
+(define button 0x01)
+(define rx (make-bytes 16))
+
+(gpio-init-mask led)
+
+; Press the button at 5 ms and release it at 12 ms; send a command at 8 ms.
+(sim-input-at 5000 button button)
+(sim-input-at 12000 button 0)
+(sim-uart-at 8000 "ping")
+
+(define start (time-us))
+(dotimes (tick 20)
+   (if (& (gpio-get-all) button)
+      (gpio-set-mask led)
+      (gpio-clr-mask led))
+   (if (> (uart-read rx) 0)
+      (uart-write rx))
+   (sleep-us 1000))
+
+(print "20 ticks in " (- (time-us) start) " us\n")
+(sim-report)
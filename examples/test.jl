@@ -16,6 +16,20 @@
 
 (assert (= (fact 5) 120))
 
+; The built-in list functions, before the definitions below replace them.
+(assert (= (map (lambda (x) (* x 2)) (list 3 4)) (list 6 8)))
+(assert (null? (map (lambda (x) x) nil)))
+(assert (= (foldl + 0 (filter (lambda (x) (> x 2)) (list 1 2 3 4))) 7))
+(assert (= (foldl - 10 (list 1 2 3)) 4))
+(assert (= (reverse (list 1 2 3)) (list 3 2 1)))
+(assert (= (append (list 1 2) nil (list 3)) (list 1 2 3)))
+(assert (= (length (list 1 2 3)) 3))
+(assert (= (length nil) 0))
+(assert (= (nth 0 (list 5 4 3)) 5))
+(assert (= (nth 2 (list 5 4 3)) 3))
+(assert (= (catch (nth 3 (list 5 4 3)) 0) 0))
+(assert (= (catch (nth -1 (list 5 4 3)) 0) 0))
+
 (define length (lambda (lst)
    (if (null? lst) 0 (+ 1 (length (rest lst))))))
 
@@ -120,5 +134,169 @@
 )
 (assert (= "0123456789,0123456789,0123456789" (repeat "0123456789" 3)))
 
+(assert (= "(1 \"a\" (2 3))" (to-string (list 1 "a" (list 2 3)))))
+(assert (= "nil" (to-string nil)))
+
+(define buf (make-bytes 6))
+(bytes-pack buf 0 "u16be" 0x1234)
+(bytes-pack buf 2 "u32le" -2)
+(assert (= (bytes-ref buf 0) 0x12))
+(assert (= (list 1 (bytes 1 2)) (list 1 (bytes 1 2))))
+(assert (!= (list 1 (bytes 1 2)) (list 1 (bytes 1 3))))
+(assert (= (bytes-unpack buf 0 "u16le") 0x3412))
+(assert (= (bytes-unpack buf 2 "s32le") -2))
+(define view (bytes-slice buf 4 2))
+(bytes-set view 1 7)
+(assert (= (bytes-ref buf 5) 7))
+(assert (= view (bytes 255 7)))
+(assert (= 2 (bytes-length view)))
+(assert (= (bytes-slice (bytes-slice (bytes 1 2 3 4 5 6) 2 4) 1 2) (bytes 4 5)))
+(define rx (make-bytes 4))
+(assert (= (spi-transfer (bytes 1 2 3) rx) 3))   ; loops back on the host
+(assert (= rx (bytes 1 2 3)))
+
+(define make-adder (lambda (n) (lambda (x) (+ x n))))
+(define add5 (make-adder 5))
+(assert (= (add5 10) 15))
+(define shadow (lambda (a b) (begin (define a 7) (+ a b))))
+(assert (= (shadow 1 2) 9))
+(define add3 (lambda (a) (lambda (b) (lambda (c) (+ a b c)))))
+(assert (= (((add3 1) 2) 3) 6))
+(define bump (lambda (n) (define get (lambda () n)) (set! n (+ n 1)) (get)))
+(assert (= (bump 4) 5))
+(define bumper (lambda (n) (set! n (+ n 1)) (lambda () n)))
+(assert (= ((bumper 4)) 5))
+(define above (lambda (limit lst) (filter (lambda (x) (> x limit)) lst)))
+(assert (= (above 4 (list 1 5 9)) (list 5 9)))
+
+(define shared (list "a" (list 1 2)))
+(define extended (cons 0 shared))
+(assert (= (head (rest extended)) "a"))
+(assert (= (head (head (rest (rest extended)))) 1))
+(assert (null? (head (list nil))))
+
+(define fast-fib (memoize (lambda (n)
+   (if (> n 1) (+ (fast-fib (- n 1)) (fast-fib (- n 2))) 1))))
+(assert (= (fast-fib 25) 121393))
+(assert (= (head (memo-stats fast-fib)) 23))
+(define buf-sum (memoize (lambda (b) (+ (bytes-ref b 0) (bytes-ref b 1)))))
+(assert (= (buf-sum (bytes 1 2)) 3))
+(assert (= (buf-sum (bytes 1 2)) 3))
+(assert (= (buf-sum (bytes 2 2)) 4))
+(assert (= (memo-stats buf-sum) (list 1 2 2 64)))
+
+(define cons-was (hash-cons 1))
+(define config-a (list "led" (list 25 1)))
+(define config-b (cons "led" (list (list 25 1))))
+(assert (= config-a config-b))
+(assert (!= config-a (list "led" (list 25 0))))
+(hash-cons cons-was)
+
+(defmacro unless (c e) `(if ,c nil ,e))
+(define clamp (lambda (x) (unless (< x 0) x)))
+(assert (= (clamp 4) 4))
+(assert (null? (clamp -1)))
+(defmacro pin-map (name pin) `(define ,name (<< 1 ,pin)))
+(pin-map led-mask 5)
+(assert (= led-mask 0x20))
+(assert (= (length `(1 ,@(list 2 3) ,(+ 2 2))) 4))
+
+(define total 0)
+(dotimes (i 5) (set! total (+ total i)))
+(assert (= total 10))
+(define steps 0)
+(while (< steps 3) (set! steps (+ steps 1)))
+(assert (= steps 3))
+(assert (= (let ((a 2) (b 3)) (* a b)) 6))
+(define make-counter (lambda () (let ((n 0)) (lambda () (set! n (+ n 1))))))
+(define tick (make-counter))
+(tick)
+(assert (= (tick) 2))
+
+(assert (= (catch (/ 1 0) 5) 5))
+(assert (= (catch (+ 1 2) 5) 3))
+(assert (= (catch (head 5) (lambda (m) m)) "invalid argument to head"))
+(catch (let ((unwound 1)) (/ unwound 0)) 0)
+(assert (= (catch unwound "unbound") "unbound"))
+
+; The smallest number divided by -1 wraps (or saturates) instead of trapping
+(define smallest (- -2147483647 1))
+(assert (= (/ smallest -1) (- 0 smallest)))
+(assert (= (% smallest -1) 0))
+(assert (= (% smallest (>> -1 16)) 0))
+
+; Conversions check their base
+(assert (= (int "ff" 16) 255))
+(assert (= (str 255 16) "FF"))
+(assert (= (catch (int "zz" 99) (lambda (m) m)) "invalid argument to int"))
+(assert (= (catch (int "10" 1) 0) 0))
+(assert (= (catch (str 10 37) 0) 0))
+
+; Tail calls through let and if
+(define count-down (lambda (n)
+   (let ((m (- n 1)))
+      (if (> m 0) (count-down m) n))))
+(assert (= (count-down 1000) 1))
+
+; Recursion through natives that run code goes deeper than a few levels
+(define through-map (lambda (n)
+   (if (> n 0) (head (map through-map (list (- n 1)))) 0)))
+(assert (= (through-map 30) 0))
+(define through-while (lambda (n)
+   (define r 0)
+   (while (< r 1) (set! r (+ 1 (if (> n 0) (through-while (- n 1)) 0))))
+   r))
+(assert (= (through-while 30) 31))
+
+; Dropped structures are reclaimed by the time yield reports none pending
+(define garbage (map (lambda (x) (list x x)) (list 1 2 3 4 5)))
+(set! garbage nil)
+(while (!= (yield) 0))
+(assert (= (yield) 0))
+
+; Files that can't be read raise an error
+(assert (= (catch (load "no-such-file.jl") (lambda (m) m))
+           "cannot load no-such-file.jl"))
+(assert (= (length (load-stats)) 3))
+
+; Values survive the wire format; repeated strings are sent once
+(define sent (decode (encode (list -300 "ab" (list "ab" 7)))))
+(assert (= (head sent) -300))
+(assert (= (head (head (rest (rest sent)))) "ab"))
+(assert (< (bytes-length (encode (list "ab" "ab")))
+           (bytes-length (encode (list "ab" "ab") 0))))
+(assert (= (catch (decode (bytes 1 6)) (lambda (m) m)) "invalid encoding"))
+(assert (= (catch (decode (bytes 1 2 255 255 255 255 15)) (lambda (m) m))
+           "invalid encoding"))
+(assert (= (catch (decode (bytes 1 5 100 0)) (lambda (m) m))
+           "invalid encoding"))
+
+; Masks reach every pin whatever the number type
+(define high-pins (gpio-mask 3 25 31))
+(gpio-drive high-pins high-pins)
+(assert (= (& (gpio-get-all) high-pins) high-pins))
+(assert (= (& (gpio-get-all) (gpio-mask 25)) (gpio-mask 25)))
+(gpio-drive high-pins 0)
+
+; Time and the UART
+(define before (time-us))
+(sleep-us 200)
+(define waited (- (time-us) before))
+(assert (or (>= waited 200) (< waited 0)))  ; time-us wraps around
+(assert (= (uart-write "hi") 2))
+
+; Edge handlers run before the next step
+(define edges 0)
+(on-edge 3 "rise" (lambda (pin level time) (set! edges (+ edges pin level))))
+(define pin3 (gpio-mask 3))
+(gpio-drive pin3 pin3)
+(gpio-drive pin3 0)
+(gpio-drive pin3 pin3)
+(assert (= edges 8))
+(on-edge 3 "both" nil)
+(gpio-drive pin3 0)
+(assert (= edges 8))
+(assert (= (edge-policy) "drop-newest"))
+
 (print "\ndone\n")
 
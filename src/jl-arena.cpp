@@ -0,0 +1,166 @@
+/**
+ * @file jl-arena.cpp
+ *
+ * Fixed arena for real-time contexts.
+ * The memory after the arena header is split into the largest power-of-two
+ * blocks that fit, largest first.  A block of order k at offset o (from
+ * the base) has its buddy at o ^ 2^k; blocks past the end of the arena or
+ * of another order are never merged, so the top blocks stay apart.
+ */
+
+#include "jl-arena.h"
+
+#include <cstdint>
+#include <cstring>
+
+#define ARENA_ALIGN     8
+#define ARENA_HEADER    8        /* Bytes before the data of a block. */
+#define MIN_ORDER       5        /* Free blocks hold the header and links. */
+#define MAX_ORDERS      (sizeof(size_t) * 8)
+
+#define ALIGN_UP(x)     (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct ArenaBlock {
+   unsigned char order;
+   unsigned char free;
+   struct ArenaBlock *next;      /**< Links (only while free). */
+   struct ArenaBlock *prev;
+} ArenaBlock;
+
+static_assert(sizeof(ArenaBlock) <= ((size_t)1 << MIN_ORDER),
+              "arena blocks too small for their links");
+
+typedef struct Arena {
+   char *base;
+   size_t size;
+   ArenaBlock *lists[MAX_ORDERS];   /**< Free blocks by order. */
+} Arena;
+
+static void PushBlock(Arena *arena, ArenaBlock *block, unsigned char order);
+static void UnlinkBlock(Arena *arena, ArenaBlock *block);
+
+void PushBlock(Arena *arena, ArenaBlock *block, unsigned char order)
+{
+   block->order = order;
+   block->free = 1;
+   block->prev = NULL;
+   block->next = arena->lists[order];
+   if(block->next) {
+      block->next->prev = block;
+   }
+   arena->lists[order] = block;
+}
+
+void UnlinkBlock(Arena *arena, ArenaBlock *block)
+{
+   if(block->prev) {
+      block->prev->next = block->next;
+   } else {
+      arena->lists[block->order] = block->next;
+   }
+   if(block->next) {
+      block->next->prev = block->prev;
+   }
+   block->free = 0;
+}
+
+Arena *CreateArena(void *memory, size_t size)
+{
+   const uintptr_t start = ALIGN_UP((uintptr_t)memory);
+   const uintptr_t end = (uintptr_t)memory + size;
+   const uintptr_t base = start + ALIGN_UP(sizeof(Arena));
+   Arena *arena;
+   size_t offset = 0;
+   size_t order;
+
+   if(base >= end) {
+      return NULL;
+   }
+   arena = (Arena*)start;
+   memset(arena, 0, sizeof(Arena));
+   arena->base = (char*)base;
+   arena->size = end - base;
+   for(order = MAX_ORDERS - 1; order >= MIN_ORDER; order--) {
+      const size_t block_size = (size_t)1 << order;
+      if(arena->size - offset >= block_size) {
+         PushBlock(arena, (ArenaBlock*)(arena->base + offset),
+                   (unsigned char)order);
+         offset += block_size;
+      }
+   }
+   return offset > 0 ? arena : NULL;
+}
+
+void *ArenaAlloc(Arena *arena, size_t size)
+{
+   size_t order = MIN_ORDER;
+   size_t index;
+   ArenaBlock *block;
+
+   while(order < MAX_ORDERS && ((size_t)1 << order) - ARENA_HEADER < size) {
+      order += 1;
+   }
+   for(index = order; index < MAX_ORDERS && !arena->lists[index]; index++);
+   if(index >= MAX_ORDERS) {
+      return NULL;
+   }
+
+   /* Split down to size, keeping the upper halves. */
+   block = arena->lists[index];
+   UnlinkBlock(arena, block);
+   while(index > order) {
+      index -= 1;
+      PushBlock(arena, (ArenaBlock*)((char*)block + ((size_t)1 << index)),
+                (unsigned char)index);
+   }
+   block->order = (unsigned char)order;
+   return (char*)block + ARENA_HEADER;
+}
+
+void *ArenaResize(Arena *arena, void *ptr, size_t size)
+{
+   size_t capacity;
+   void *result;
+
+   if(ptr == NULL) {
+      return ArenaAlloc(arena, size);
+   }
+   capacity = ((size_t)1 << ((ArenaBlock*)((char*)ptr - ARENA_HEADER))->order)
+            - ARENA_HEADER;
+   if(size <= capacity) {
+      return ptr;
+   }
+   result = ArenaAlloc(arena, size);
+   if(result) {
+      memcpy(result, ptr, capacity);
+      ArenaFree(arena, ptr);
+   }
+   return result;
+}
+
+void ArenaFree(Arena *arena, void *ptr)
+{
+   ArenaBlock *block;
+   size_t order;
+
+   if(ptr == NULL) {
+      return;
+   }
+   block = (ArenaBlock*)((char*)ptr - ARENA_HEADER);
+   order = block->order;
+   while(order + 1 < MAX_ORDERS) {
+      const size_t block_size = (size_t)1 << order;
+      const size_t offset = (size_t)((char*)block - arena->base) ^ block_size;
+      ArenaBlock *buddy = (ArenaBlock*)(arena->base + offset);
+      if(offset + block_size > arena->size ||
+         !buddy->free || buddy->order != order) {
+         break;
+      }
+      UnlinkBlock(arena, buddy);
+      if(buddy < block) {
+         block = buddy;
+      }
+      order += 1;
+   }
+   PushBlock(arena, block, (unsigned char)order);
+}
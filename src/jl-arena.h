@@ -0,0 +1,28 @@
+/**
+ * @file jl-arena.h
+ *
+ * Fixed arena for real-time contexts.
+ * A binary buddy allocator: blocks are powers of two that are split on
+ * allocation and merged with their buddy on release, so both take at most
+ * one step per size class and never call malloc.
+ */
+
+#ifndef JL_ARENA_H
+#define JL_ARENA_H
+
+#include <stddef.h>
+
+struct Arena;
+
+/** Set up an arena in memory; returns NULL if it is too small. */
+struct Arena *CreateArena(void *memory, size_t size);
+
+/** Allocate from an arena; returns NULL if no block is big enough. */
+void *ArenaAlloc(struct Arena *arena, size_t size);
+
+/** Resize an allocation; returns NULL (leaving ptr alone) on failure. */
+void *ArenaResize(struct Arena *arena, void *ptr, size_t size);
+
+void ArenaFree(struct Arena *arena, void *ptr);
+
+#endif /* JL_ARENA_H */
@@ -0,0 +1,290 @@
+/**
+ * @file jl-bus.cpp
+ *
+ * Bus transfers on byte buffers.
+ */
+
+#ifdef RP2040
+#include <pico/stdlib.h>
+#include <hardware/spi.h>
+#include <hardware/uart.h>
+#endif
+
+#include "jl.h"
+#include "jl-bus.h"
+#include "jl-bytes.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-number.h"
+#include "jl-sim.h"
+
+#include <cstring>
+
+/* The UART for uart-write and uart-read; stdio has the default one. */
+#ifdef RP2040
+#ifndef JL_UART
+#define JL_UART            uart1
+#define JL_UART_TX_PIN     4
+#define JL_UART_RX_PIN     5
+#endif
+#endif
+
+#ifndef JL_UART_BAUD
+#define JL_UART_BAUD       115200
+#endif
+
+static void Transfer(const unsigned char *tx, unsigned char *rx, size_t len);
+static void WriteUart(const unsigned char *data, size_t len);
+static size_t ReadUart(unsigned char *data, size_t len);
+
+static JLValue *SpiInitFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *SpiTransferFunc(JLContext *context, JLValue *args,
+                                void *extra);
+static JLValue *UartInitFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *UartWriteFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *UartReadFunc(JLContext *context, JLValue *args, void *extra);
+
+static constexpr InternalFunctionNode BUS_FUNCTIONS[] = {
+   { "spi-init",     SpiInitFunc,     JLEVAL_STRICT },
+   { "spi-transfer", SpiTransferFunc, JLEVAL_STRICT },
+   { "uart-init",    UartInitFunc,    JLEVAL_STRICT },
+   { "uart-write",   UartWriteFunc,   JLEVAL_STRICT },
+   { "uart-read",    UartReadFunc,    JLEVAL_STRICT }
+};
+DEFINE_BUILTIN_TABLE(BUS_TABLE, BUS_FUNCTIONS)
+
+#ifdef RP2040
+
+void Transfer(const unsigned char *tx, unsigned char *rx, size_t len)
+{
+   if(rx) {
+      spi_write_read_blocking(spi_default, tx, rx, len);
+   } else {
+      spi_write_blocking(spi_default, tx, len);
+   }
+}
+
+void WriteUart(const unsigned char *data, size_t len)
+{
+   uart_write_blocking(JL_UART, data, len);
+}
+
+size_t ReadUart(unsigned char *data, size_t len)
+{
+   size_t count = 0;
+   while(count < len && uart_is_readable(JL_UART)) {
+      data[count++] = (unsigned char)uart_getc(JL_UART);
+   }
+   return count;
+}
+
+#else
+
+static unsigned long uart_baud = JL_UART_BAUD;
+static unsigned char uart_rx[UART_RX_SIZE];
+static size_t uart_rx_start = 0;
+static size_t uart_rx_count = 0;
+
+void Transfer(const unsigned char *tx, unsigned char *rx, size_t len)
+{
+   if(rx) {
+      memmove(rx, tx, len);
+   }
+}
+
+void ReceiveUart(const unsigned char *data, size_t len)
+{
+   size_t i;
+   for(i = 0; i < len && uart_rx_count < UART_RX_SIZE; i++) {
+      uart_rx[(uart_rx_start + uart_rx_count) % UART_RX_SIZE] = data[i];
+      uart_rx_count += 1;
+   }
+}
+
+void WriteUart(const unsigned char *data, size_t len)
+{
+#ifdef JL_SIMULATOR
+   SimUartWrite(data, len, uart_baud);
+#else
+   ReceiveUart(data, len);
+#endif
+}
+
+size_t ReadUart(unsigned char *data, size_t len)
+{
+   size_t count = 0;
+   while(count < len && uart_rx_count > 0) {
+      data[count++] = uart_rx[uart_rx_start];
+      uart_rx_start = (uart_rx_start + 1) % UART_RX_SIZE;
+      uart_rx_count -= 1;
+   }
+   return count;
+}
+
+#endif /* RP2040 */
+
+JLValue *SpiInitFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   arg = JLEvaluate(context, args->next);
+   if(arg == NULL || arg->tag != JLVALUE_NUMBER) {
+      JLRelease(context, arg);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+#ifdef RP2040
+   spi_init(spi_default, (uint)Number::ToInt(arg->value.number));
+   gpio_set_function(PICO_DEFAULT_SPI_RX_PIN, GPIO_FUNC_SPI);
+   gpio_set_function(PICO_DEFAULT_SPI_SCK_PIN, GPIO_FUNC_SPI);
+   gpio_set_function(PICO_DEFAULT_SPI_TX_PIN, GPIO_FUNC_SPI);
+#endif
+   JLRelease(context, arg);
+   return NULL;
+}
+
+JLValue *SpiTransferFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *tx = NULL;
+   JLValue *rx = NULL;
+   JLValue *result = NULL;
+   size_t len;
+
+   /* (spi-transfer tx [rx]): send tx and receive into rx in place. */
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next && args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   PushRelease(context, &tx);
+   PushRelease(context, &rx);
+   tx = JLEvaluate(context, args->next);
+   if(tx == NULL || tx->tag != JLVALUE_BYTES) {
+      InvalidArgumentError(context, args);
+      goto transfer_done;
+   }
+   len = tx->value.bytes->length;
+   if(args->next->next) {
+      rx = JLEvaluate(context, args->next->next);
+      if(rx == NULL || rx->tag != JLVALUE_BYTES) {
+         InvalidArgumentError(context, args);
+         goto transfer_done;
+      }
+      if(rx->value.bytes->capacity < len) {
+         len = rx->value.bytes->capacity;
+      }
+      rx->value.bytes->length = len;
+   }
+
+   Transfer(tx->value.bytes->data, rx ? rx->value.bytes->data : NULL, len);
+   result = JLDefineNumber(context, NULL, Number::FromInt(len));
+
+transfer_done:
+
+   JLRelease(context, tx);
+   JLRelease(context, rx);
+   return result;
+}
+
+JLValue *UartInitFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   arg = JLEvaluate(context, args->next);
+   if(arg == NULL || arg->tag != JLVALUE_NUMBER ||
+      Number::ToInt(arg->value.number) <= 0) {
+      JLRelease(context, arg);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+#ifdef RP2040
+   uart_init(JL_UART, (uint)Number::ToInt(arg->value.number));
+   gpio_set_function(JL_UART_TX_PIN, GPIO_FUNC_UART);
+   gpio_set_function(JL_UART_RX_PIN, GPIO_FUNC_UART);
+#else
+   uart_baud = (unsigned long)Number::ToInt(arg->value.number);
+#endif
+   JLRelease(context, arg);
+   return NULL;
+}
+
+JLValue *UartWriteFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   size_t len;
+
+   /* (uart-write data): send a buffer or string. */
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   arg = JLEvaluate(context, args->next);
+   if(arg && arg->tag == JLVALUE_BYTES) {
+      len = arg->value.bytes->length;
+      WriteUart(arg->value.bytes->data, len);
+   } else if(arg && arg->tag == JLVALUE_STRING) {
+      len = strlen(arg->value.str);
+      WriteUart((const unsigned char*)arg->value.str, len);
+   } else {
+      JLRelease(context, arg);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   JLRelease(context, arg);
+   return JLDefineNumber(context, NULL, Number::FromInt(len));
+}
+
+JLValue *UartReadFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *rx;
+   size_t len;
+
+   /* (uart-read rx): receive what is waiting into rx in place. */
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   rx = JLEvaluate(context, args->next);
+   if(rx == NULL || rx->tag != JLVALUE_BYTES) {
+      JLRelease(context, rx);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   len = ReadUart(rx->value.bytes->data, rx->value.bytes->capacity);
+   rx->value.bytes->length = len;
+   JLRelease(context, rx);
+   return JLDefineNumber(context, NULL, Number::FromInt(len));
+}
+
+void RegisterBusFunctions(JLContext *context)
+{
+   RegisterBuiltins(context, &BUS_TABLE);
+}
@@ -0,0 +1,30 @@
+/**
+ * @file jl-bus.h
+ *
+ * Bus transfers on byte buffers.
+ * Host builds use a loopback bus: received data echoes what was sent.
+ * The same goes for the UART, except in simulator builds, where its
+ * input comes from scripted events (see jl-sim.h).
+ */
+
+#ifndef JL_BUS_H
+#define JL_BUS_H
+
+#include <stddef.h>
+
+struct JLContext;
+
+#ifndef RP2040
+
+#define UART_RX_SIZE 256
+
+/** Queue data as if received on the UART.
+ * Data that does not fit in the receive buffer is dropped.
+ */
+void ReceiveUart(const unsigned char *data, size_t len);
+
+#endif /* RP2040 */
+
+void RegisterBusFunctions(struct JLContext *context);
+
+#endif /* JL_BUS_H */
@@ -0,0 +1,556 @@
+/**
+ * @file jl-bytes.cpp
+ *
+ * Mutable byte buffers.
+ */
+
+#include "jl.h"
+#include "jl-bytes.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-number.h"
+
+#include <cstdlib>
+#include <cstring>
+
+static char ParseFormat(const char *fmt, unsigned *size,
+                        char *big, char *sign);
+static JLValue *EvaluateBytes(JLContext *context, JLValue *args,
+                              JLValue *vp);
+static char EvaluateIndex(JLContext *context, JLValue *args, JLValue *vp,
+                          size_t limit, size_t *index);
+static void RangeError(JLContext *context, JLValue *args);
+
+static JLValue *BytesFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *MakeBytesFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *IsBytesFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *BytesLengthFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *BytesCapacityFunc(JLContext *context, JLValue *args,
+                                  void *extra);
+static JLValue *BytesResizeFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *BytesRefFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *BytesSetFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *BytesSliceFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *BytesUnpackFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *BytesPackFunc(JLContext *context, JLValue *args, void *extra);
+
+static constexpr InternalFunctionNode BYTES_FUNCTIONS[] = {
+   { "bytes",          BytesFunc,         JLEVAL_STRICT },
+   { "make-bytes",     MakeBytesFunc,     JLEVAL_STRICT },
+   { "bytes?",         IsBytesFunc,       JLEVAL_STRICT },
+   { "bytes-length",   BytesLengthFunc,   JLEVAL_STRICT },
+   { "bytes-capacity", BytesCapacityFunc, JLEVAL_STRICT },
+   { "bytes-resize",   BytesResizeFunc,   JLEVAL_STRICT },
+   { "bytes-ref",      BytesRefFunc,      JLEVAL_STRICT },
+   { "bytes-set",      BytesSetFunc,      JLEVAL_STRICT },
+   { "bytes-slice",    BytesSliceFunc,    JLEVAL_STRICT },
+   { "bytes-unpack",   BytesUnpackFunc,   JLEVAL_STRICT },
+   { "bytes-pack",     BytesPackFunc,     JLEVAL_STRICT }
+};
+DEFINE_BUILTIN_TABLE(BYTES_TABLE, BYTES_FUNCTIONS)
+
+ByteBuffer *CreateByteBuffer(JLContext *context, size_t capacity)
+{
+   ByteBuffer *buffer = (ByteBuffer*)AllocMemory(context, sizeof(ByteBuffer)
+                                                          + capacity);
+   buffer->base = NULL;
+   buffer->data = (unsigned char*)(buffer + 1);
+   buffer->length = capacity;
+   buffer->capacity = capacity;
+   buffer->count = 1;
+   memset(buffer->data, 0, capacity);
+   return buffer;
+}
+
+ByteBuffer *CreateByteSlice(JLContext *context, ByteBuffer *base,
+                            size_t start, size_t len)
+{
+   ByteBuffer *buffer = (ByteBuffer*)AllocMemory(context, sizeof(ByteBuffer));
+   buffer->data = &base->data[start];
+   if(base->base) {
+      /* Always point at the owner so slices don't chain. */
+      base = base->base;
+   }
+   base->count += 1;
+   buffer->base = base;
+   buffer->length = len;
+   buffer->capacity = len;
+   buffer->count = 1;
+   return buffer;
+}
+
+void ReleaseByteBuffer(JLContext *context, ByteBuffer *buffer)
+{
+   buffer->count -= 1;
+   if(buffer->count == 0) {
+      if(buffer->base) {
+         ReleaseByteBuffer(context, buffer->base);
+      }
+      FreeMemory(context, buffer);
+   }
+}
+
+char ParseFormat(const char *fmt, unsigned *size, char *big, char *sign)
+{
+   /* Formats are u8, s8 or [us](16|32)(le|be). */
+   if(fmt[0] != 'u' && fmt[0] != 's') {
+      return 0;
+   }
+   *sign = fmt[0] == 's';
+   *big = 0;
+   if(!strcmp(&fmt[1], "8")) {
+      *size = 1;
+      return 1;
+   } else if(!strncmp(&fmt[1], "16", 2)) {
+      *size = 2;
+   } else if(!strncmp(&fmt[1], "32", 2)) {
+      *size = 4;
+   } else {
+      return 0;
+   }
+   if(!strcmp(&fmt[3], "be")) {
+      *big = 1;
+      return 1;
+   }
+   return !strcmp(&fmt[3], "le");
+}
+
+void RangeError(JLContext *context, JLValue *args)
+{
+   Error(context, "index out of range in %s", args->value.str);
+}
+
+JLValue *EvaluateBytes(JLContext *context, JLValue *args, JLValue *vp)
+{
+   JLValue *result = JLEvaluate(context, vp);
+   if(result == NULL || result->tag != JLVALUE_BYTES) {
+      JLRelease(context, result);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   return result;
+}
+
+char EvaluateIndex(JLContext *context, JLValue *args, JLValue *vp,
+                   size_t limit, size_t *index)
+{
+   JLValue *arg = JLEvaluate(context, vp);
+   long long value;
+   if(arg == NULL || arg->tag != JLVALUE_NUMBER) {
+      JLRelease(context, arg);
+      InvalidArgumentError(context, args);
+      return 0;
+   }
+   value = Number::ToInt(arg->value.number);
+   JLRelease(context, arg);
+   if(value < 0 || (unsigned long long)value > limit) {
+      RangeError(context, args);
+      return 0;
+   }
+   *index = (size_t)value;
+   return 1;
+}
+
+JLValue *BytesFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *result;
+   JLValue *vp;
+   size_t count = 0;
+   size_t i = 0;
+
+   for(vp = args->next; vp; vp = vp->next) {
+      count += 1;
+   }
+   result = JLCreateBytes(context, count);
+   PushRelease(context, &result);
+   for(vp = args->next; vp; vp = vp->next) {
+      JLValue *arg = JLEvaluate(context, vp);
+      if(arg == NULL || arg->tag != JLVALUE_NUMBER) {
+         JLRelease(context, arg);
+         InvalidArgumentError(context, args);
+         return NULL;
+      }
+      result->value.bytes->data[i++]
+         = (unsigned char)Number::ToInt(arg->value.number);
+      JLRelease(context, arg);
+   }
+   return result;
+}
+
+JLValue *MakeBytesFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *result;
+   size_t capacity;
+   size_t len;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next && args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   if(!EvaluateIndex(context, args, args->next, (size_t)-1 >> 1,
+                     &capacity)) {
+      return NULL;
+   }
+   len = capacity;
+   if(args->next->next &&
+      !EvaluateIndex(context, args, args->next->next, capacity, &len)) {
+      return NULL;
+   }
+   result = JLCreateBytes(context, capacity);
+   result->value.bytes->length = len;
+   return result;
+}
+
+JLValue *IsBytesFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg = NULL;
+   JLValue *result = NULL;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   arg = JLEvaluate(context, args->next);
+   if(arg && arg->tag == JLVALUE_BYTES) {
+      result = JLDefineNumber(context, NULL, Number::FromInt(1));
+   }
+   JLRelease(context, arg);
+   return result;
+}
+
+JLValue *BytesLengthFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   JLValue *result;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   arg = EvaluateBytes(context, args, args->next);
+   if(arg == NULL) {
+      return NULL;
+   }
+   result = JLDefineNumber(context, NULL,
+                           Number::FromInt(arg->value.bytes->length));
+   JLRelease(context, arg);
+   return result;
+}
+
+JLValue *BytesCapacityFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   JLValue *result;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   arg = EvaluateBytes(context, args, args->next);
+   if(arg == NULL) {
+      return NULL;
+   }
+   result = JLDefineNumber(context, NULL,
+                           Number::FromInt(arg->value.bytes->capacity));
+   JLRelease(context, arg);
+   return result;
+}
+
+JLValue *BytesResizeFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   size_t len;
+
+   if(args->next == NULL || args->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   arg = EvaluateBytes(context, args, args->next);
+   if(arg == NULL) {
+      return NULL;
+   }
+   PushRelease(context, &arg);
+   if(!EvaluateIndex(context, args, args->next->next,
+                     arg->value.bytes->capacity, &len)) {
+      JLRelease(context, arg);
+      return NULL;
+   }
+   arg->value.bytes->length = len;
+   return arg;
+}
+
+JLValue *BytesRefFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   JLValue *result = NULL;
+   size_t index;
+
+   if(args->next == NULL || args->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   arg = EvaluateBytes(context, args, args->next);
+   if(arg == NULL) {
+      return NULL;
+   }
+   PushRelease(context, &arg);
+   if(EvaluateIndex(context, args, args->next->next,
+                    arg->value.bytes->length, &index)) {
+      if(index < arg->value.bytes->length) {
+         result = JLDefineNumber(context, NULL,
+                                 Number::FromInt(arg->value.bytes->data[index]));
+      } else {
+         RangeError(context, args);
+      }
+   }
+   JLRelease(context, arg);
+   return result;
+}
+
+JLValue *BytesSetFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   JLValue *value = NULL;
+   size_t index;
+
+   if(args->next == NULL || args->next->next == NULL ||
+      args->next->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   arg = EvaluateBytes(context, args, args->next);
+   if(arg == NULL) {
+      return NULL;
+   }
+   PushRelease(context, &arg);
+   PushRelease(context, &value);
+   if(!EvaluateIndex(context, args, args->next->next,
+                     arg->value.bytes->length, &index)) {
+      goto set_done;
+   }
+   if(index >= arg->value.bytes->length) {
+      RangeError(context, args);
+      goto set_done;
+   }
+   value = JLEvaluate(context, args->next->next->next);
+   if(value == NULL || value->tag != JLVALUE_NUMBER) {
+      InvalidArgumentError(context, args);
+      goto set_done;
+   }
+   arg->value.bytes->data[index] = (unsigned char)Number::ToInt(value->value.number);
+
+set_done:
+
+   JLRelease(context, arg);
+   JLRelease(context, value);
+   return NULL;
+}
+
+JLValue *BytesSliceFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   JLValue *result = NULL;
+   size_t start;
+   size_t len;
+
+   if(args->next == NULL || args->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next && args->next->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   arg = EvaluateBytes(context, args, args->next);
+   if(arg == NULL) {
+      return NULL;
+   }
+   PushRelease(context, &arg);
+   if(!EvaluateIndex(context, args, args->next->next,
+                     arg->value.bytes->length, &start)) {
+      goto slice_done;
+   }
+   len = arg->value.bytes->length - start;
+   if(args->next->next->next &&
+      !EvaluateIndex(context, args, args->next->next->next, len, &len)) {
+      goto slice_done;
+   }
+   result = CreateValue(context, NULL, JLVALUE_BYTES);
+   result->value.bytes = CreateByteSlice(context, arg->value.bytes, start,
+                                         len);
+
+slice_done:
+
+   JLRelease(context, arg);
+   return result;
+}
+
+JLValue *BytesUnpackFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   JLValue *fmt = NULL;
+   JLValue *result = NULL;
+   const unsigned char *data;
+   unsigned size;
+   char big;
+   char sign;
+   size_t offset;
+   uint32_t value = 0;
+   unsigned i;
+
+   if(args->next == NULL || args->next->next == NULL ||
+      args->next->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   arg = EvaluateBytes(context, args, args->next);
+   if(arg == NULL) {
+      return NULL;
+   }
+   PushRelease(context, &arg);
+   PushRelease(context, &fmt);
+   if(!EvaluateIndex(context, args, args->next->next,
+                     arg->value.bytes->length, &offset)) {
+      goto unpack_done;
+   }
+   fmt = JLEvaluate(context, args->next->next->next);
+   if(fmt == NULL || fmt->tag != JLVALUE_STRING ||
+      !ParseFormat(fmt->value.str, &size, &big, &sign)) {
+      InvalidArgumentError(context, args);
+      goto unpack_done;
+   }
+   if(offset + size > arg->value.bytes->length) {
+      RangeError(context, args);
+      goto unpack_done;
+   }
+
+   data = &arg->value.bytes->data[offset];
+   for(i = 0; i < size; i++) {
+      const unsigned shift = big ? (size - i - 1) * 8 : i * 8;
+      value |= (uint32_t)data[i] << shift;
+   }
+   if(sign && size < 4 && (value & (1u << (size * 8 - 1)))) {
+      value |= ~0u << (size * 8);
+   }
+   result = JLDefineNumber(context, NULL, Number::FromInt(
+      sign ? (long long)(int32_t)value : (long long)value));
+
+unpack_done:
+
+   JLRelease(context, arg);
+   JLRelease(context, fmt);
+   return result;
+}
+
+JLValue *BytesPackFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   JLValue *fmt = NULL;
+   JLValue *num = NULL;
+   unsigned char *data;
+   unsigned size;
+   char big;
+   char sign;
+   size_t offset;
+   uint32_t value;
+   unsigned i;
+
+   if(args->next == NULL || args->next->next == NULL ||
+      args->next->next->next == NULL ||
+      args->next->next->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   arg = EvaluateBytes(context, args, args->next);
+   if(arg == NULL) {
+      return NULL;
+   }
+   PushRelease(context, &arg);
+   PushRelease(context, &fmt);
+   PushRelease(context, &num);
+   if(!EvaluateIndex(context, args, args->next->next,
+                     arg->value.bytes->length, &offset)) {
+      goto pack_done;
+   }
+   fmt = JLEvaluate(context, args->next->next->next);
+   if(fmt == NULL || fmt->tag != JLVALUE_STRING ||
+      !ParseFormat(fmt->value.str, &size, &big, &sign)) {
+      InvalidArgumentError(context, args);
+      goto pack_done;
+   }
+   num = JLEvaluate(context, args->next->next->next->next);
+   if(num == NULL || num->tag != JLVALUE_NUMBER) {
+      InvalidArgumentError(context, args);
+      goto pack_done;
+   }
+   if(offset + size > arg->value.bytes->length) {
+      RangeError(context, args);
+      goto pack_done;
+   }
+
+   value = (uint32_t)Number::ToInt(num->value.number);
+   data = &arg->value.bytes->data[offset];
+   for(i = 0; i < size; i++) {
+      const unsigned shift = big ? (size - i - 1) * 8 : i * 8;
+      data[i] = (unsigned char)(value >> shift);
+   }
+
+pack_done:
+
+   JLRelease(context, arg);
+   JLRelease(context, fmt);
+   JLRelease(context, num);
+   return NULL;
+}
+
+void RegisterBytesFunctions(JLContext *context)
+{
+   RegisterBuiltins(context, &BYTES_TABLE);
+}
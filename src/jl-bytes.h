@@ -0,0 +1,34 @@
+/**
+ * @file jl-bytes.h
+ *
+ * Mutable byte buffers.
+ */
+
+#ifndef JL_BYTES_H
+#define JL_BYTES_H
+
+#include <stddef.h>
+
+struct JLContext;
+
+/** Storage for a byte buffer.
+ * Slices share the data of their base buffer.
+ */
+typedef struct ByteBuffer {
+   struct ByteBuffer *base;   /**< Owner of the data (NULL if this). */
+   unsigned char *data;
+   size_t length;
+   size_t capacity;
+   unsigned int count;
+} ByteBuffer;
+
+ByteBuffer *CreateByteBuffer(struct JLContext *context, size_t capacity);
+
+ByteBuffer *CreateByteSlice(struct JLContext *context, ByteBuffer *base,
+                            size_t start, size_t len);
+
+void ReleaseByteBuffer(struct JLContext *context, ByteBuffer *buffer);
+
+void RegisterBytesFunctions(struct JLContext *context);
+
+#endif /* JL_BYTES_H */
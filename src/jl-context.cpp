@@ -3,76 +3,609 @@
  * @author Joe Wingbermuehle
  */
 
+#ifdef RP2040
+#include <pico/time.h>
+#else
+#include <time.h>
+#include <errno.h>
+#endif
+
 #include "jl.h"
 #include "jl-context.h"
 #include "jl-scope.h"
 #include "jl-value.h"
+#include "jl-eval.h"
+#include "jl-profile.h"
+#include "jl-arena.h"
+#include "jl-reclaim.h"
 
 #include <stdio.h>
 #include <cstdlib>
 #include <cstdarg>
+#include <cstring>
 
-#define BLOCK_SIZE   8192
+/* Values and scope nodes are kept in separate pools so neither is
+ * padded out to the size of the other. */
+#define VALUE_BLOCK_SIZE   8192
+#define SCOPE_BLOCK_SIZE   1024
 
 typedef struct FreeNode {
    union {
-      BindingNode        binding;
-      ScopeNode          scope;
       JLValue            value;
       struct FreeNode   *next;
    };
 } FreeNode;
 
+typedef struct FreeScopeNode {
+   union {
+      BindingNode             binding;
+      ScopeNode               scope;
+      struct FreeScopeNode   *next;
+   };
+} FreeScopeNode;
+
+/** Header for a block of pool nodes (the nodes follow). */
 typedef struct BlockNode {
-   FreeNode nodes[BLOCK_SIZE];
-   struct BlockNode *next;
+   union {
+      struct BlockNode *next;
+      long long align;
+   };
 } BlockNode;
 
-void *GetFree(JLContext *context)
+/* Scope nodes reserved for each value node in a real-time context. */
+#define POOL_SCOPE_RATIO   4
+
+#define ALIGN_POOL(x)      (((x) + 7) & ~(size_t)7)
+
+[[noreturn]] static void OutOfMemory(JLContext *context);
+
+void OutOfMemory(JLContext *context)
 {
-   FreeNode *node;
-   if(context->freelist == NULL) {
-      BlockNode *block = (BlockNode*)malloc(sizeof(BlockNode));
+   Error(context, "out of memory");
+   /* Outside an evaluation there is nowhere to unwind to. */
+   abort();
+}
+
+static char Reclaim(JLContext *context);
+
+char Reclaim(JLContext *context)
+{
+#if defined(JL_BACKGROUND_RELEASE)
+   if(context->pending_count > 0 || WaitReclaimer(context)) {
+      JLDrainReleases(context, 0);
+      return 1;
+   }
+#elif defined(JL_DEFERRED_RELEASE)
+   if(context->pending_count > 0) {
+      JLDrainReleases(context, 0);
+      return 1;
+   }
+#endif
+   return 0;
+}
+
+void *AllocMemory(JLContext *context, size_t size)
+{
+   void *ptr = context->arena ? ArenaAlloc(context->arena, size)
+                              : malloc(size);
+   if(ptr == NULL && size > 0 && Reclaim(context)) {
+      return AllocMemory(context, size);
+   }
+   if(ptr == NULL && size > 0) {
+      OutOfMemory(context);
+   }
+   return ptr;
+}
+
+void *AllocZeroed(JLContext *context, size_t count, size_t size)
+{
+   void *ptr = AllocMemory(context, count * size);
+   memset(ptr, 0, count * size);
+   return ptr;
+}
+
+void *ResizeMemory(JLContext *context, void *ptr, size_t size)
+{
+   void *result = context->arena ? ArenaResize(context->arena, ptr, size)
+                                 : realloc(ptr, size);
+   if(result == NULL && size > 0 && Reclaim(context)) {
+      return ResizeMemory(context, ptr, size);
+   }
+   if(result == NULL && size > 0) {
+      OutOfMemory(context);
+   }
+   return result;
+}
+
+void FreeMemory(JLContext *context, void *ptr)
+{
+   if(context->arena) {
+      ArenaFree(context->arena, ptr);
+   } else {
+      free(ptr);
+   }
+}
+
+char *CopyString(JLContext *context, const char *str)
+{
+   const size_t len = strlen(str) + 1;
+   char *result = (char*)AllocMemory(context, len);
+   memcpy(result, str, len);
+   return result;
+}
+
+template<typename T, size_t COUNT>
+static T *GetPoolNode(JLContext *context, T **freelist, BlockNode **blocks)
+{
+   T *node;
+#ifdef JL_DEFERRED_RELEASE
+   if(*freelist == NULL) {
+      /* Reclaim before growing (all of it if the pool can't grow). */
+      JLDrainReleases(context, context->arena ? 0 : JL_RELEASE_SLICE);
+   }
+#endif
+   if(*freelist == NULL) {
+      BlockNode *block;
+      T *nodes;
       size_t i;
-      block->next = context->blocks;
-      context->blocks = block;
-      for(i = 1; i < BLOCK_SIZE; i++) {
-         block->nodes[i].next = context->freelist;
-         context->freelist = &block->nodes[i];
+      if(context->arena) {
+         /* Real-time pools are reserved up front and never grow. */
+         OutOfMemory(context);
+      }
+#ifdef JL_HEAP_PROFILE
+      /* Nodes not handed out yet must read as free. */
+      block = (BlockNode*)AllocZeroed(context, 1, sizeof(BlockNode)
+                                                  + COUNT * sizeof(T));
+#else
+      block = (BlockNode*)AllocMemory(context, sizeof(BlockNode)
+                                               + COUNT * sizeof(T));
+#endif
+      nodes = (T*)(block + 1);
+      block->next = *blocks;
+      *blocks = block;
+      for(i = 1; i < COUNT; i++) {
+         nodes[i].next = *freelist;
+         *freelist = &nodes[i];
       }
-      node = &block->nodes[0];
+      node = &nodes[0];
    } else {
-      node = context->freelist;
-      context->freelist = node->next;
+      node = *freelist;
+      *freelist = node->next;
    }
    return node;
 }
 
+template<typename T>
+static void PutPoolNode(T **freelist, void *value)
+{
+   T *temp = (T*)value;
+   temp->next = *freelist;
+   *freelist = temp;
+}
+
+template<typename T>
+static void FillPool(T **freelist, T *nodes, size_t count)
+{
+   size_t i;
+#ifdef JL_HEAP_PROFILE
+   memset(nodes, 0, count * sizeof(T));
+#endif
+   for(i = count; i > 0; i--) {
+      nodes[i - 1].next = *freelist;
+      *freelist = &nodes[i - 1];
+   }
+}
+
+static void FreeBlocks(JLContext *context, BlockNode **blocks)
+{
+   while(*blocks) {
+      BlockNode *next = (*blocks)->next;
+      FreeMemory(context, *blocks);
+      *blocks = next;
+   }
+}
+
+size_t GetPoolBytes(size_t values)
+{
+   return ALIGN_POOL(values * sizeof(FreeNode))
+        + values / POOL_SCOPE_RATIO * sizeof(FreeScopeNode);
+}
+
+void ReservePools(JLContext *context, void *memory, size_t values)
+{
+   FreeNode *nodes = (FreeNode*)memory;
+   FreeScopeNode *scopes = (FreeScopeNode*)((char*)memory
+      + ALIGN_POOL(values * sizeof(FreeNode)));
+   FillPool(&context->freelist, nodes, values);
+   FillPool(&context->scope_freelist, scopes, values / POOL_SCOPE_RATIO);
+   context->pool = nodes;
+   context->pool_size = values;
+}
+
+void *GetFree(JLContext *context)
+{
+   FreeNode *node = GetPoolNode<FreeNode, VALUE_BLOCK_SIZE>(
+      context, &context->freelist, &context->blocks);
+#ifdef JL_HEAP_PROFILE
+   node->value.site = GetHeapSite(context);
+#endif
+   return node;
+}
+
 void PutFree(JLContext *context, void *value)
 {
-   FreeNode *temp = (FreeNode*)value;
-   temp->next = context->freelist;
-   context->freelist = temp;
+#ifdef JL_HEAP_PROFILE
+   ((JLValue*)value)->site = 0;
+#endif
+   PutPoolNode(&context->freelist, value);
+}
+
+#ifdef JL_BACKGROUND_RELEASE
+void *ChainFree(void *value, void *chain)
+{
+   FreeNode *node = (FreeNode*)value;
+#ifdef JL_HEAP_PROFILE
+   node->value.site = 0;
+#endif
+   node->next = (FreeNode*)chain;
+   return node;
+}
+
+void PutFreeChain(JLContext *context, void *first, void *last)
+{
+   ((FreeNode*)last)->next = context->freelist;
+   context->freelist = (FreeNode*)first;
+}
+#endif
+
+#ifdef JL_HEAP_PROFILE
+void ForEachValue(JLContext *context, void (*func)(JLValue*, void*),
+                  void *arg)
+{
+   BlockNode *block;
+   size_t i;
+   for(block = context->blocks; block; block = block->next) {
+      FreeNode *nodes = (FreeNode*)(block + 1);
+      for(i = 0; i < VALUE_BLOCK_SIZE; i++) {
+         if(nodes[i].value.site) {
+            (func)(&nodes[i].value, arg);
+         }
+      }
+   }
+   for(i = 0; i < context->pool_size; i++) {
+      if(context->pool[i].value.site) {
+         (func)(&context->pool[i].value, arg);
+      }
+   }
+}
+#endif
+
+void *GetFreeScope(JLContext *context)
+{
+   return GetPoolNode<FreeScopeNode, SCOPE_BLOCK_SIZE>(
+      context, &context->scope_freelist, &context->scope_blocks);
+}
+
+void PutFreeScope(JLContext *context, void *node)
+{
+   PutPoolNode(&context->scope_freelist, node);
+}
+
+unsigned int AddSpecial(JLContext *context, JLFunction func, void *extra,
+                        unsigned char eval)
+{
+   if(context->special_count == context->special_size) {
+      const unsigned int size = context->special_size ?
+                                context->special_size * 2 : 64;
+      context->specials = (SpecialFunction*)ResizeMemory(context,
+         context->specials, size * sizeof(SpecialFunction));
+      context->special_size = size;
+   }
+   context->specials[context->special_count].func = func;
+   context->specials[context->special_count].extra = extra;
+   context->specials[context->special_count].eval = eval;
+   context->special_count += 1;
+   return context->special_count - 1;
 }
 
 void FreeContext(JLContext *context)
 {
-   while(context->blocks) {
-      BlockNode *next = context->blocks->next;
-      free(context->blocks);
-      context->blocks = next;
+   FreeBlocks(context, &context->blocks);
+   FreeBlocks(context, &context->scope_blocks);
+   FreeMemory(context, context->specials);
+   FreeMemory(context, context->unwind);
+#ifdef JL_DEFERRED_RELEASE
+   FreeMemory(context, context->pending);
+#endif
+#ifdef JL_STACKLESS
+   FreeMemory(context, context->eval_stack);
+#endif
+   if(context->arena == NULL) {
+      /* A real-time context lives in memory owned by the caller. */
+      free(context);
    }
-   free(context);
+}
+
+static void WriteStdout(void *arg, const char *data, size_t len);
+static void OutputFormatV(JLContext *context, const char *fmt, va_list ap);
+
+void WriteStdout(void *arg, const char *data, size_t len)
+{
+   fwrite(data, 1, len, stdout);
+   fflush(stdout);
+}
+
+void InitOutput(JLContext *context)
+{
+   context->output = WriteStdout;
+   context->output_arg = NULL;
+   context->output_len = 0;
+}
+
+void JLSetOutput(JLContext *context, JLOutputFunction func, void *arg)
+{
+   JLFlush(context);
+   context->output = func;
+   context->output_arg = arg;
+}
+
+void JLWrite(JLContext *context, const char *data, size_t len)
+{
+   if(context->output_len + len > JL_OUTPUT_BUFFER_SIZE) {
+      JLFlush(context);
+      if(len >= JL_OUTPUT_BUFFER_SIZE) {
+         /* Too big to buffer; pass it straight through. */
+         (context->output)(context->output_arg, data, len);
+         return;
+      }
+   }
+   memcpy(&context->output_buffer[context->output_len], data, len);
+   context->output_len += len;
+   if(memchr(data, '\n', len)) {
+      /* Line buffered, so a program that prints in a loop is seen. */
+      JLFlush(context);
+   }
+}
+
+void JLFlush(JLContext *context)
+{
+   if(context->output_len > 0) {
+      (context->output)(context->output_arg, context->output_buffer,
+                        context->output_len);
+      context->output_len = 0;
+   }
+}
+
+void OutputString(JLContext *context, const char *str)
+{
+   JLWrite(context, str, strlen(str));
+}
+
+void OutputFormatV(JLContext *context, const char *fmt, va_list ap)
+{
+   char buffer[128];
+   va_list temp;
+   int len;
+
+   va_copy(temp, ap);
+   len = vsnprintf(buffer, sizeof(buffer), fmt, temp);
+   va_end(temp);
+   if(len < 0) {
+      return;
+   } else if((size_t)len < sizeof(buffer)) {
+      JLWrite(context, buffer, len);
+   } else if(context->arena) {
+      /* Errors are reported with this; don't allocate. */
+      JLWrite(context, buffer, sizeof(buffer) - 1);
+   } else {
+      char *str = (char*)malloc(len + 1);
+      vsnprintf(str, len + 1, fmt, ap);
+      JLWrite(context, str, len);
+      free(str);
+   }
+}
+
+void OutputFormat(JLContext *context, const char *fmt, ...)
+{
+   va_list ap;
+   va_start(ap, fmt);
+   OutputFormatV(context, fmt, ap);
+   va_end(ap);
 }
 
 void Error(JLContext *context, const char *msg, ...)
 {
    va_list ap;
    va_start(ap, msg);
-   context->error = 1;
-   printf("ERROR[%d]: ", context->line);
-   vprintf(msg, ap);
-   printf("\n");
+   vsnprintf(context->error_message, JL_ERROR_BUFFER_SIZE, msg, ap);
    va_end(ap);
+   context->error = 1;
+   context->error_line = context->line;
+   if(context->catches) {
+      Raise(context);
+   }
+   ReportError(context);
+}
+
+void ReportError(JLContext *context)
+{
+   OutputFormat(context, "ERROR[%d]: %s\n", context->error_line,
+                context->error_message);
+   JLFlush(context);
+}
+
+void GrowUnwind(JLContext *context)
+{
+   const size_t size = context->unwind_size ? context->unwind_size * 2 : 64;
+   context->unwind = (UnwindNode*)ResizeMemory(context, context->unwind,
+                                               size * sizeof(UnwindNode));
+   context->unwind_size = size;
+}
+
+#ifdef JL_DEFERRED_RELEASE
+char GrowPending(JLContext *context)
+{
+   const size_t size = context->pending_size ? context->pending_size * 2
+                                             : 64;
+   const size_t bytes = size * sizeof(JLValue*);
+   JLValue **pending = (JLValue**)(context->arena
+      ? ArenaResize(context->arena, context->pending, bytes)
+      : realloc(context->pending, bytes));
+   if(pending == NULL) {
+      return 0;
+   }
+   context->pending = pending;
+   context->pending_size = size;
+   return 1;
+}
+#endif
+
+void PushScopeRelease(JLContext *context, ScopeNode *restore,
+                      FrameBinding *frame, unsigned int frame_size)
+{
+   UnwindNode *node;
+   if(context->unwind_count == context->unwind_size) {
+      GrowUnwind(context);
+   }
+   node = &context->unwind[context->unwind_count];
+   node->value = NULL;
+   node->scope = context->scope;
+   node->restore = restore;
+   node->frame = frame;
+   node->frame_size = frame_size;
+   context->unwind_count += 1;
+}
+
+void EnterCatch(JLContext *context, CatchNode *node)
+{
+   node->prev = context->catches;
+   node->scope = context->scope;
+   node->unwind_count = context->unwind_count;
+   node->levels = context->levels;
+#ifdef JL_HEAP_PROFILE
+   node->site_name = context->site_name;
+#endif
+   context->catches = node;
+}
+
+void LeaveCatch(JLContext *context, CatchNode *node)
+{
+   context->catches = node->prev;
+}
+
+void CheckBudget(JLContext *context)
+{
+   unsigned long steps = JL_BUDGET_CHECK_STEPS;
+
+   /* Nothing stops this; every catch passes it on (see TryEvaluate). */
+   if(context->budget_deadline &&
+      JLGetTimeUs() >= context->budget_deadline) {
+      context->budget = JL_BUDGET_DEADLINE;
+      Error(context, "evaluation deadline exceeded");
+      return;
+   }
+   if(context->budget_steps == 0) {
+      context->budget = JL_BUDGET_STEPS;
+      Error(context, "evaluation step budget exceeded");
+      return;
+   }
+   if(context->budget_steps != (unsigned long)-1) {
+      if(steps > context->budget_steps) {
+         steps = context->budget_steps;
+      }
+      context->budget_steps -= steps;
+   }
+   context->budget_count = steps;
+}
+
+uint64_t JLGetTimeUs()
+{
+#ifdef RP2040
+   return time_us_64();
+#elif defined(JL_SIMULATOR)
+   return SimGetTimeUs();
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void SleepUs(JLContext *context, uint64_t us)
+{
+#ifdef RP2040
+   const absolute_time_t wake = make_timeout_time_us(us);
+
+   /* The edge interrupt ends the wait for an event. */
+   while(!best_effort_wfe_or_timeout(wake)) {
+      if(context->edges && EdgesPending()) {
+         DispatchEdges(context);
+      }
+   }
+#elif defined(JL_SIMULATOR)
+   const uint64_t wake = JLGetTimeUs() + us;
+   while(!SimSleep(us)) {
+      uint64_t now;
+      if(context->edges) {
+         DispatchEdges(context);
+      }
+      now = JLGetTimeUs();
+      us = now < wake ? wake - now : 0;
+   }
+#else
+   const uint64_t wake = JLGetTimeUs() + us;
+   for(;;) {
+      const uint64_t now = JLGetTimeUs();
+      struct timespec ts;
+      if(now >= wake) {
+         break;
+      }
+      us = wake - now;
+      if(context->edges && us > JL_SLEEP_SLICE_US) {
+         us = JL_SLEEP_SLICE_US;
+      }
+      ts.tv_sec = (time_t)(us / 1000000);
+      ts.tv_nsec = (long)(us % 1000000) * 1000;
+      while(nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+      }
+      if(context->edges && EdgesPending()) {
+         DispatchEdges(context);
+      }
+   }
+#endif
+}
+
+void Raise(JLContext *context)
+{
+   CatchNode *node = context->catches;
+
+   /* Run the cleanup registered since the catch, newest first.
+    * The stack frames being unwound are still intact here. */
+   while(context->unwind_count > node->unwind_count) {
+      UnwindNode *unwind = &context->unwind[--context->unwind_count];
+      if(unwind->value) {
+         JLValue *value = *unwind->value;
+         *unwind->value = NULL;
+         JLRelease(context, value);
+      } else if(unwind->scope) {
+         context->scope = unwind->scope;
+         LeaveFrameScope(context, unwind->frame, unwind->frame_size);
+         context->scope = unwind->restore;
+      }
+#ifdef JL_STACKLESS
+      else {
+         UnwindEvaluator(context, unwind->stack);
+      }
+#endif
+   }
+
+   context->scope = node->scope;
+   context->levels = node->levels;
+#ifdef JL_HEAP_PROFILE
+   context->site_name = node->site_name;
+   context->site = 0;
+#endif
+   context->catches = node->prev;
+   longjmp(node->env, 1);
 }
 
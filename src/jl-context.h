@@ -9,26 +9,329 @@
 #ifndef JL_CONTEXT_H
 #define JL_CONTEXT_H
 
+#include "jl.h"
+#include "jl-sim.h"
+#include "jl-edge.h"
+
+#include <setjmp.h>
+#include <stddef.h>
+
+#ifndef JL_OUTPUT_BUFFER_SIZE
+#define JL_OUTPUT_BUFFER_SIZE 1024
+#endif
+
+#ifndef JL_MAX_BUILTIN_TABLES
+#define JL_MAX_BUILTIN_TABLES 16
+#endif
+
+#ifndef JL_ERROR_BUFFER_SIZE
+#define JL_ERROR_BUFFER_SIZE 96
+#endif
+
+/* The longest a sleep on the host goes without looking for pin edges. */
+#ifndef JL_SLEEP_SLICE_US
+#define JL_SLEEP_SLICE_US 1000
+#endif
+
+/* How often the clock is read when evaluating with a deadline. */
+#ifndef JL_BUDGET_CHECK_STEPS
+#define JL_BUDGET_CHECK_STEPS 256
+#endif
+
+/* Native functions that evaluate code (map, catch, ...) still nest on the
+ * C stack with the stackless evaluator; this bounds the bytes of C stack
+ * they use.  The RP2040 leaves room below it for the natives themselves. */
+#ifndef JL_MAX_C_STACK
+#if defined(RP2040) && defined(PICO_STACK_SIZE)
+#define JL_MAX_C_STACK (PICO_STACK_SIZE / 2)
+#elif defined(RP2040)
+#define JL_MAX_C_STACK 0x400
+#else
+#define JL_MAX_C_STACK (256 * 1024)
+#endif
+#endif
+
+/* With JL_DEFERRED_RELEASE, the queued values freed by each release that
+ * queues one, and by yield or a pool that has run dry. */
+#ifndef JL_RELEASE_STEPS
+#define JL_RELEASE_STEPS 8
+#endif
+#ifndef JL_RELEASE_SLICE
+#define JL_RELEASE_SLICE 256
+#endif
+
+/* With JL_BACKGROUND_RELEASE, the size of the rings between the threads
+ * (a power of two), the nodes returned at a time, the lists the reclaimer
+ * follows into at once, and how long it sleeps when idle on the host. */
+#ifndef JL_RECLAIM_QUEUE
+#define JL_RECLAIM_QUEUE 256
+#endif
+#ifndef JL_RECLAIM_BATCH
+#define JL_RECLAIM_BATCH 64
+#endif
+#ifndef JL_RECLAIM_DEPTH
+#define JL_RECLAIM_DEPTH 32
+#endif
+#ifndef JL_RECLAIM_IDLE_US
+#define JL_RECLAIM_IDLE_US 200
+#endif
+
 struct ScopeNode;
 struct FreeNode;
+struct FreeScopeNode;
 struct BlockNode;
+struct SpecialFunction;
+struct GlobalNode;
+struct FrameChunk;
+struct BuiltinTable;
+struct FrameBinding;
+struct EvalFrame;
+struct HeapSite;
+struct Arena;
+struct LoadEntry;
+struct LoadFile;
+struct Reclaimer;
+struct EdgeHandlers;
+struct JLRom;
+
+/** Cleanup to run if an error unwinds past it.
+ * With neither a value nor a scope, this is a run of the stackless
+ * evaluator whose frames above stack are dropped.
+ */
+typedef struct UnwindNode {
+   struct JLValue **value;       /**< Value to release (NULL for a scope). */
+   struct ScopeNode *scope;      /**< Scope to leave. */
+   struct ScopeNode *restore;    /**< Scope to return to. */
+   struct FrameBinding *frame;   /**< Frame of the scope (or NULL). */
+   unsigned int frame_size;
+#ifdef JL_STACKLESS
+   size_t stack;                 /**< Evaluator depth to unwind to. */
+#endif
+} UnwindNode;
+
+/** A point that errors unwind to (see TryEvaluate). */
+typedef struct CatchNode {
+   jmp_buf env;
+   struct CatchNode *prev;
+   struct ScopeNode *scope;
+   size_t unwind_count;
+   unsigned int levels;
+#ifdef JL_HEAP_PROFILE
+   const char *site_name;
+#endif
+} CatchNode;
 
 typedef struct JLContext {
    struct ScopeNode *scope;
+   struct Arena *arena;          /**< Fixed arena (NULL to use malloc). */
    struct FreeNode *freelist;
    struct BlockNode *blocks;
+   struct FreeNode *pool;        /**< Values reserved in the arena. */
+   size_t pool_size;
+   struct FreeScopeNode *scope_freelist;
+   struct BlockNode *scope_blocks;
+   struct SpecialFunction *specials;
+   unsigned int special_count;
+   unsigned int special_size;
+   struct FrameChunk *frames;
+   struct FrameChunk *spare_frames;
+   struct GlobalNode *globals;
+   struct JLValue *true_value;   /**< Shared result of true comparisons. */
+   struct JLValue **interned;
+   size_t intern_size;
+   size_t intern_count;
+   char hash_cons;
+   unsigned int macro_count;
+   size_t global_size;
+   size_t global_count;
+   const struct BuiltinTable *builtins[JL_MAX_BUILTIN_TABLES];
+   struct JLValue **builtin_values[JL_MAX_BUILTIN_TABLES];
+   unsigned int builtin_count;
+   struct LoadEntry *loads;      /**< Forms parsed by load. */
+   struct LoadFile *files;       /**< Files added with JLAddFile. */
+   JLLoadFunction loader;
+   void *loader_arg;
+   unsigned long load_hits;
+   unsigned long load_misses;
+   const struct JLRom *rom;      /**< Constant bindings (see JLUseRom). */
+   JLOutputFunction output;
+   void *output_arg;
+   size_t output_len;
+   char output_buffer[JL_OUTPUT_BUFFER_SIZE];
+   UnwindNode *unwind;
+   size_t unwind_count;
+   size_t unwind_size;
+   CatchNode *catches;
+#ifdef JL_STACKLESS
+   struct EvalFrame *eval_stack;
+   size_t eval_count;
+   size_t eval_size;
+   unsigned int nested;          /**< Evaluator runs on the C stack. */
+   uintptr_t stack_base;         /**< C stack at the outermost run. */
+#endif
+#ifdef JL_HEAP_PROFILE
+   const char *site_name;        /**< Function being applied. */
+   struct HeapSite *sites;
+   unsigned short *site_index;   /**< Open-addressed site IDs. */
+   size_t site_size;
+   size_t site_count;
+   unsigned short site;          /**< Cached current site (0 if unknown). */
+#endif
+#ifdef JL_DEFERRED_RELEASE
+   struct JLValue **pending;     /**< Dead values still to be freed. */
+   size_t pending_count;
+   size_t pending_size;
+   char draining;
+#endif
+#ifdef JL_BACKGROUND_RELEASE
+   struct Reclaimer *reclaimer;  /**< NULL if values are freed here. */
+#endif
+   struct EdgeHandlers *edges;   /**< Handlers from on-edge (or NULL). */
+   unsigned long budget_steps;   /**< Steps left after budget_count. */
+   unsigned long budget_count;   /**< Steps to the next check (0 if none). */
+   uint64_t budget_deadline;     /**< 0 for no deadline. */
+   char budget;                  /**< JL_BUDGET_* once a budget runs out. */
    unsigned int line;
    unsigned int levels;
    unsigned int max_levels;
    char error;
+   unsigned int error_line;      /**< line when the error was raised. */
+   char error_message[JL_ERROR_BUFFER_SIZE];
 } JLContext;
 
+/** Allocate memory for the context.
+ * This comes from the arena of a real-time context; running out raises
+ * an "out of memory" error, which is fatal outside an evaluation.
+ */
+void *AllocMemory(JLContext *context, size_t size);
+
+/** Allocate zeroed memory for count items of size bytes. */
+void *AllocZeroed(JLContext *context, size_t count, size_t size);
+
+/** Resize memory from AllocMemory; on failure ptr is left alone. */
+void *ResizeMemory(JLContext *context, void *ptr, size_t size);
+
+void FreeMemory(JLContext *context, void *ptr);
+
+/** Copy a string into memory from AllocMemory. */
+char *CopyString(JLContext *context, const char *str);
+
+/** Get the bytes needed to reserve the pools of a real-time context. */
+size_t GetPoolBytes(size_t values);
+
+/** Fill the pools of a real-time context from memory.
+ * values is the number of value nodes; a quarter as many scope nodes are
+ * reserved.  The pools never grow after this.
+ */
+void ReservePools(JLContext *context, void *memory, size_t values);
+
 void *GetFree(JLContext *context);
 
 void PutFree(JLContext *context, void *value);
 
+#ifdef JL_BACKGROUND_RELEASE
+/** Link a dead value in front of a chain of free nodes.
+ * This touches nothing but the value, so the reclaimer can call it.
+ * @return The new head of the chain.
+ */
+void *ChainFree(void *value, void *chain);
+
+/** Return a chain of free nodes to the pool in one step. */
+void PutFreeChain(JLContext *context, void *first, void *last);
+#endif
+
+/** Get a node for a ScopeNode or BindingNode. */
+void *GetFreeScope(JLContext *context);
+
+void PutFreeScope(JLContext *context, void *node);
+
+#ifdef JL_HEAP_PROFILE
+/** Call func for each live value. */
+void ForEachValue(JLContext *context, void (*func)(struct JLValue*, void*),
+                  void *arg);
+#endif
+
+/** Add a native function; returns its index. */
+unsigned int AddSpecial(JLContext *context, JLFunction func, void *extra,
+                        unsigned char eval);
+
 void FreeContext(JLContext *context);
 
+void InitOutput(JLContext *context);
+
+void OutputString(JLContext *context, const char *str);
+
+void OutputFormat(JLContext *context, const char *fmt, ...);
+
+/** Report an error.
+ * Inside an evaluation this unwinds to the nearest catch or top-level
+ * evaluation; otherwise the message is printed and Error returns.
+ */
 void Error(JLContext *context, const char *msg, ...);
 
+/** Print the message of the last error. */
+void ReportError(JLContext *context);
+
+void GrowUnwind(JLContext *context);
+
+#ifdef JL_DEFERRED_RELEASE
+/** Make room for more pending releases; returns zero if out of memory. */
+char GrowPending(JLContext *context);
+#endif
+
+/** Release *value if an error unwinds out of the current native function.
+ * *value must always hold a reference or NULL while registered.
+ * Registrations are dropped when the function returns (see ApplyFunction);
+ * other functions must restore unwind_count themselves.
+ */
+static inline void PushRelease(JLContext *context, struct JLValue **value)
+{
+   if(context->unwind_count == context->unwind_size) {
+      GrowUnwind(context);
+   }
+   context->unwind[context->unwind_count].value = value;
+   context->unwind_count += 1;
+}
+
+/** Leave the current scope if an error unwinds past it.
+ * restore is the scope to return to; frame is released with the scope.
+ */
+void PushScopeRelease(JLContext *context, struct ScopeNode *restore,
+                      struct FrameBinding *frame, unsigned int frame_size);
+
+/** Make node the target for errors until LeaveCatch.
+ * The caller must setjmp(node->env) right after this; Raise returns
+ * there with the state at EnterCatch restored.
+ */
+void EnterCatch(JLContext *context, CatchNode *node);
+
+void LeaveCatch(JLContext *context, CatchNode *node);
+
+/** Unwind to the innermost catch. */
+[[noreturn]] void Raise(JLContext *context);
+
+/** Wait on the clock of JLGetTimeUs.
+ * Pin edges that arrive meanwhile are handled as they arrive.
+ */
+void SleepUs(JLContext *context, uint64_t us);
+
+/** Raise an error if the evaluation budget has run out. */
+void CheckBudget(JLContext *context);
+
+/** Count an evaluation step against the budget.
+ * Queued pin edges are handled here, between steps.
+ */
+static inline void CountStep(JLContext *context)
+{
+#ifdef JL_SIMULATOR
+   SimStep();
+#endif
+   if(context->edges && EdgesPending()) {
+      DispatchEdges(context);
+   }
+   if(context->budget_count && --context->budget_count == 0) {
+      CheckBudget(context);
+   }
+}
+
 #endif /* JL_CONTEXT_H */
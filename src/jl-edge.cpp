@@ -0,0 +1,453 @@
+/**
+ * @file jl-edge.cpp
+ *
+ * Pin-change handlers (on-edge).
+ * The queue is shared like the pins it watches, and the handlers belong
+ * to the one context that registered them.  CountStep checks the queue
+ * on every evaluation step, so a handler runs at most a step after its
+ * edge is queued; errors in a handler are reported and the evaluation it
+ * interrupted goes on.
+ */
+
+#ifdef RP2040
+#include <pico/stdlib.h>
+#include <hardware/gpio.h>
+#endif
+
+#include "jl.h"
+#include "jl-edge.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-number.h"
+
+#include <cstring>
+
+#ifdef RP2040
+#define EDGE_PINS       NUM_BANK0_GPIOS
+#else
+#define EDGE_PINS       32
+#endif
+
+#define EDGE_PIN_SHIFT     2
+#define EDGE_TIME_SHIFT    7
+#define EDGE_TIME_MASK     ((1ul << (32 - EDGE_TIME_SHIFT)) - 1)
+
+static_assert((JL_EDGE_QUEUE & (JL_EDGE_QUEUE - 1)) == 0,
+              "JL_EDGE_QUEUE must be a power of two");
+
+/** The handlers of a context. */
+typedef struct EdgeHandlers {
+   JLValue *handlers[EDGE_PINS];
+   JLValue *func;                /**< Handler being run. */
+   JLValue *form;                /**< Arguments of the handler. */
+   unsigned long handled;
+   char dispatching;
+} EdgeHandlers;
+
+EdgeQueue edge_queue;
+
+/* Edges that overwrote unread items (EDGE_DROP_OLDEST). */
+static uint32_t edge_lost = 0;
+
+/* The context that gets the edges. */
+static JLContext *edge_owner = NULL;
+
+static void PushEdge(uint32_t item);
+static char TakeEdge(uint32_t *item);
+static void RunHandler(JLContext *context, EdgeHandlers *edges,
+                       uint32_t item);
+static void SetEdges(unsigned int pin, uint32_t edges);
+static void SetMask(std::atomic<uint32_t> *mask, uint32_t bit, char set);
+
+static JLValue *OnEdgeFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *EdgePolicyFunc(JLContext *context, JLValue *args,
+                               void *extra);
+static JLValue *EdgeStatsFunc(JLContext *context, JLValue *args, void *extra);
+
+static constexpr InternalFunctionNode EDGE_FUNCTIONS[] = {
+   { "on-edge",     OnEdgeFunc,     JLEVAL_STRICT },
+   { "edge-policy", EdgePolicyFunc, JLEVAL_STRICT },
+   { "edge-stats",  EdgeStatsFunc,  JLEVAL_STRICT }
+};
+DEFINE_BUILTIN_TABLE(EDGE_TABLE, EDGE_FUNCTIONS)
+
+#ifdef RP2040
+
+static void EdgeCallback(uint gpio, uint32_t events);
+
+void EdgeCallback(uint gpio, uint32_t events)
+{
+   const uint32_t bit = 1ul << gpio;
+   const uint64_t now = time_us_64();
+   const char rise = (events & GPIO_IRQ_EDGE_RISE) != 0;
+   const char fall = (events & GPIO_IRQ_EDGE_FALL) != 0;
+
+   /* With both, the pin has returned to where it started. */
+   if(rise && fall && gpio_get(gpio)) {
+      QueueEdges(0, bit, now);
+      QueueEdges(bit, 0, now);
+   } else {
+      QueueEdges(rise ? bit : 0, fall ? bit : 0, now);
+   }
+   gpio_acknowledge_irq(gpio, events);
+}
+
+void SetEdges(unsigned int pin, uint32_t edges)
+{
+   uint32_t events = 0;
+   if(edges & EDGE_RISE) {
+      events |= GPIO_IRQ_EDGE_RISE;
+   }
+   if(edges & EDGE_FALL) {
+      events |= GPIO_IRQ_EDGE_FALL;
+   }
+   gpio_set_irq_enabled(pin, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, false);
+   if(events) {
+      gpio_set_input_enabled(pin, true);
+      gpio_set_irq_enabled_with_callback(pin, events, true, EdgeCallback);
+   }
+}
+
+#else
+
+void SetEdges(unsigned int pin, uint32_t edges)
+{
+   /* The simulated pins queue whatever the masks allow. */
+}
+
+#endif /* RP2040 */
+
+void SetMask(std::atomic<uint32_t> *mask, uint32_t bit, char set)
+{
+   /* Only the owner writes the masks, so there is no need for a
+    * read-modify-write (which the RP2040 lacks). */
+   const uint32_t value = mask->load(std::memory_order_relaxed);
+   mask->store(set ? (value | bit) : (value & ~bit),
+               std::memory_order_relaxed);
+}
+
+void PushEdge(uint32_t item)
+{
+   EdgeQueue *queue = &edge_queue;
+   const uint32_t tail = queue->tail.load(std::memory_order_relaxed);
+   uint32_t depth = tail - queue->head.load(std::memory_order_acquire);
+
+   if(depth >= JL_EDGE_QUEUE) {
+      if(queue->policy.load(std::memory_order_relaxed) == EDGE_DROP_NEWEST) {
+         queue->dropped.store(queue->dropped.load(std::memory_order_relaxed)
+                              + 1, std::memory_order_relaxed);
+         return;
+      }
+      depth = JL_EDGE_QUEUE - 1;
+   }
+
+   /* Claim the slot before writing it (see TakeEdge). */
+   queue->claim.store(tail + 1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+   queue->items[tail & (JL_EDGE_QUEUE - 1)].store(item,
+      std::memory_order_relaxed);
+   queue->tail.store(tail + 1, std::memory_order_release);
+
+   if(depth + 1 > queue->max_depth.load(std::memory_order_relaxed)) {
+      queue->max_depth.store(depth + 1, std::memory_order_relaxed);
+   }
+}
+
+char TakeEdge(uint32_t *item)
+{
+   EdgeQueue *queue = &edge_queue;
+   uint32_t head = queue->head.load(std::memory_order_relaxed);
+
+   for(;;) {
+      const uint32_t tail = queue->tail.load(std::memory_order_acquire);
+      if(head == tail) {
+         return 0;
+      }
+      if(tail - head > JL_EDGE_QUEUE) {
+         /* The producer wrote over the oldest items. */
+         edge_lost += tail - head - JL_EDGE_QUEUE;
+         head = tail - JL_EDGE_QUEUE;
+      }
+      *item = queue->items[head & (JL_EDGE_QUEUE - 1)].load(
+         std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(queue->claim.load(std::memory_order_relaxed) - head
+         <= JL_EDGE_QUEUE) {
+         queue->head.store(head + 1, std::memory_order_release);
+         return 1;
+      }
+      /* Written over while it was read; try again. */
+   }
+}
+
+void QueueEdges(uint32_t rising, uint32_t falling, uint64_t time_us)
+{
+   const uint32_t time = (uint32_t)(time_us & EDGE_TIME_MASK)
+                       << EDGE_TIME_SHIFT;
+   uint32_t pins;
+   unsigned int pin;
+
+   rising &= edge_queue.rise_mask.load(std::memory_order_relaxed);
+   falling &= edge_queue.fall_mask.load(std::memory_order_relaxed);
+   pins = rising | falling;
+   for(pin = 0; pins; pin++, pins >>= 1) {
+      if(pins & 1) {
+         const uint32_t edge = ((rising >> pin) & 1) ? EDGE_RISE : EDGE_FALL;
+         PushEdge(time | (pin << EDGE_PIN_SHIFT) | edge);
+      }
+   }
+}
+
+void RunHandler(JLContext *context, EdgeHandlers *edges, uint32_t item)
+{
+   const unsigned int pin = (item >> EDGE_PIN_SHIFT) & 0x1F;
+   const uint64_t now = JLGetTimeUs();
+   const uint64_t time = now - ((now - (item >> EDGE_TIME_SHIFT))
+                                & EDGE_TIME_MASK);
+   CatchNode node;
+   JLValue *arg;
+
+   if(pin >= EDGE_PINS || edges->handlers[pin] == NULL) {
+      /* Removed since the edge was queued. */
+      return;
+   }
+
+   /* Keep the handler; it can remove itself. */
+   edges->func = edges->handlers[pin];
+   JLRetain(context, edges->func);
+   EnterCatch(context, &node);
+   if(setjmp(node.env) == 0) {
+      /* (handler pin level time-us) */
+      edges->form = CreateValue(context, NULL, JLVALUE_NIL);
+      edges->form->value.str = (char*)"on-edge";
+      arg = JLDefineNumber(context, NULL, Number::FromInt(pin));
+      edges->form->next = CreateCell(context, arg);
+      arg = JLDefineNumber(context, NULL,
+                           Number::FromInt((item & EDGE_RISE) ? 1 : 0));
+      edges->form->next->next = CreateCell(context, arg);
+      arg = JLDefineNumber(context, NULL, Number::FromCounter(time));
+      edges->form->next->next->next = CreateCell(context, arg);
+      JLRelease(context, ApplyFunction(context, edges->func, edges->form));
+      LeaveCatch(context, &node);
+   } else if(context->budget != JL_BUDGET_DONE) {
+      /* An exhausted budget unwinds the whole evaluation. */
+      JLRelease(context, edges->form);
+      JLRelease(context, edges->func);
+      edges->form = NULL;
+      edges->func = NULL;
+      edges->dispatching = 0;
+      Raise(context);
+   } else {
+      context->error = 0;
+      ReportError(context);
+   }
+   JLRelease(context, edges->form);
+   JLRelease(context, edges->func);
+   edges->form = NULL;
+   edges->func = NULL;
+   edges->handled += 1;
+}
+
+void DispatchEdges(JLContext *context)
+{
+   EdgeHandlers *edges = context->edges;
+   uint32_t item;
+
+   /* Handlers are not interrupted by more edges. */
+   if(edges->dispatching || context != edge_owner) {
+      return;
+   }
+   edges->dispatching = 1;
+   while(TakeEdge(&item)) {
+      RunHandler(context, edges, item);
+   }
+   edges->dispatching = 0;
+}
+
+void ReleaseEdges(JLContext *context)
+{
+   EdgeHandlers *edges = context->edges;
+   unsigned int pin;
+
+   if(edges == NULL) {
+      return;
+   }
+   for(pin = 0; pin < EDGE_PINS; pin++) {
+      if(edges->handlers[pin]) {
+         SetEdges(pin, 0);
+         JLRelease(context, edges->handlers[pin]);
+      }
+   }
+   if(edge_owner == context) {
+      edge_queue.rise_mask.store(0, std::memory_order_relaxed);
+      edge_queue.fall_mask.store(0, std::memory_order_relaxed);
+      edge_queue.head.store(edge_queue.tail.load(std::memory_order_acquire),
+                            std::memory_order_release);
+      edge_owner = NULL;
+   }
+   FreeMemory(context, edges);
+   context->edges = NULL;
+}
+
+JLValue *OnEdgeFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *pin_value = NULL;
+   JLValue *edge_value = NULL;
+   JLValue *handler = NULL;
+   EdgeHandlers *edges;
+   uint32_t bit;
+   uint32_t kind = 0;
+   unsigned int pin;
+
+   /* (on-edge pin edge handler) */
+   if(args->next == NULL || args->next->next == NULL ||
+      args->next->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   PushRelease(context, &pin_value);
+   PushRelease(context, &edge_value);
+   PushRelease(context, &handler);
+   pin_value = JLEvaluate(context, args->next);
+   edge_value = JLEvaluate(context, args->next->next);
+   handler = JLEvaluate(context, args->next->next->next);
+   if(pin_value == NULL || pin_value->tag != JLVALUE_NUMBER ||
+      Number::ToInt(pin_value->value.number) < 0 ||
+      Number::ToInt(pin_value->value.number) >= EDGE_PINS) {
+      goto edge_invalid;
+   }
+   pin = (unsigned int)Number::ToInt(pin_value->value.number);
+   if(edge_value == NULL || edge_value->tag != JLVALUE_STRING) {
+      goto edge_invalid;
+   }
+   if(!strcmp(edge_value->value.str, "rise")) {
+      kind = EDGE_RISE;
+   } else if(!strcmp(edge_value->value.str, "fall")) {
+      kind = EDGE_FALL;
+   } else if(!strcmp(edge_value->value.str, "both")) {
+      kind = EDGE_RISE | EDGE_FALL;
+   } else {
+      goto edge_invalid;
+   }
+   if(handler && handler->tag != JLVALUE_LAMBDA &&
+      handler->tag != JLVALUE_SPECIAL && handler->tag != JLVALUE_MEMO) {
+      goto edge_invalid;
+   }
+   if(edge_owner && edge_owner != context) {
+      Error(context, "edges are handled by another context");
+      goto edge_done;
+   }
+
+   /* nil removes the handler. */
+   if(context->edges == NULL) {
+      context->edges = (EdgeHandlers*)AllocZeroed(context, 1,
+                                                  sizeof(EdgeHandlers));
+   }
+   edges = context->edges;
+   edge_owner = context;
+   bit = 1ul << pin;
+   if(handler == NULL) {
+      kind = 0;
+   }
+   SetMask(&edge_queue.rise_mask, bit, kind & EDGE_RISE);
+   SetMask(&edge_queue.fall_mask, bit, kind & EDGE_FALL);
+   JLRelease(context, edges->handlers[pin]);
+   edges->handlers[pin] = handler;
+   handler = NULL;
+   SetEdges(pin, kind);
+   goto edge_done;
+
+edge_invalid:
+
+   InvalidArgumentError(context, args);
+
+edge_done:
+
+   JLRelease(context, pin_value);
+   JLRelease(context, edge_value);
+   JLRelease(context, handler);
+   return NULL;
+}
+
+JLValue *EdgePolicyFunc(JLContext *context, JLValue *args, void *extra)
+{
+   const char previous = edge_queue.policy.load(std::memory_order_relaxed);
+   JLValue *result;
+   JLValue *arg;
+
+   /* (edge-policy ["drop-newest" | "drop-oldest"]) returns the old one. */
+   if(args->next && args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next) {
+      arg = JLEvaluate(context, args->next);
+      if(arg && arg->tag == JLVALUE_STRING &&
+         !strcmp(arg->value.str, "drop-newest")) {
+         edge_queue.policy.store(EDGE_DROP_NEWEST, std::memory_order_relaxed);
+      } else if(arg && arg->tag == JLVALUE_STRING &&
+                !strcmp(arg->value.str, "drop-oldest")) {
+         edge_queue.policy.store(EDGE_DROP_OLDEST, std::memory_order_relaxed);
+      } else {
+         JLRelease(context, arg);
+         InvalidArgumentError(context, args);
+         return NULL;
+      }
+      JLRelease(context, arg);
+   }
+   result = CreateValue(context, NULL, JLVALUE_STRING);
+   result->value.str = NULL;
+   PushRelease(context, &result);
+   result->value.str = CopyString(context, previous == EDGE_DROP_OLDEST
+                                           ? "drop-oldest" : "drop-newest");
+   context->unwind_count -= 1;
+   return result;
+}
+
+JLValue *EdgeStatsFunc(JLContext *context, JLValue *args, void *extra)
+{
+   const uint32_t head = edge_queue.head.load(std::memory_order_relaxed);
+   const uint32_t tail = edge_queue.tail.load(std::memory_order_acquire);
+   uint32_t depth = tail - head;
+   unsigned long values[4];
+   JLValue *result;
+   JLValue **item;
+   unsigned int i;
+
+   if(args->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   /* Return (depth max-depth dropped handled). */
+   if(depth > JL_EDGE_QUEUE) {
+      depth = JL_EDGE_QUEUE;
+   }
+   values[0] = depth;
+   values[1] = edge_queue.max_depth.load(std::memory_order_relaxed);
+   values[2] = edge_queue.dropped.load(std::memory_order_relaxed)
+             + edge_lost;
+   values[3] = context->edges ? context->edges->handled : 0;
+   result = CreateValue(context, NULL, JLVALUE_LIST);
+   result->value.lst = NULL;
+   PushRelease(context, &result);
+   item = &result->value.lst;
+   for(i = 0; i < 4; i++) {
+      *item = JLDefineNumber(context, NULL, Number::FromInt(values[i]));
+      item = &(*item)->next;
+   }
+   context->unwind_count -= 1;
+   return result;
+}
+
+void RegisterEdgeFunctions(JLContext *context)
+{
+   RegisterBuiltins(context, &EDGE_TABLE);
+}
@@ -0,0 +1,71 @@
+/**
+ * @file jl-edge.h
+ *
+ * Pin-change handlers (on-edge).
+ * Edges are queued by the GPIO interrupt on the RP2040, or by changes to
+ * the simulated input register on the host, and the handlers run between
+ * evaluation steps of the context that registered them.
+ */
+
+#ifndef JL_EDGE_H
+#define JL_EDGE_H
+
+#include <atomic>
+#include <stdint.h>
+
+struct JLContext;
+
+/* Edges the queue holds (a power of two). */
+#ifndef JL_EDGE_QUEUE
+#define JL_EDGE_QUEUE 32
+#endif
+
+#define EDGE_FALL    1
+#define EDGE_RISE    2
+
+/* What happens to an edge that finds the queue full. */
+#define EDGE_DROP_NEWEST   0     /**< The new edge is lost. */
+#define EDGE_DROP_OLDEST   1     /**< The oldest queued edge is lost. */
+
+/** A single-producer, single-consumer ring of packed edges.
+ * Each item holds the edge in bits 0-1, the pin in bits 2-6 and the low
+ * 25 bits of the time in microseconds above that, so an item is written
+ * in one store even on the RP2040.  With EDGE_DROP_OLDEST the producer
+ * writes over unread items; claim moves before each write so the
+ * consumer can tell that an item changed while it was read.
+ */
+typedef struct EdgeQueue {
+   std::atomic<uint32_t> items[JL_EDGE_QUEUE];
+   std::atomic<uint32_t> head;         /**< Next item to take. */
+   std::atomic<uint32_t> tail;         /**< Next slot to fill. */
+   std::atomic<uint32_t> claim;        /**< tail, once the write is done. */
+   std::atomic<uint32_t> rise_mask;    /**< Pins queueing rising edges. */
+   std::atomic<uint32_t> fall_mask;    /**< Pins queueing falling edges. */
+   std::atomic<uint32_t> max_depth;
+   std::atomic<uint32_t> dropped;      /**< Edges the producer dropped. */
+   std::atomic<char> policy;           /**< EDGE_DROP_* */
+} EdgeQueue;
+
+extern EdgeQueue edge_queue;
+
+/** Queue edges on the pins in rising and falling (the ISR side).
+ * Only edges with a handler are queued.
+ */
+void QueueEdges(uint32_t rising, uint32_t falling, uint64_t time_us);
+
+/** Run the handlers of the queued edges. */
+void DispatchEdges(struct JLContext *context);
+
+/** Drop the handlers of a context. */
+void ReleaseEdges(struct JLContext *context);
+
+/** Determine if edges are waiting in the queue. */
+static inline char EdgesPending()
+{
+   return edge_queue.head.load(std::memory_order_relaxed)
+       != edge_queue.tail.load(std::memory_order_relaxed);
+}
+
+void RegisterEdgeFunctions(struct JLContext *context);
+
+#endif /* JL_EDGE_H */
@@ -0,0 +1,607 @@
+/**
+ * @file jl-eval.cpp
+ *
+ * Stackless evaluator.
+ * Each frame is a continuation: it says what to do with the next value
+ * the evaluator produces.  A list pushes a call frame and evaluates its
+ * head; an atom produces a value, which is handed to the frame on top.
+ * The last form of a body and the branches of if are evaluated after
+ * their frame is popped, and a lambda called there leaves the scope of
+ * its caller first, so loops written as tail calls run in constant space.
+ */
+
+#include "jl.h"
+#include "jl-eval.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-macro.h"
+#include "jl-memo.h"
+
+#include <cstdlib>
+
+#ifdef JL_STACKLESS
+
+/* What a frame does with the next value. */
+#define EVAL_CALL       0     /* The value is the function to call. */
+#define EVAL_ARGS       1     /* Store the argument; code is the next one. */
+#define EVAL_SEQUENCE   2     /* Drop the value; code is the next form. */
+#define EVAL_LEAVE      3     /* Leave the scope of a call or let. */
+#define EVAL_IF         4     /* code is the condition. */
+#define EVAL_AND        5
+#define EVAL_OR         6
+#define EVAL_DEFINE     7     /* code is the name. */
+#define EVAL_SET        8
+#define EVAL_LET        9     /* code is the binding being evaluated. */
+#define EVAL_MEMO       10    /* Record the result; form is the key. */
+
+typedef struct EvalFrame {
+   JLValue *code;
+   JLValue *body;                /**< Body of a let. */
+   JLValue *func;                /**< Function being called (owned). */
+   JLValue *form;                /**< Evaluated arguments (owned). */
+   JLValue **item;               /**< Where the next argument goes. */
+   ScopeNode *scope;             /**< Scope entered by the frame. */
+   ScopeNode *restore;           /**< Scope to return to. */
+   FrameBinding *frame;
+   unsigned int frame_size;
+#ifdef JL_HEAP_PROFILE
+   const char *site_name;        /**< Site to restore on leaving. */
+#endif
+   unsigned char op;
+} EvalFrame;
+
+static EvalFrame *PushEval(JLContext *context, unsigned char op,
+                           JLValue *code);
+static void PopEval(JLContext *context);
+static void LeaveEval(JLContext *context, EvalFrame *frame);
+static unsigned char GetEvalKind(JLContext *context, const JLValue *func);
+static char HasCalls(const JLValue *args);
+static char EnterLet(JLContext *context, EvalFrame *top, JLValue *head);
+static JLValue *EnterLambda(JLContext *context, size_t base);
+static char EnterMemo(JLContext *context, JLValue **result);
+
+EvalFrame *PushEval(JLContext *context, unsigned char op, JLValue *code)
+{
+   EvalFrame *frame;
+   CountStep(context);
+   if(context->levels >= context->max_levels) {
+      Error(context, "maximum evaluation depth exceeded");
+      return NULL;
+   }
+   if(context->eval_count == context->eval_size) {
+      const size_t size = context->eval_size ? context->eval_size * 2 : 64;
+      context->eval_stack = (EvalFrame*)ResizeMemory(context,
+         context->eval_stack, size * sizeof(EvalFrame));
+      context->eval_size = size;
+   }
+   frame = &context->eval_stack[context->eval_count];
+   frame->op = op;
+   frame->code = code;
+   frame->func = NULL;
+   frame->form = NULL;
+   context->eval_count += 1;
+   context->levels += 1;
+   return frame;
+}
+
+void PopEval(JLContext *context)
+{
+   EvalFrame *frame = &context->eval_stack[--context->eval_count];
+   JLRelease(context, frame->func);
+   JLRelease(context, frame->form);
+   context->levels -= 1;
+}
+
+void LeaveEval(JLContext *context, EvalFrame *frame)
+{
+   context->scope = frame->scope;
+   LeaveFrameScope(context, frame->frame, frame->frame_size);
+   context->scope = frame->restore;
+#ifdef JL_HEAP_PROFILE
+   context->site_name = frame->site_name;
+   context->site = 0;
+#endif
+}
+
+unsigned char GetEvalKind(JLContext *context, const JLValue *func)
+{
+   switch(func->tag) {
+   case JLVALUE_SPECIAL:
+      return context->specials[func->value.special].eval;
+   case JLVALUE_LAMBDA:
+   case JLVALUE_MEMO:
+      return JLEVAL_STRICT;
+   default:
+      return JLEVAL_CODE;
+   }
+}
+
+char HasCalls(const JLValue *args)
+{
+   for(; args; args = args->next) {
+      if(args->tag == JLVALUE_LIST) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+char EnterLet(JLContext *context, EvalFrame *top, JLValue *head)
+{
+   JLValue *bp;
+   unsigned int size = 0;
+
+   /* Malformed lets are left to LetFunc to report. */
+   if(head->next == NULL || head->next->tag != JLVALUE_LIST) {
+      return 0;
+   }
+   for(bp = head->next->value.lst; bp; bp = bp->next) {
+      if(bp->tag != JLVALUE_LIST || bp->value.lst == NULL ||
+         bp->value.lst->tag != JLVALUE_VARIABLE) {
+         return 0;
+      }
+      size += 1;
+   }
+
+   /* All of the bindings share one frame. */
+   top->code = head->next->value.lst;
+   top->body = head->next->next;
+   top->restore = context->scope;
+   top->frame = PushFrame(context, size);
+   top->frame_size = size;
+   JLEnterScope(context);
+   top->scope = context->scope;
+   top->scope->frame = top->frame;
+#ifdef JL_HEAP_PROFILE
+   top->site_name = context->site_name;
+#endif
+   top->op = EVAL_LET;
+   return 1;
+}
+
+JLValue *EnterLambda(JLContext *context, size_t base)
+{
+   EvalFrame *top = &context->eval_stack[context->eval_count - 1];
+   const JLValue *lambda = top->func;
+   JLValue *params;
+   JLValue *bp;
+   JLValue *ap;
+   JLValue *value;
+   ScopeNode *scope;
+   FrameBinding *frame = NULL;
+   unsigned int frame_size = 0;
+
+   /* Make sure the lambda is well-defined (see EvalLambda). */
+   if(lambda->value.lst == NULL ||
+      lambda->value.lst->tag != JLVALUE_SCOPE ||
+      lambda->value.lst->next == NULL ||
+      lambda->value.lst->next->tag != JLVALUE_LIST) {
+      Error(context, "invalid lambda");
+      return NULL;
+   }
+   params = lambda->value.lst->next->value.lst;
+
+   /* A call in tail position replaces the scopes it would return to.
+    * Its arguments are already in the form.  A scope captured by a
+    * closure is kept until the call returns, as the cycle between the
+    * scope and a lambda bound in it is only broken when nothing else
+    * holds the lambda (see ReleaseScope). */
+   while(context->eval_count - 1 > base &&
+         top[-1].op == EVAL_LEAVE && top[-1].scope->count == 1) {
+      EvalFrame *below = top - 1;
+      LeaveEval(context, below);
+      JLRelease(context, below->func);
+      JLRelease(context, below->form);
+      *below = *top;
+      top = below;
+      context->eval_count -= 1;
+      context->levels -= 1;
+   }
+
+   for(bp = params; bp; bp = bp->next) {
+      frame_size += 1;
+   }
+   frame = PushFrame(context, frame_size);
+   top->restore = context->scope;
+   context->scope = GetLambdaScope(context, lambda);
+   JLEnterScope(context);
+   scope = context->scope;
+   scope->frame = frame;
+   top->scope = scope;
+   top->frame = frame;
+   top->frame_size = frame_size;
+#ifdef JL_HEAP_PROFILE
+   top->site_name = context->site_name;
+   context->site_name = top->form->value.str;
+   context->site = 0;
+#endif
+   top->op = EVAL_LEAVE;
+
+   ap = top->form->next;  /* Skip the name */
+   for(bp = params; bp; bp = bp->next) {
+      if(ap == NULL) {
+         Error(context, "too few arguments");
+         return NULL;
+      }
+      if(bp->tag != JLVALUE_VARIABLE) {
+         Error(context, "invalid lambda argument");
+         return NULL;
+      }
+      if(bp->next == NULL && ap->next != NULL) {
+         /* The rest of the arguments; the list shares their cells. */
+         value = CreateValue(context, NULL, JLVALUE_LIST);
+         value->value.lst = ap;
+         JLRetain(context, ap);
+      } else {
+         value = ap->value.lst;
+         JLRetain(context, value);
+      }
+      ap = ap->next;
+      if(frame) {
+         frame[scope->frame_count].name = bp->value.str;
+         frame[scope->frame_count].value = value;
+         scope->frame_count += 1;
+      } else {
+         DefineBinding(context, scope, bp->value.str, value);
+         JLRelease(context, value);
+      }
+   }
+   JLRelease(context, top->form);
+   top->form = NULL;
+   return lambda->value.lst->next->next;
+}
+
+char EnterMemo(JLContext *context, JLValue **result)
+{
+   EvalFrame *top = &context->eval_stack[context->eval_count - 1];
+   Memo *memo = top->func->value.memo;
+   JLValue *key = NULL;
+   JLValue *form = top->form;
+
+   /* The key shares the cells of the form (see CallMemo). */
+   if(form->next) {
+      key = CreateValue(context, NULL, JLVALUE_LIST);
+      key->value.lst = form->next;
+      JLRetain(context, key->value.lst);
+   }
+   if(FindMemo(context, memo, key, result)) {
+      JLRelease(context, key);
+      return 1;
+   }
+
+   /* Call the function above a frame that records the result. */
+   top->op = EVAL_MEMO;
+   top->form = key;
+   top = PushEval(context, EVAL_ARGS, NULL);
+   top->func = memo->func;
+   top->form = form;
+   JLRetain(context, top->func);
+   return 0;
+}
+
+JLValue *RunEvaluator(JLContext *context, JLValue *code)
+{
+   const size_t base = context->eval_count;
+   const size_t mark = context->unwind_count;
+   UnwindNode *unwind;
+   EvalFrame *top;
+   JLValue *value;
+   JLValue *head;
+   JLValue *node;
+   JLValue **slot;
+   unsigned char kind;
+   char here;
+
+   /* Natives that evaluate code run this again further down the C stack
+    * (which grows down); stop before it runs out. */
+   if(context->nested == 0) {
+      context->stack_base = (uintptr_t)&here;
+   } else if(context->stack_base - (uintptr_t)&here > JL_MAX_C_STACK) {
+      Error(context, "maximum evaluation depth exceeded");
+      return NULL;
+   }
+
+   /* If an error unwinds past this run, its frames are dropped. */
+   if(context->unwind_count == context->unwind_size) {
+      GrowUnwind(context);
+   }
+   unwind = &context->unwind[context->unwind_count];
+   unwind->value = NULL;
+   unwind->scope = NULL;
+   unwind->stack = base;
+   context->unwind_count += 1;
+   context->nested += 1;
+
+evaluate:
+
+   if(code == NULL) {
+      value = NULL;
+   } else {
+      switch(code->tag) {
+      case JLVALUE_LIST:
+         if(code->value.lst == NULL) {
+            value = NULL;
+            break;
+         }
+         PushEval(context, EVAL_CALL, code);
+         code = code->value.lst;
+         goto evaluate;
+      case JLVALUE_VARIABLE:
+         value = Lookup(context, code->value.str);
+         JLRetain(context, value);
+         break;
+      case JLVALUE_CELL:
+         /* Cells hold values that have already been evaluated. */
+         value = code->value.lst;
+         JLRetain(context, value);
+         break;
+      case JLVALUE_NIL:
+         value = NULL;
+         break;
+      default:
+         value = code;
+         JLRetain(context, value);
+         break;
+      }
+   }
+
+resume:
+
+   if(context->eval_count == base) {
+      context->unwind_count = mark;
+      context->nested -= 1;
+      return value;
+   }
+   top = &context->eval_stack[context->eval_count - 1];
+   switch(top->op) {
+   case EVAL_CALL:
+      if(value == NULL) {
+         PopEval(context);
+         goto resume;
+      }
+      top->func = value;
+      head = top->code->value.lst;
+      if(value->tag == JLVALUE_MACRO) {
+         /* Defined after this code was processed; expand it now. */
+         code = top->code;
+         ExpandForm(context, code, value);
+         PopEval(context);
+         goto evaluate;
+      }
+      kind = GetEvalKind(context, value);
+      switch(kind) {
+      case JLEVAL_STRICT:
+         if(value->tag == JLVALUE_SPECIAL && !HasCalls(head->next)) {
+            /* Atoms evaluate without recursing; skip the call form. */
+            break;
+         }
+         /* The head only names the function in errors. */
+         top->op = EVAL_ARGS;
+         top->form = CreateValue(context, NULL, JLVALUE_NIL);
+         top->form->value.str = head->tag == JLVALUE_VARIABLE
+                              ? head->value.str : (char*)"lambda";
+         top->item = &top->form->next;
+         top->code = head->next;
+         if(top->code) {
+            code = top->code;
+            goto evaluate;
+         }
+         goto apply;
+      case JLEVAL_IF:
+         if(head->next == NULL) {
+            break;
+         }
+         top->op = EVAL_IF;
+         top->code = head->next;
+         code = head->next;
+         goto evaluate;
+      case JLEVAL_BEGIN:
+         if(BeginNeedsScope(head)) {
+            break;
+         }
+         node = head->next;
+         PopEval(context);
+         goto sequence;
+      case JLEVAL_AND:
+      case JLEVAL_OR:
+         if(head->next == NULL) {
+            break;
+         }
+         top->op = kind == JLEVAL_AND ? EVAL_AND : EVAL_OR;
+         top->code = head->next;
+         code = head->next;
+         goto evaluate;
+      case JLEVAL_DEFINE:
+         if(head->next == NULL || head->next->tag != JLVALUE_VARIABLE) {
+            break;
+         }
+         top->op = EVAL_DEFINE;
+         top->code = head->next;
+         code = head->next->next;
+         goto evaluate;
+      case JLEVAL_SET:
+         node = head->next;
+         if(node == NULL || node->next == NULL || node->next->next ||
+            node->tag != JLVALUE_VARIABLE) {
+            break;
+         }
+         top->op = EVAL_SET;
+         top->code = node;
+         code = node->next;
+         goto evaluate;
+      case JLEVAL_LET:
+         if(!EnterLet(context, top, head)) {
+            break;
+         }
+         if(top->code) {
+            context->scope = top->restore;
+            code = top->code->value.lst->next;
+            goto evaluate;
+         }
+         top->op = EVAL_LEAVE;
+         node = top->body;
+         goto sequence;
+      default:
+         break;
+      }
+
+      /* Everything else gets its arguments as code. */
+      value = ApplyFunction(context, top->func, head);
+      PopEval(context);
+      goto resume;
+
+   case EVAL_ARGS:
+      *top->item = CreateCell(context, value);
+      top->item = &(*top->item)->next;
+      top->code = top->code->next;
+      if(top->code) {
+         code = top->code;
+         goto evaluate;
+      }
+      goto apply;
+
+   case EVAL_SEQUENCE:
+      JLRelease(context, value);
+      node = top->code;
+      if(node->next) {
+         top->code = node->next;
+      } else {
+         PopEval(context);
+      }
+      code = node;
+      goto evaluate;
+
+   case EVAL_LEAVE:
+      LeaveEval(context, top);
+      PopEval(context);
+      goto resume;
+
+   case EVAL_IF:
+      node = top->code;
+      PopEval(context);
+      if(IsTrue(value)) {
+         code = node->next;
+      } else {
+         code = node->next ? node->next->next : NULL;
+      }
+      JLRelease(context, value);
+      goto evaluate;
+
+   case EVAL_AND:
+   case EVAL_OR:
+      if(IsTrue(value) != (top->op == EVAL_AND)) {
+         /* Decided: false for and, true for or. */
+         JLRelease(context, value);
+         value = top->op == EVAL_OR ? context->true_value : NULL;
+         JLRetain(context, value);
+         PopEval(context);
+         goto resume;
+      }
+      JLRelease(context, value);
+      top->code = top->code->next;
+      if(top->code) {
+         code = top->code;
+         goto evaluate;
+      }
+      value = top->op == EVAL_AND ? context->true_value : NULL;
+      JLRetain(context, value);
+      PopEval(context);
+      goto resume;
+
+   case EVAL_DEFINE:
+      JLDefineValue(context, top->code->value.str, value);
+      PopEval(context);
+      goto resume;
+
+   case EVAL_SET:
+      /* Look up after evaluating: that can move frame bindings. */
+      slot = FindValue(context, top->code->value.str);
+      if(slot == NULL) {
+         JLRelease(context, value);
+         Error(context, "set! of unbound symbol: %s", top->code->value.str);
+         value = NULL;
+      } else {
+         JLRelease(context, *slot);
+         *slot = value;
+         JLRetain(context, value);
+      }
+      PopEval(context);
+      goto resume;
+
+   case EVAL_LET:
+      context->scope = top->scope;
+      node = top->code;
+      if(top->frame) {
+         top->frame[top->scope->frame_count].name = node->value.lst->value.str;
+         top->frame[top->scope->frame_count].value = value;
+         top->scope->frame_count += 1;
+      } else {
+         DefineBinding(context, top->scope, node->value.lst->value.str, value);
+         JLRelease(context, value);
+      }
+      if(node->next) {
+         top->code = node->next;
+         context->scope = top->restore;
+         code = node->next->value.lst->next;
+         goto evaluate;
+      }
+      top->op = EVAL_LEAVE;
+      node = top->body;
+      goto sequence;
+
+   case EVAL_MEMO:
+      StoreMemo(context, top->func->value.memo, top->form, value);
+      PopEval(context);
+      goto resume;
+
+   default:
+      break;
+   }
+
+apply:
+
+   /* top holds a function and its evaluated arguments. */
+   if(top->func->tag == JLVALUE_MEMO) {
+      if(EnterMemo(context, &value)) {
+         PopEval(context);
+         goto resume;
+      }
+      top = &context->eval_stack[context->eval_count - 1];
+   }
+   if(top->func->tag != JLVALUE_LAMBDA) {
+      value = ApplyFunction(context, top->func, top->form);
+      PopEval(context);
+      goto resume;
+   }
+   node = EnterLambda(context, base);
+
+sequence:
+
+   /* Evaluate the forms from node; the last one is a tail position. */
+   if(node == NULL) {
+      value = NULL;
+      goto resume;
+   }
+   if(node->next) {
+      PushEval(context, EVAL_SEQUENCE, node->next);
+   }
+   code = node;
+   goto evaluate;
+}
+
+void UnwindEvaluator(JLContext *context, size_t stack)
+{
+   while(context->eval_count > stack) {
+      EvalFrame *frame = &context->eval_stack[--context->eval_count];
+      if(frame->op == EVAL_LEAVE || frame->op == EVAL_LET) {
+         LeaveEval(context, frame);
+      }
+      JLRelease(context, frame->func);
+      JLRelease(context, frame->form);
+   }
+   context->nested -= 1;
+}
+
+#endif /* JL_STACKLESS */
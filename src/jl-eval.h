@@ -0,0 +1,27 @@
+/**
+ * @file jl-eval.h
+ *
+ * Stackless evaluator.
+ * With JL_STACKLESS, calls, bodies and control forms are run from a stack
+ * of continuation frames on the heap instead of recursing on the C stack,
+ * so deep recursion in JL does not overflow the (small) native stack.
+ */
+
+#ifndef JL_EVAL_H
+#define JL_EVAL_H
+
+#include <stddef.h>
+
+struct JLContext;
+struct JLValue;
+
+/** Evaluate a list; returns a new reference to the result. */
+struct JLValue *RunEvaluator(struct JLContext *context,
+                             struct JLValue *code);
+
+/** Drop the frames of an evaluator run that an error unwinds past.
+ * stack is the depth of the frame stack when the run started.
+ */
+void UnwindEvaluator(struct JLContext *context, size_t stack);
+
+#endif /* JL_EVAL_H */
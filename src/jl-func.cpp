@@ -8,20 +8,28 @@
 #include "jl-value.h"
 #include "jl-context.h"
 #include "jl-scope.h"
+#include "jl-number.h"
+#include "jl-bytes.h"
+#include "jl-intern.h"
+#include "jl-macro.h"
 
 #include <stdio.h>
 #include <cstdlib>
 #include <cstring>
 
-typedef struct InternalFunctionNode {
-   const char *name;
-   JLFunction function;
-} InternalFunctionNode;
-
 static char CheckCondition(JLContext *context, JLValue *value);
-static void InvalidArgumentError(JLContext *context, JLValue *args);
-static void TooManyArgumentsError(JLContext *context, JLValue *args);
-static void TooFewArgumentsError(JLContext *context, JLValue *args);
+static char ContainsSymbol(const JLValue *value, const char *name);
+static JLValue *CreateCallForm(JLContext *context, const char *name,
+                               size_t count);
+static void SetArgument(JLContext *context, JLValue *cell, JLValue *value);
+static void EvaluateBody(JLContext *context, JLValue *vp);
+static JLValue *CallForm(JLContext *context, JLValue *func, JLValue **form);
+static JLValue *EvaluateFunction(JLContext *context, JLValue *args,
+                                 JLValue *vp);
+static char EvaluateList(JLContext *context, JLValue *args, JLValue *vp,
+                         JLValue **result);
+static JLValue *CreateTrue(JLContext *context);
+static int CompareBytes(const ByteBuffer *a, const ByteBuffer *b);
 
 static JLValue *CompareFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *AddFunc(JLContext *context, JLValue *args, void *extra);
@@ -39,13 +47,16 @@ static JLValue *AndFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *OrFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *NotFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *BeginFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *CatchFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *ConsFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *DefineFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *DotimesFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *HeadFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *IfFunc(JLContext *context, JLValue *args, void *extra);
-static JLValue *LambdaFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *LetFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *ListFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *RestFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *SetFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *SubstrFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *ConcatFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *IsNumberFunc(JLContext *context, JLValue *args, void *extra);
@@ -54,71 +65,199 @@ static JLValue *IsListFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *IsNullFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *StrToIntFunc(JLContext *context, JLValue *args, void *extra);
 static JLValue *IntToStrFunc(JLContext *context, JLValue *args, void *extra);
-static char* itoa(NUMBER_TYPE num, int base);
-
-
-static InternalFunctionNode INTERNAL_FUNCTIONS[] = {
-   { "=",         CompareFunc    },
-   { "!=",        CompareFunc    },
-   { ">",         CompareFunc    },
-   { ">=",        CompareFunc    },
-   { "<",         CompareFunc    },
-   { "<=",        CompareFunc    },
-   { "+",         AddFunc        },
-   { "-",         SubFunc        },
-   { "*",         MulFunc        },
-   { "/",         DivFunc        },
-   { "%",       ModFunc        },
-   { "and",       AndFunc        },
-   { "or",        OrFunc         },
-   { "not",       NotFunc        },
-   { "&",         BitAndFunc     },
-   { "|",         BitOrFunc      },
-   { "^",         BitXorFunc     },
-   { "~",         BitNotFunc     },
-   { "<<",        BitShiftLeftFunc },
-   { ">>",        BitShiftRightFunc },
-   { "int",       StrToIntFunc   },
-   { "str",       IntToStrFunc   },
-   { "begin",     BeginFunc      },
-   { "cons",      ConsFunc       },
-   { "define",    DefineFunc     },
-   { "head",      HeadFunc       },
-   { "if",        IfFunc         },
-   { "lambda",    LambdaFunc     },
-   { "list",      ListFunc       },
-   { "rest",      RestFunc       },
-   { "substr",    SubstrFunc     },
-   { "concat",    ConcatFunc     },
-   { "number?",   IsNumberFunc   },
-   { "string?",   IsStringFunc   },
-   { "list?",     IsListFunc     },
-   { "null?",     IsNullFunc     }
+static JLValue *ToStringFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *MapFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *FilterFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *FoldlFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *ReverseFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *AppendFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *LengthFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *NthFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *WhileFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *YieldFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *TimeUsFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *SleepUsFunc(JLContext *context, JLValue *args, void *extra);
+
+
+static constexpr InternalFunctionNode INTERNAL_FUNCTIONS[] = {
+   { "=",         CompareFunc,       JLEVAL_STRICT },
+   { "!=",        CompareFunc,       JLEVAL_STRICT },
+   { ">",         CompareFunc,       JLEVAL_STRICT },
+   { ">=",        CompareFunc,       JLEVAL_STRICT },
+   { "<",         CompareFunc,       JLEVAL_STRICT },
+   { "<=",        CompareFunc,       JLEVAL_STRICT },
+   { "+",         AddFunc,           JLEVAL_STRICT },
+   { "-",         SubFunc,           JLEVAL_STRICT },
+   { "*",         MulFunc,           JLEVAL_STRICT },
+   { "/",         DivFunc,           JLEVAL_STRICT },
+   { "%",         ModFunc,           JLEVAL_STRICT },
+   { "and",       AndFunc,           JLEVAL_AND },
+   { "or",        OrFunc,            JLEVAL_OR },
+   { "not",       NotFunc,           JLEVAL_STRICT },
+   { "&",         BitAndFunc,        JLEVAL_STRICT },
+   { "|",         BitOrFunc,         JLEVAL_STRICT },
+   { "^",         BitXorFunc,        JLEVAL_STRICT },
+   { "~",         BitNotFunc,        JLEVAL_STRICT },
+   { "<<",        BitShiftLeftFunc,  JLEVAL_STRICT },
+   { ">>",        BitShiftRightFunc, JLEVAL_STRICT },
+   { "int",       StrToIntFunc,      JLEVAL_STRICT },
+   { "str",       IntToStrFunc,      JLEVAL_STRICT },
+   { "to-string", ToStringFunc,      JLEVAL_STRICT },
+   { "begin",     BeginFunc,         JLEVAL_BEGIN },
+   { "catch",     CatchFunc,         JLEVAL_CODE },
+   { "cons",      ConsFunc,          JLEVAL_STRICT },
+   { "define",    DefineFunc,        JLEVAL_DEFINE },
+   { "dotimes",   DotimesFunc,       JLEVAL_CODE },
+   { "head",      HeadFunc,          JLEVAL_STRICT },
+   { "if",        IfFunc,            JLEVAL_IF },
+   { "lambda",    LambdaFunc,        JLEVAL_CODE },
+   { "let",       LetFunc,           JLEVAL_LET },
+   { "list",      ListFunc,          JLEVAL_STRICT },
+   { "rest",      RestFunc,          JLEVAL_STRICT },
+   { "set!",      SetFunc,           JLEVAL_SET },
+   { "substr",    SubstrFunc,        JLEVAL_STRICT },
+   { "concat",    ConcatFunc,        JLEVAL_STRICT },
+   { "number?",   IsNumberFunc,      JLEVAL_STRICT },
+   { "string?",   IsStringFunc,      JLEVAL_STRICT },
+   { "list?",     IsListFunc,        JLEVAL_STRICT },
+   { "null?",     IsNullFunc,        JLEVAL_STRICT },
+   { "map",       MapFunc,           JLEVAL_STRICT },
+   { "filter",    FilterFunc,        JLEVAL_STRICT },
+   { "foldl",     FoldlFunc,         JLEVAL_STRICT },
+   { "reverse",   ReverseFunc,       JLEVAL_STRICT },
+   { "append",    AppendFunc,        JLEVAL_STRICT },
+   { "length",    LengthFunc,        JLEVAL_STRICT },
+   { "nth",       NthFunc,           JLEVAL_STRICT },
+   { "while",     WhileFunc,         JLEVAL_CODE },
+   { "yield",     YieldFunc,         JLEVAL_STRICT },
+   { "time-us",   TimeUsFunc,        JLEVAL_STRICT },
+   { "sleep-us",  SleepUsFunc,       JLEVAL_STRICT }
 };
-static size_t INTERNAL_FUNCTION_COUNT = sizeof(INTERNAL_FUNCTIONS)
-                                      / sizeof(InternalFunctionNode);
+DEFINE_BUILTIN_TABLE(INTERNAL_TABLE, INTERNAL_FUNCTIONS)
 
-char CheckCondition(JLContext *context, JLValue *value)
+char IsTrue(const JLValue *value)
 {
-   JLValue *cond = JLEvaluate(context, value);
-   char rc = 0;
-   if(cond) {
-      switch(cond->tag) {
+   if(value) {
+      switch(value->tag) {
       case JLVALUE_NUMBER:
-         rc = cond->value.number != 0.0;
-         break;
+         return !Number::IsZero(value->value.number);
       case JLVALUE_LIST:
-         rc = cond->value.lst != NULL;
-         break;
+         return value->value.lst != NULL;
       default:
-         rc = 1;
-         break;
+         return 1;
       }
-      JLRelease(context, cond);
    }
+   return 0;
+}
+
+char CheckCondition(JLContext *context, JLValue *value)
+{
+   JLValue *cond = JLEvaluate(context, value);
+   const char rc = IsTrue(cond);
+   JLRelease(context, cond);
    return rc;
 }
 
+char ContainsSymbol(const JLValue *value, const char *name)
+{
+   for(; value; value = value->next) {
+      if(value->tag == JLVALUE_VARIABLE && !strcmp(value->value.str, name)) {
+         return 1;
+      }
+      if(value->tag == JLVALUE_LIST && ContainsSymbol(value->value.lst, name)) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+JLValue *CreateCallForm(JLContext *context, const char *name, size_t count)
+{
+   /* The head is only used to name the function in errors. */
+   JLValue *form = CreateValue(context, NULL, JLVALUE_NIL);
+   JLValue **item = &form->next;
+   size_t i;
+   form->value.str = (char*)name;
+   for(i = 0; i < count; i++) {
+      *item = CreateCell(context, NULL);
+      item = &(*item)->next;
+   }
+   return form;
+}
+
+void SetArgument(JLContext *context, JLValue *cell, JLValue *value)
+{
+   JLRelease(context, cell->value.lst);
+   cell->value.lst = value;
+}
+
+void EvaluateBody(JLContext *context, JLValue *vp)
+{
+   for(; vp; vp = vp->next) {
+      JLRelease(context, JLEvaluate(context, vp));
+   }
+}
+
+JLValue *CallForm(JLContext *context, JLValue *func, JLValue **form)
+{
+   JLValue *result = ApplyFunction(context, func, *form);
+   if((*form)->next->count > 1) {
+      /* The function kept its arguments; use new cells next time. */
+      JLValue *old = *form;
+      size_t count = 0;
+      JLValue *vp;
+      for(vp = old->next; vp; vp = vp->next) {
+         count += 1;
+      }
+      *form = CreateCallForm(context, old->value.str, count);
+      JLRelease(context, old);
+   }
+   return result;
+}
+
+JLValue *EvaluateFunction(JLContext *context, JLValue *args, JLValue *vp)
+{
+   JLValue *func = JLEvaluate(context, vp);
+   if(func == NULL || (func->tag != JLVALUE_LAMBDA &&
+                       func->tag != JLVALUE_SPECIAL &&
+                       func->tag != JLVALUE_MEMO)) {
+      JLRelease(context, func);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   return func;
+}
+
+char EvaluateList(JLContext *context, JLValue *args, JLValue *vp,
+                  JLValue **result)
+{
+   /* nil is the empty list. */
+   *result = JLEvaluate(context, vp);
+   if(*result != NULL && (*result)->tag != JLVALUE_LIST) {
+      JLRelease(context, *result);
+      *result = NULL;
+      InvalidArgumentError(context, args);
+      return 0;
+   }
+   return 1;
+}
+
+JLValue *CreateTrue(JLContext *context)
+{
+   JLRetain(context, context->true_value);
+   return context->true_value;
+}
+
+int CompareBytes(const ByteBuffer *a, const ByteBuffer *b)
+{
+   const size_t len = a->length < b->length ? a->length : b->length;
+   const int diff = memcmp(a->data, b->data, len);
+   if(diff == 0) {
+      return a->length < b->length ? -1 : (a->length > b->length);
+   }
+   return diff;
+}
+
 void InvalidArgumentError(JLContext *context, JLValue *args)
 {
    Error(context, "invalid argument to %s", args->value.str);
@@ -150,6 +289,8 @@ JLValue *CompareFunc(JLContext *context, JLValue *args, void *extra)
       return NULL;
    }
 
+   PushRelease(context, &va);
+   PushRelease(context, &vb);
    va = JLEvaluate(context, args->next);
    vb = JLEvaluate(context, args->next->next);
    if(va == NULL || vb == NULL || va->tag != vb->tag) {
@@ -165,33 +306,37 @@ JLValue *CompareFunc(JLContext *context, JLValue *args, void *extra)
    } else {
 
       /* Here we know that va and vb are not nil and are of the same type. */
-      NUMBER_TYPE diff = 0;
+      int diff = 0;
       if(va->tag == JLVALUE_NUMBER) {
-         diff = va->value.number - vb->value.number;
+         diff = Number::Compare(va->value.number, vb->value.number);
       } else if(va->tag == JLVALUE_STRING) {
          diff = strcmp(va->value.str, vb->value.str);
+      } else if(va->tag == JLVALUE_BYTES) {
+         diff = CompareBytes(va->value.bytes, vb->value.bytes);
+      } else if(va->tag == JLVALUE_LIST && (op[0] == '=' || op[0] == '!')) {
+         diff = !EqualValues(va, vb);
       } else {
          InvalidArgumentError(context, args);
       }
 
       if(op[0] == '=') {
-         cond = diff == 0.0;
+         cond = diff == 0;
       } else if(op[0] == '!') {
-         cond = diff != 0.0;
+         cond = diff != 0;
       } else if(op[0] == '<' && op[1] == 0) {
-         cond = diff < 0.0;
+         cond = diff < 0;
       } else if(op[0] == '<' && op[1] == '=') {
-         cond = diff <= 0.0;
+         cond = diff <= 0;
       } else if(op[0] == '>' && op[1] == 0) {
-         cond = diff > 0.0;
+         cond = diff > 0;
       } else if(op[0] == '>' && op[1] == '=') {
-         cond = diff >= 0.0;
+         cond = diff >= 0;
       }
 
    }
 
    if(cond) {
-      result = JLDefineNumber(context, NULL, 1);
+      result = CreateTrue(context);
    }
 
    JLRelease(context, va);
@@ -206,20 +351,20 @@ JLValue *name(JLContext *context, JLValue *args, void *extra) {\
    for(vp = args->next; vp; vp = vp->next) {\
       JLValue *arg = JLEvaluate(context, vp);\
       if(arg == NULL || arg->tag != JLVALUE_NUMBER) {\
-         InvalidArgumentError(context, args);\
          JLRelease(context, arg);\
+         InvalidArgumentError(context, args);\
          return NULL;\
       }\
-      sum opr arg->value.number;\
+      sum = opr(sum, arg->value.number);\
       JLRelease(context, arg);\
    }\
    return JLDefineNumber(context, NULL, sum);\
 };
 
-DEFINE_BIT_ARITHMETIC(AddFunc, +=, 0)
-DEFINE_BIT_ARITHMETIC(BitAndFunc, &=, -1)
-DEFINE_BIT_ARITHMETIC(BitOrFunc, |=, 0)
-DEFINE_BIT_ARITHMETIC(BitXorFunc, ^=, 0)
+DEFINE_BIT_ARITHMETIC(AddFunc, Number::Add, Number::FromInt(0))
+DEFINE_BIT_ARITHMETIC(BitAndFunc, Number::And, Number::Not(0))
+DEFINE_BIT_ARITHMETIC(BitOrFunc, Number::Or, 0)
+DEFINE_BIT_ARITHMETIC(BitXorFunc, Number::Xor, 0)
 
 
 JLValue *SubFunc(JLContext *context, JLValue *args, void *extra)
@@ -230,8 +375,8 @@ JLValue *SubFunc(JLContext *context, JLValue *args, void *extra)
 
    arg = JLEvaluate(context, vp);
    if(arg == NULL || arg->tag != JLVALUE_NUMBER) {
-      InvalidArgumentError(context, args);
       JLRelease(context, arg);
+      InvalidArgumentError(context, args);
       return NULL;
    }
    total = arg->value.number;
@@ -240,11 +385,11 @@ JLValue *SubFunc(JLContext *context, JLValue *args, void *extra)
    for(vp = vp->next; vp; vp = vp->next) {
       arg = JLEvaluate(context, vp);
       if(arg == NULL || arg->tag != JLVALUE_NUMBER) {
-         InvalidArgumentError(context, args);
          JLRelease(context, arg);
+         InvalidArgumentError(context, args);
          return NULL;
       }
-      total -= arg->value.number;
+      total = Number::Sub(total, arg->value.number);
       JLRelease(context, arg);
    }
 
@@ -254,26 +399,28 @@ JLValue *SubFunc(JLContext *context, JLValue *args, void *extra)
 JLValue *MulFunc(JLContext *context, JLValue *args, void *extra)
 {
    JLValue *vp;
-   NUMBER_TYPE product = 1;
+   NUMBER_TYPE product = Number::FromInt(1);
    for(vp = args->next; vp; vp = vp->next) {
       JLValue *arg = JLEvaluate(context, vp);
       if(arg == NULL || arg->tag != JLVALUE_NUMBER) {
-         InvalidArgumentError(context, args);
          JLRelease(context, arg);
+         InvalidArgumentError(context, args);
          return NULL;
       }
-      product *= arg->value.number;
+      product = Number::Mul(product, arg->value.number);
       JLRelease(context, arg);
    }
    return JLDefineNumber(context, NULL, product);
 }
 
-#define DEFINE_DIV_ARITHMETIC(name, opr)\
+#define DEFINE_DIV_ARITHMETIC(name, opr, check_zero)\
 JLValue *name(JLContext *context, JLValue *args, void *extra)\
 {\
    JLValue *va = NULL;\
    JLValue *vb = NULL;\
    JLValue *result = NULL;\
+   PushRelease(context, &va);\
+   PushRelease(context, &vb);\
    va = JLEvaluate(context, args->next);\
    if(va == NULL || va->tag != JLVALUE_NUMBER) {\
       InvalidArgumentError(context, args);\
@@ -288,17 +435,22 @@ JLValue *name(JLContext *context, JLValue *args, void *extra)\
       TooManyArgumentsError(context, args);\
       goto div_done;\
    }\
-   result = JLDefineNumber(context, NULL, va->value.number opr vb->value.number);\
+   if(check_zero && Number::IsZero(vb->value.number)) {\
+      Error(context, "division by zero");\
+      goto div_done;\
+   }\
+   result = JLDefineNumber(context, NULL,\
+                           opr(va->value.number, vb->value.number));\
 div_done:\
    JLRelease(context, va);\
    JLRelease(context, vb);\
    return result;\
 }
 
-DEFINE_DIV_ARITHMETIC(DivFunc, /)
-DEFINE_DIV_ARITHMETIC(ModFunc, %)
-DEFINE_DIV_ARITHMETIC(BitShiftLeftFunc, <<)
-DEFINE_DIV_ARITHMETIC(BitShiftRightFunc, >>)
+DEFINE_DIV_ARITHMETIC(DivFunc, Number::Div, 1)
+DEFINE_DIV_ARITHMETIC(ModFunc, Number::Mod, 1)
+DEFINE_DIV_ARITHMETIC(BitShiftLeftFunc, Number::Shl, 0)
+DEFINE_DIV_ARITHMETIC(BitShiftRightFunc, Number::Shr, 0)
 
 JLValue *AndFunc(JLContext *context, JLValue *args, void *extra)
 {
@@ -308,7 +460,7 @@ JLValue *AndFunc(JLContext *context, JLValue *args, void *extra)
          return NULL;
       }
    }
-   return JLDefineNumber(context, NULL, 1);
+   return CreateTrue(context);
 }
 
 JLValue *OrFunc(JLContext *context, JLValue *args, void *extra)
@@ -316,7 +468,7 @@ JLValue *OrFunc(JLContext *context, JLValue *args, void *extra)
    JLValue *vp;
    for(vp = args->next; vp; vp = vp->next) {
       if(CheckCondition(context, vp)) {
-         return JLDefineNumber(context, NULL, 1);
+         return CreateTrue(context);
       }
    }
    return NULL;
@@ -333,7 +485,7 @@ JLValue *NotFunc(JLContext *context, JLValue *args, void *extra)
       return NULL;
    }
    if(!CheckCondition(context, args->next)) {
-      return JLDefineNumber(context, NULL, 1);
+      return CreateTrue(context);
    } else {
       return NULL;
    }
@@ -353,11 +505,12 @@ JLValue *BitNotFunc(JLContext *context, JLValue *args, void *extra)
    JLValue *result = NULL;
    va = JLEvaluate(context, args->next);
    if(va == NULL || va->tag != JLVALUE_NUMBER) {
-      InvalidArgumentError(context, args);
       JLRelease(context, va);
+      InvalidArgumentError(context, args);
       return NULL;
    }
-   result = JLDefineNumber(context, NULL, ~va->value.number);
+   result = JLDefineNumber(context, NULL, Number::Not(va->value.number));
+   JLRelease(context, va);
    return result;
 }
 
@@ -367,18 +520,31 @@ JLValue *StrToIntFunc(JLContext *context, JLValue *args, void *extra) {
       return NULL;
    }
 
-   JLValue *va = JLEvaluate(context, args->next);
-   JLValue *vb = JLEvaluate(context, args->next->next);
+   JLValue *va = NULL;
+   JLValue *vb = NULL;
    JLValue *result = NULL;
    char *pEnd = NULL;
+   long long base = 0;
+
+   PushRelease(context, &va);
+   PushRelease(context, &vb);
+   va = JLEvaluate(context, args->next);
+   vb = JLEvaluate(context, args->next->next);
 
-   if (!va || va->tag != JLVALUE_STRING || !vb || vb->tag != JLVALUE_NUMBER) {
+   if(vb && vb->tag == JLVALUE_NUMBER) {
+      base = Number::ToInt(vb->value.number);
+   }
+   if (!va || va->tag != JLVALUE_STRING || base < 2 || base > 36) {
       InvalidArgumentError(context, args);
       JLRelease(context, va);
+      JLRelease(context, vb);
       return NULL;
    }
 
-   result = JLDefineNumber(context, NULL, strtol(va->value.str, &pEnd, vb->value.number));
+   result = JLDefineNumber(context, NULL, Number::FromInt(
+      strtoll(va->value.str, &pEnd, (int)base)));
+   JLRelease(context, va);
+   JLRelease(context, vb);
    return result;
 }
 
@@ -388,32 +554,141 @@ JLValue *IntToStrFunc(JLContext *context, JLValue *args, void *extra) {
       return NULL;
    }
 
-   JLValue *va = JLEvaluate(context, args->next);
-   JLValue *vb = JLEvaluate(context, args->next->next);
+   JLValue *va = NULL;
+   JLValue *vb = NULL;
    JLValue *result = NULL;
-   char *pEnd = NULL;
+   char buffer[NUMBER_BUFFER_SIZE];
+   long long base = 0;
+   size_t len;
 
-   if (!va || va->tag != JLVALUE_NUMBER || !vb || vb->tag != JLVALUE_NUMBER) {
+   PushRelease(context, &va);
+   PushRelease(context, &vb);
+   va = JLEvaluate(context, args->next);
+   vb = JLEvaluate(context, args->next->next);
+
+   if(vb && vb->tag == JLVALUE_NUMBER) {
+      base = Number::ToInt(vb->value.number);
+   }
+   if (!va || va->tag != JLVALUE_NUMBER || base < 2 || base > 36) {
       InvalidArgumentError(context, args);
       JLRelease(context, va);
+      JLRelease(context, vb);
       return NULL;
    }
-   
+
+   len = Number::Format(buffer, va->value.number, (unsigned)base);
    result = CreateValue(context, NULL, JLVALUE_STRING);
-   result->value.str = itoa(va->value.number, vb->value.number);
+   result->value.str = (char*)AllocMemory(context, len + 1);
+   memcpy(result->value.str, buffer, len);
+   result->value.str[len] = 0;
+   JLRelease(context, va);
+   JLRelease(context, vb);
    return result;
 }
 
+JLValue *ToStringFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg = NULL;
+   JLValue *result = NULL;
+   char *str;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   PushRelease(context, &arg);
+   arg = JLEvaluate(context, args->next);
+   str = PrintToString(context, arg);
+   result = CreateValue(context, NULL, JLVALUE_STRING);
+   result->value.str = str;
+   JLRelease(context, arg);
+   return result;
+}
+
+char BeginNeedsScope(JLValue *args)
+{
+   /* Only a sequence that defines something needs its own scope. */
+   if(!(args->flags & JLVALUE_FLAG_SCANNED) && IsRomValue(args)) {
+      return ContainsSymbol(args->next, "define");
+   }
+   if(!(args->flags & JLVALUE_FLAG_SCANNED)) {
+      args->flags |= JLVALUE_FLAG_SCANNED;
+      if(ContainsSymbol(args->next, "define")) {
+         args->flags |= JLVALUE_FLAG_DEFINES;
+      }
+   }
+   return (args->flags & JLVALUE_FLAG_DEFINES) != 0;
+}
+
 JLValue *BeginFunc(JLContext *context, JLValue *args, void *extra)
 {
    JLValue *vp;
    JLValue *result = NULL;
-   JLEnterScope(context);
+   const char defines = BeginNeedsScope(args);
+
+   if(defines) {
+      JLEnterScope(context);
+      PushScopeRelease(context, context->scope->next, NULL, 0);
+   }
+   PushRelease(context, &result);
    for(vp = args->next; vp; vp = vp->next) {
       JLRelease(context, result);
       result = JLEvaluate(context, vp);
    }
-   JLLeaveScope(context);
+   if(defines) {
+      JLLeaveScope(context);
+   }
+   return result;
+}
+
+JLValue *CatchFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *result = NULL;
+   JLValue *message = NULL;
+   JLValue *handler = NULL;
+   JLValue *form = NULL;
+
+   /* (catch expr handler) */
+   if(args->next == NULL || args->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   if(TryEvaluate(context, args->next, &result)) {
+      return result;
+   }
+
+   /* Take the message before the handler can raise another error. */
+   context->error = 0;
+   message = CreateValue(context, NULL, JLVALUE_STRING);
+   message->value.str = CopyString(context, context->error_message);
+   PushRelease(context, &message);
+   PushRelease(context, &handler);
+   PushRelease(context, &form);
+
+   handler = JLEvaluate(context, args->next->next);
+   if(handler && (handler->tag == JLVALUE_LAMBDA ||
+                  handler->tag == JLVALUE_SPECIAL ||
+                  handler->tag == JLVALUE_MEMO)) {
+      /* A function is called with the message. */
+      form = CreateCallForm(context, args->value.str, 1);
+      SetArgument(context, form->next, message);
+      message = NULL;
+      result = ApplyFunction(context, handler, form);
+      JLRelease(context, form);
+      JLRelease(context, handler);
+   } else {
+      result = handler;
+   }
+   JLRelease(context, message);
    return result;
 }
 
@@ -421,7 +696,6 @@ JLValue *ConsFunc(JLContext *context, JLValue *args, void *extra)
 {
    JLValue *head = NULL;
    JLValue *rest = NULL;
-   JLValue *temp = NULL;
    JLValue *result = NULL;
 
    if(args->next == NULL || args->next->next == NULL) {
@@ -435,14 +709,13 @@ JLValue *ConsFunc(JLContext *context, JLValue *args, void *extra)
 
    rest = JLEvaluate(context, args->next->next);
    if(rest != NULL && rest->tag != JLVALUE_LIST) {
-      InvalidArgumentError(context, args);
       JLRelease(context, rest);
+      InvalidArgumentError(context, args);
       return NULL;
    }
+   PushRelease(context, &rest);
 
-   temp = JLEvaluate(context, args->next);
-   head = CopyValue(context, temp);
-   JLRelease(context, temp);
+   head = CreateCell(context, JLEvaluate(context, args->next));
 
    result = CreateValue(context, NULL, JLVALUE_LIST);
    if(rest) {
@@ -452,7 +725,7 @@ JLValue *ConsFunc(JLContext *context, JLValue *args, void *extra)
    }
    result->value.lst = head;
 
-   return result;
+   return InternList(context, result);
 }
 
 JLValue *DefineFunc(JLContext *context, JLValue *args, void *extra)
@@ -472,21 +745,82 @@ JLValue *DefineFunc(JLContext *context, JLValue *args, void *extra)
    return result;
 }
 
+JLValue *DotimesFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *spec = args->next;
+   JLValue *limit;
+   JLValue **slot;
+   FrameBinding *frame;
+   long long count;
+   long long i;
+
+   /* (dotimes (name count) body...) */
+   if(spec == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(spec->tag != JLVALUE_LIST || spec->value.lst == NULL ||
+      spec->value.lst->tag != JLVALUE_VARIABLE) {
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   limit = JLEvaluate(context, spec->value.lst->next);
+   if(limit == NULL || limit->tag != JLVALUE_NUMBER) {
+      JLRelease(context, limit);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   count = Number::ToInt(limit->value.number);
+   JLRelease(context, limit);
+
+   frame = PushFrame(context, 1);
+   JLEnterScope(context);
+   context->scope->frame = frame;
+   PushScopeRelease(context, context->scope->next, frame, 1);
+   if(frame) {
+      frame[0].name = spec->value.lst->value.str;
+      frame[0].value = NULL;
+      context->scope->frame_count = 1;
+   } else {
+      DefineBinding(context, context->scope, spec->value.lst->value.str,
+                    NULL);
+   }
+
+   for(i = 0; i < count; i++) {
+
+      /* An empty body takes no steps of its own. */
+      CountStep(context);
+
+      /* Reuse the counter if nothing else refers to it. */
+      slot = FindValue(context, spec->value.lst->value.str);
+      if(*slot && (*slot)->count == 1 && (*slot)->tag == JLVALUE_NUMBER &&
+         !((*slot)->flags & JLVALUE_FLAG_INTERNED)) {
+         (*slot)->value.number = Number::FromInt(i);
+      } else {
+         JLRelease(context, *slot);
+         *slot = JLDefineNumber(context, NULL, Number::FromInt(i));
+      }
+
+      EvaluateBody(context, args->next->next);
+   }
+
+   LeaveFrameScope(context, frame, 1);
+   return NULL;
+}
+
 JLValue *HeadFunc(JLContext *context, JLValue *args, void *extra)
 {
    JLValue *result = NULL;
    JLValue *vp = JLEvaluate(context, args->next);
 
    if(vp == NULL || vp->tag != JLVALUE_LIST) {
+      JLRelease(context, vp);
       InvalidArgumentError(context, args);
-      goto head_done;
+      return NULL;
    }
 
-   result = vp->value.lst;
+   result = GetElement(vp->value.lst);
    JLRetain(context, result);
-
-head_done:
-
    JLRelease(context, vp);
    return result;
 }
@@ -512,6 +846,10 @@ JLValue *LambdaFunc(JLContext *context, JLValue *args, void *extra)
       return NULL;
    }
 
+   ExpandMacros(context, args->next->next);
+
+   /* Frames in the chain are moved to the heap only if the lambda is
+    * still around when they are left (see LeaveFrameScope). */
    scope = CreateValue(context, NULL, JLVALUE_SCOPE);
    scope->value.scope = context->scope;
    context->scope->count += 1;
@@ -524,22 +862,78 @@ JLValue *LambdaFunc(JLContext *context, JLValue *args, void *extra)
    return result;
 }
 
+JLValue *LetFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *result = NULL;
+   JLValue *bp;
+   JLValue *value;
+   ScopeNode *scope;
+   FrameBinding *frame;
+   unsigned int size = 0;
+
+   /* (let ((name value) ...) body...) */
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->tag != JLVALUE_LIST) {
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   for(bp = args->next->value.lst; bp; bp = bp->next) {
+      if(bp->tag != JLVALUE_LIST || bp->value.lst == NULL ||
+         bp->value.lst->tag != JLVALUE_VARIABLE) {
+         InvalidArgumentError(context, args);
+         return NULL;
+      }
+      size += 1;
+   }
+
+   /* All of the bindings share one frame. */
+   frame = PushFrame(context, size);
+   JLEnterScope(context);
+   scope = context->scope;
+   scope->frame = frame;
+   PushScopeRelease(context, scope->next, frame, size);
+   PushRelease(context, &result);
+   for(bp = args->next->value.lst; bp; bp = bp->next) {
+      context->scope = scope->next;
+      value = JLEvaluate(context, bp->value.lst->next);
+      context->scope = scope;
+      if(frame) {
+         frame[scope->frame_count].name = bp->value.lst->value.str;
+         frame[scope->frame_count].value = value;
+         scope->frame_count += 1;
+      } else {
+         DefineBinding(context, scope, bp->value.lst->value.str, value);
+         JLRelease(context, value);
+      }
+   }
+
+   for(bp = args->next->next; bp; bp = bp->next) {
+      JLRelease(context, result);
+      result = JLEvaluate(context, bp);
+   }
+
+   LeaveFrameScope(context, frame, size);
+   return result;
+}
+
 JLValue *ListFunc(JLContext *context, JLValue *args, void *extra)
 {
    JLValue *result = NULL;
    if(args->next) {
       result = CreateValue(context, NULL, JLVALUE_LIST);
+      result->value.lst = NULL;
+      PushRelease(context, &result);
       JLValue **item = &result->value.lst;
       JLValue *vp;
       for(vp = args->next; vp; vp = vp->next) {
-         JLValue *arg = JLEvaluate(context, vp);
-         JLValue *temp = CopyValue(context, arg);
-         *item = temp;
-         item = &temp->next;
-         JLRelease(context, arg);
+         *item = CreateCell(context, JLEvaluate(context, vp));
+         item = &(*item)->next;
       }
    }
-   return result;
+   return InternList(context, result);
 }
 
 JLValue *RestFunc(JLContext *context, JLValue *args, void *extra)
@@ -548,8 +942,9 @@ JLValue *RestFunc(JLContext *context, JLValue *args, void *extra)
    JLValue *vp = JLEvaluate(context, args->next);
 
    if(vp == NULL || vp->tag != JLVALUE_LIST) {
+      JLRelease(context, vp);
       InvalidArgumentError(context, args);
-      goto rest_done;
+      return NULL;
    }
 
    if(vp->value.lst && vp->value.lst->next) {
@@ -557,10 +952,39 @@ JLValue *RestFunc(JLContext *context, JLValue *args, void *extra)
       result->value.lst = vp->value.lst->next;
       JLRetain(context, result->value.lst);
    }
+   JLRelease(context, vp);
+   return result;
+}
 
-rest_done:
+JLValue *SetFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *vp = args->next;
+   JLValue *result;
+   JLValue **slot;
+   if(vp == NULL || vp->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(vp->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   if(vp->tag != JLVALUE_VARIABLE) {
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
 
-   JLRelease(context, vp);
+   /* Evaluate first: that can move frame bindings to the heap. */
+   result = JLEvaluate(context, vp->next);
+   slot = FindValue(context, vp->value.str);
+   if(slot == NULL) {
+      JLRelease(context, result);
+      Error(context, "set! of unbound symbol: %s", vp->value.str);
+      return NULL;
+   }
+   JLRelease(context, *slot);
+   *slot = result;
+   JLRetain(context, result);
    return result;
 }
 
@@ -574,6 +998,9 @@ JLValue *SubstrFunc(JLContext *context, JLValue *args, void *extra)
    size_t len        = (size_t)-1;
    size_t slen;
 
+   PushRelease(context, &str);
+   PushRelease(context, &sval);
+   PushRelease(context, &lval);
    str = JLEvaluate(context, args->next);
    if(!str || str->tag != JLVALUE_STRING) {
       InvalidArgumentError(context, args);
@@ -586,7 +1013,7 @@ JLValue *SubstrFunc(JLContext *context, JLValue *args, void *extra)
          InvalidArgumentError(context, args);
          goto substr_done;
       }
-      start = (size_t)sval->value.number;
+      start = (size_t)Number::ToInt(sval->value.number);
    }
 
    if(args->next->next) {
@@ -600,7 +1027,7 @@ JLValue *SubstrFunc(JLContext *context, JLValue *args, void *extra)
             InvalidArgumentError(context, args);
             goto substr_done;
          }
-         len = (size_t)lval->value.number;
+         len = (size_t)Number::ToInt(lval->value.number);
       }
    }
 
@@ -608,7 +1035,7 @@ JLValue *SubstrFunc(JLContext *context, JLValue *args, void *extra)
    if(start < slen && len > 0) {
       len = slen - start > len ? len : slen - start;
       result = CreateValue(context, NULL, JLVALUE_STRING);
-      result->value.str = (char*)malloc(len + 1);
+      result->value.str = (char*)AllocMemory(context, len + 1);
       memcpy(result->value.str, &str->value.str[start], len);
       result->value.str[len] = 0;
    }
@@ -626,28 +1053,32 @@ substr_done:
 JLValue *ConcatFunc(JLContext *context, JLValue *args, void *extra)
 {
    JLValue *result = CreateValue(context, NULL, JLVALUE_STRING);
+   JLValue *arg = NULL;
    JLValue *vp;
    size_t len = 0;
    size_t max_len = 8;
-   result->value.str = (char*)malloc(max_len);
+   result->value.str = (char*)AllocMemory(context, max_len);
+   PushRelease(context, &result);
+   PushRelease(context, &arg);
    for(vp = args->next; vp; vp = vp->next) {
-      JLValue *arg = JLEvaluate(context, vp);
+      arg = JLEvaluate(context, vp);
       if(arg == NULL || arg->tag != JLVALUE_STRING) {
          InvalidArgumentError(context, args);
-         JLRelease(context, arg);
-         JLRelease(context, result);
          return NULL;
       } else {
          const size_t l = strlen(arg->value.str);
          const size_t new_len = len + l;
          if(new_len >= max_len) {
             max_len = new_len + 1;
-            result->value.str = (char*)realloc(result->value.str, max_len);
+            result->value.str = (char*)ResizeMemory(context,
+                                                    result->value.str,
+                                                    max_len);
          }
          memcpy(&result->value.str[len], arg->value.str, l);
          len = new_len;
       }
       JLRelease(context, arg);
+      arg = NULL;
    }
    result->value.str[len] = 0;
    return result;
@@ -669,7 +1100,7 @@ JLValue *IsNumberFunc(JLContext *context, JLValue *args, void *extra)
 
    arg = JLEvaluate(context, args->next);
    if(arg && arg->tag == JLVALUE_NUMBER) {
-      result = JLDefineNumber(context, NULL, 1);
+      result = CreateTrue(context);
    }
    JLRelease(context, arg);
    return result;
@@ -691,7 +1122,7 @@ JLValue *IsStringFunc(JLContext *context, JLValue *args, void *extra)
 
    arg = JLEvaluate(context, args->next);
    if(arg && arg->tag == JLVALUE_STRING) {
-      result = JLDefineNumber(context, NULL, 1);
+      result = CreateTrue(context);
    }
    JLRelease(context, arg);
    return result;
@@ -714,7 +1145,7 @@ JLValue *IsListFunc(JLContext *context, JLValue *args, void *extra)
 
    arg = JLEvaluate(context, args->next);
    if(arg && arg->tag == JLVALUE_LIST) {
-      result = JLDefineNumber(context, NULL, 1);
+      result = CreateTrue(context);
    }
    JLRelease(context, arg);
    return result;
@@ -735,60 +1166,393 @@ JLValue *IsNullFunc(JLContext *context, JLValue *args, void *extra)
 
    arg = JLEvaluate(context, args->next);
    if(arg == NULL) {
-      return JLDefineNumber(context, NULL, 1);
+      return CreateTrue(context);
    } else {
       JLRelease(context, arg);
       return NULL;
    }
 }
 
-void RegisterFunctions(JLContext *context)
+JLValue *MapFunc(JLContext *context, JLValue *args, void *extra)
 {
-   size_t i;
-   for(i = 0; i < INTERNAL_FUNCTION_COUNT; i++) {
-      JLDefineSpecial(context, INTERNAL_FUNCTIONS[i].name,
-                      INTERNAL_FUNCTIONS[i].function, NULL);
+   JLValue *func = NULL;
+   JLValue *lst = NULL;
+   JLValue *form = NULL;
+   JLValue *result = NULL;
+   JLValue **item = &result;
+   JLValue *vp;
+
+   if(args->next == NULL || args->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
    }
+   if(args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   PushRelease(context, &func);
+   PushRelease(context, &lst);
+   PushRelease(context, &form);
+   PushRelease(context, &result);
+   func = EvaluateFunction(context, args, args->next);
+   if(func == NULL || !EvaluateList(context, args, args->next->next, &lst)) {
+      goto map_done;
+   }
+   if(lst == NULL) {
+      goto map_done;
+   }
+
+   form = CreateCallForm(context, args->value.str, 1);
+   for(vp = lst->value.lst; vp; vp = vp->next) {
+      JLValue *element = GetElement(vp);
+      JLRetain(context, element);
+      SetArgument(context, form->next, element);
+      element = CallForm(context, func, &form);
+      if(result == NULL) {
+         result = CreateValue(context, NULL, JLVALUE_LIST);
+         item = &result->value.lst;
+      }
+      *item = CreateCell(context, element);
+      item = &(*item)->next;
+   }
+
+map_done:
+
+   JLRelease(context, form);
+   JLRelease(context, lst);
+   JLRelease(context, func);
+   return result;
 }
 
-char* itoa(NUMBER_TYPE num, int base) {
-   uint bufMaxSize = 16;
-   char *pBuf = (char*) malloc(bufMaxSize);
-   bool neg = false;
-   char *pPos = pBuf;
+JLValue *FilterFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *func = NULL;
+   JLValue *lst = NULL;
+   JLValue *form = NULL;
+   JLValue *result = NULL;
+   JLValue **item = &result;
+   JLValue *vp;
+
+   if(args->next == NULL || args->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
 
-   if (base == 10 && num <0) {
-      num *= -1;
-      neg = true;
+   PushRelease(context, &func);
+   PushRelease(context, &lst);
+   PushRelease(context, &form);
+   PushRelease(context, &result);
+   func = EvaluateFunction(context, args, args->next);
+   if(func == NULL || !EvaluateList(context, args, args->next->next, &lst)) {
+      goto filter_done;
+   }
+   if(lst == NULL) {
+      goto filter_done;
    }
-   for (unsigned rest = num; rest > 1; rest /= base) {
-      if (pPos - pBuf >= bufMaxSize) {
-         char *pNew = (char*) realloc(pBuf, bufMaxSize *= 2);
-         pPos = pNew + (pPos - pBuf);
-         pBuf = pNew; 
+
+   form = CreateCallForm(context, args->value.str, 1);
+   for(vp = lst->value.lst; vp; vp = vp->next) {
+      JLValue *element = GetElement(vp);
+      JLValue *keep;
+      JLRetain(context, element);
+      SetArgument(context, form->next, element);
+      keep = CallForm(context, func, &form);
+      if(IsTrue(keep)) {
+         if(result == NULL) {
+            result = CreateValue(context, NULL, JLVALUE_LIST);
+            item = &result->value.lst;
+         }
+         JLRetain(context, element);
+         *item = CreateCell(context, element);
+         item = &(*item)->next;
       }
+      JLRelease(context, keep);
+   }
+
+filter_done:
+
+   JLRelease(context, form);
+   JLRelease(context, lst);
+   JLRelease(context, func);
+   return result;
+}
+
+JLValue *FoldlFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *func = NULL;
+   JLValue *lst = NULL;
+   JLValue *form = NULL;
+   JLValue *result = NULL;
+   JLValue *vp;
+
+   if(args->next == NULL || args->next->next == NULL ||
+      args->next->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   func = EvaluateFunction(context, args, args->next);
+   if(func == NULL) {
+      return NULL;
+   }
+   PushRelease(context, &func);
+   PushRelease(context, &lst);
+   PushRelease(context, &form);
+   PushRelease(context, &result);
+   result = JLEvaluate(context, args->next->next);
+   if(!EvaluateList(context, args, args->next->next->next, &lst)) {
+      goto foldl_done;
+   }
+   if(lst == NULL) {
+      goto foldl_done;
+   }
+
+   form = CreateCallForm(context, args->value.str, 2);
+   for(vp = lst->value.lst; vp; vp = vp->next) {
+      JLValue *element = GetElement(vp);
+      JLRetain(context, element);
+      SetArgument(context, form->next, result);
+      SetArgument(context, form->next->next, element);
+      result = NULL;    /* Now held by the form. */
+      result = CallForm(context, func, &form);
+   }
+
+foldl_done:
+
+   JLRelease(context, form);
+   JLRelease(context, lst);
+   JLRelease(context, func);
+   return result;
+}
+
+JLValue *ReverseFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *lst = NULL;
+   JLValue *result = NULL;
+   JLValue *vp;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   if(!EvaluateList(context, args, args->next, &lst) || lst == NULL) {
+      return NULL;
+   }
+
+   result = CreateValue(context, NULL, JLVALUE_LIST);
+   result->value.lst = NULL;
+   for(vp = lst->value.lst; vp; vp = vp->next) {
+      JLValue *element = GetElement(vp);
+      JLValue *cell;
+      JLRetain(context, element);
+      cell = CreateCell(context, element);
+      cell->next = result->value.lst;
+      result->value.lst = cell;
+   }
+   JLRelease(context, lst);
+   return result;
+}
 
-      uint digit = rest % base;
-      if (digit < 10) {
-         *pPos++ = 0x30 + digit;
+JLValue *AppendFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *result = NULL;
+   JLValue **item = &result;
+   JLValue *ap;
+   JLValue *vp;
+
+   PushRelease(context, &result);
+   for(ap = args->next; ap; ap = ap->next) {
+      JLValue *lst;
+      if(!EvaluateList(context, args, ap, &lst)) {
+         return NULL;
+      }
+      if(lst == NULL) {
+         continue;
+      }
+      if(result == NULL) {
+         result = CreateValue(context, NULL, JLVALUE_LIST);
+         result->value.lst = NULL;
+         item = &result->value.lst;
+      }
+      if(ap->next == NULL) {
+         /* The last list is shared rather than copied. */
+         *item = lst->value.lst;
+         JLRetain(context, *item);
       } else {
-         *pPos++ = 0x40 + digit - 9;
+         for(vp = lst->value.lst; vp; vp = vp->next) {
+            JLValue *element = GetElement(vp);
+            JLRetain(context, element);
+            *item = CreateCell(context, element);
+            item = &(*item)->next;
+         }
+      }
+      JLRelease(context, lst);
+   }
+   return result;
+}
+
+JLValue *LengthFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *lst;
+   JLValue *vp;
+   long long count = 0;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   if(!EvaluateList(context, args, args->next, &lst)) {
+      return NULL;
+   }
+   if(lst) {
+      for(vp = lst->value.lst; vp; vp = vp->next) {
+         count += 1;
+      }
+      JLRelease(context, lst);
+   }
+   return JLDefineNumber(context, NULL, Number::FromInt(count));
+}
+
+JLValue *NthFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *index;
+   JLValue *lst = NULL;
+   JLValue *result = NULL;
+   JLValue *vp = NULL;
+   long long n;
+
+   if(args->next == NULL || args->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   index = JLEvaluate(context, args->next);
+   if(index == NULL || index->tag != JLVALUE_NUMBER) {
+      JLRelease(context, index);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   n = Number::ToInt(index->value.number);
+   JLRelease(context, index);
+
+   if(!EvaluateList(context, args, args->next->next, &lst)) {
+      return NULL;
+   }
+   if(lst && n >= 0) {
+      for(vp = lst->value.lst; vp && n > 0; vp = vp->next) {
+         n -= 1;
       }
    }
+   if(vp) {
+      result = GetElement(vp);
+      JLRetain(context, result);
+   }
+   JLRelease(context, lst);
+   if(vp == NULL) {
+      Error(context, "index out of range in %s", args->value.str);
+   }
+   return result;
+}
 
-   if (neg) {
-      *pPos++ = '-';
+JLValue *WhileFunc(JLContext *context, JLValue *args, void *extra)
+{
+   /* (while condition body...) */
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
    }
-   
-   *pPos = '\0';
-   // reverse string
-   char c;
-   for (int i = 0, j = strlen(pBuf)-1; i<j; i++, j--) {
-      c = pBuf[i];
-      pBuf[i] = pBuf[j];
-      pBuf[j] = c;
+   while(CheckCondition(context, args->next)) {
+      CountStep(context);
+      EvaluateBody(context, args->next->next);
    }
+   return NULL;
+}
+
+JLValue *YieldFunc(JLContext *context, JLValue *args, void *extra)
+{
+   size_t pending;
+   if(args->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   /* A good place to catch up on deferred releases. */
+   pending = JLDrainReleases(context, JL_RELEASE_SLICE);
+   return JLDefineNumber(context, NULL, Number::FromInt((long long)pending));
+}
+
+JLValue *TimeUsFunc(JLContext *context, JLValue *args, void *extra)
+{
+   if(args->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   return JLDefineNumber(context, NULL, Number::FromCounter(JLGetTimeUs()));
+}
 
-   return pBuf;
+JLValue *SleepUsFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   long long us;
+   char capped = 0;
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   arg = JLEvaluate(context, args->next);
+   if(arg == NULL || arg->tag != JLVALUE_NUMBER) {
+      JLRelease(context, arg);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   us = Number::ToInt(arg->value.number);
+   JLRelease(context, arg);
+   if(us <= 0) {
+      return NULL;
+   }
+   if(context->budget_deadline) {
+      /* Don't sleep past the deadline of JLEvaluateWithBudget. */
+      const uint64_t now = JLGetTimeUs();
+      if(now + (uint64_t)us >= context->budget_deadline) {
+         us = now < context->budget_deadline
+            ? (long long)(context->budget_deadline - now) : 0;
+         capped = 1;
+      }
+   }
+   SleepUs(context, (uint64_t)us);
+   if(capped) {
+      CheckBudget(context);
+   }
+   return NULL;
 }
 
+void RegisterFunctions(JLContext *context)
+{
+   RegisterBuiltins(context, &INTERNAL_TABLE);
+}
@@ -9,8 +9,138 @@
 #ifndef JL_FUNC_H
 #define JL_FUNC_H
 
-struct JLContext;
+#include "jl.h"
+
+#include <stdint.h>
+
+typedef struct InternalFunctionNode {
+   const char *name;
+   JLFunction function;
+   unsigned char eval;           /**< JLEVAL_* (see jl-value.h). */
+} InternalFunctionNode;
+
+/** A table of built-in functions indexed by a perfect hash.
+ * These are generated at compile time (see DEFINE_BUILTIN_TABLE) so the
+ * whole table lives in flash.
+ */
+typedef struct BuiltinTable {
+   const InternalFunctionNode *functions;
+   const unsigned char *slots;      /**< Function index + 1 (0 if empty). */
+   uint32_t seed;
+   uint32_t mask;
+   size_t count;
+} BuiltinTable;
+
+/** Hash a name (FNV-1a with a seed). */
+constexpr uint32_t HashName(const char *name, uint32_t seed)
+{
+   uint32_t hash = 2166136261u ^ (seed * 0x9E3779B9u);
+   while(*name) {
+      hash ^= (unsigned char)*name;
+      hash *= 16777619u;
+      name += 1;
+   }
+   return hash ^ (hash >> 15);
+}
+
+constexpr size_t BuiltinHashSize(size_t count)
+{
+   size_t size = 8;
+   while(size < count * 4) {
+      size *= 2;
+   }
+   return size;
+}
+
+template<size_t SIZE>
+struct BuiltinHash {
+   uint32_t seed;
+   unsigned char slots[SIZE];
+};
+
+/** Search for a seed that maps every name to its own slot. */
+template<size_t SIZE, size_t COUNT>
+constexpr BuiltinHash<SIZE> MakeBuiltinHash(
+   const InternalFunctionNode (&functions)[COUNT])
+{
+   static_assert(COUNT < 255, "too many functions for one table");
+   BuiltinHash<SIZE> hash = {};
+   for(uint32_t seed = 1; seed < 100000; seed++) {
+      bool found = true;
+      for(size_t i = 0; i < SIZE; i++) {
+         hash.slots[i] = 0;
+      }
+      for(size_t i = 0; i < COUNT && found; i++) {
+         const uint32_t slot = HashName(functions[i].name, seed) & (SIZE - 1);
+         if(hash.slots[slot]) {
+            found = false;
+         } else {
+            hash.slots[slot] = (unsigned char)(i + 1);
+         }
+      }
+      if(found) {
+         hash.seed = seed;
+         return hash;
+      }
+   }
+   hash.seed = 0;
+   return hash;
+}
+
+#define DEFINE_BUILTIN_TABLE(table, functions)                             \
+   static constexpr size_t table##_COUNT                                   \
+      = sizeof(functions) / sizeof(InternalFunctionNode);                  \
+   static constexpr BuiltinHash<BuiltinHashSize(table##_COUNT)>            \
+      table##_HASH = MakeBuiltinHash<BuiltinHashSize(table##_COUNT)>(      \
+         functions);                                                       \
+   static_assert(table##_HASH.seed != 0, "no perfect hash for " #table);  \
+   static const BuiltinTable table = {                                     \
+      functions, table##_HASH.slots, table##_HASH.seed,                    \
+      BuiltinHashSize(table##_COUNT) - 1, table##_COUNT                    \
+   };
 
 void RegisterFunctions(struct JLContext *context);
 
+/** Call a function value.
+ * args is the call form: args->value.str names the function and the
+ * arguments follow (cells can be used to pass evaluated values).
+ */
+struct JLValue *ApplyFunction(struct JLContext *context,
+                              struct JLValue *func,
+                              struct JLValue *args);
+
+/** Create a lambda; args->next is the parameter list and the body
+ * follows it.
+ */
+struct JLValue *LambdaFunc(struct JLContext *context,
+                           struct JLValue *args,
+                           void *extra);
+
+/** Determine if a value counts as true (not 0 or nil). */
+char IsTrue(const struct JLValue *value);
+
+/** Determine if a begin form needs its own scope (it defines something).
+ * args is the head of the form; the answer is cached in its flags.
+ */
+char BeginNeedsScope(struct JLValue *args);
+
+/** Evaluate a value, stopping any error raised by it.
+ * Returns zero (with *result set to NULL) if an error was raised.
+ */
+char TryEvaluate(struct JLContext *context,
+                 struct JLValue *value,
+                 struct JLValue **result);
+
+/** Skip white-space and comments, counting lines. */
+void SkipSpace(struct JLContext *context, const char **line);
+
+/** Print a value to a string from AllocMemory. */
+char *PrintToString(struct JLContext *context, const struct JLValue *value);
+
+void InvalidArgumentError(struct JLContext *context, struct JLValue *args);
+
+void TooManyArgumentsError(struct JLContext *context, struct JLValue *args);
+
+void TooFewArgumentsError(struct JLContext *context, struct JLValue *args);
+
 #endif /* JL_FUNC_H */
@@ -0,0 +1,409 @@
+/**
+ * @file jl-gpio.cpp
+ *
+ * Batched GPIO functions.
+ */
+
+#ifdef RP2040
+#include <pico/stdlib.h>
+#include <hardware/structs/sio.h>
+#else
+#include <time.h>
+#endif
+
+#include "jl.h"
+#include "jl-gpio.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-number.h"
+#include "jl-sim.h"
+#include "jl-edge.h"
+
+#include <cstdlib>
+
+/* Sequences up to this length are staged on the stack. */
+#define SEQ_STACK_SIZE  64
+
+static char GetMask(JLContext *context, JLValue *args, uint32_t *mask);
+static void WriteSet(uint32_t mask);
+static void WriteClear(uint32_t mask);
+static void WriteToggle(uint32_t mask);
+static uint32_t ReadOutput();
+static uint32_t ReadInput();
+
+static JLValue *GpioMaskFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *GpioInitMaskFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *GpioSetMaskFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *GpioClrMaskFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *GpioXorMaskFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *GpioGetAllFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *GpioWriteSeqFunc(JLContext *context, JLValue *args, void *extra);
+#ifndef RP2040
+static JLValue *GpioTraceFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *GpioDriveFunc(JLContext *context, JLValue *args, void *extra);
+#endif
+
+static constexpr InternalFunctionNode GPIO_FUNCTIONS[] = {
+   { "gpio-mask",      GpioMaskFunc,     JLEVAL_STRICT },
+   { "gpio-init-mask", GpioInitMaskFunc, JLEVAL_STRICT },
+   { "gpio-set-mask",  GpioSetMaskFunc,  JLEVAL_STRICT },
+   { "gpio-clr-mask",  GpioClrMaskFunc,  JLEVAL_STRICT },
+   { "gpio-xor-mask",  GpioXorMaskFunc,  JLEVAL_STRICT },
+   { "gpio-get-all",   GpioGetAllFunc,   JLEVAL_STRICT },
+   { "gpio-write-seq", GpioWriteSeqFunc, JLEVAL_STRICT },
+#ifndef RP2040
+   { "gpio-trace",     GpioTraceFunc,    JLEVAL_STRICT },
+   { "gpio-drive",     GpioDriveFunc,    JLEVAL_STRICT },
+#endif
+};
+DEFINE_BUILTIN_TABLE(GPIO_TABLE, GPIO_FUNCTIONS)
+
+#ifdef RP2040
+
+void WriteSet(uint32_t mask)
+{
+   sio_hw->gpio_set = mask;
+}
+
+void WriteClear(uint32_t mask)
+{
+   sio_hw->gpio_clr = mask;
+}
+
+void WriteToggle(uint32_t mask)
+{
+   sio_hw->gpio_togl = mask;
+}
+
+uint32_t ReadOutput()
+{
+   return sio_hw->gpio_out;
+}
+
+uint32_t ReadInput()
+{
+   return sio_hw->gpio_in;
+}
+
+#else
+
+static GpioRegisters registers;
+
+static uint64_t GetTimeUs();
+static void RecordOutput(uint32_t out);
+
+GpioRegisters *GetGpioRegisters()
+{
+   return &registers;
+}
+
+uint64_t GetTimeUs()
+{
+#ifdef JL_SIMULATOR
+   return JLGetTimeUs();
+#else
+   static uint64_t start = 0;
+   struct timespec ts;
+   uint64_t now;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+   if(start == 0) {
+      start = now;
+   }
+   return now - start;
+#endif
+}
+
+void RecordOutput(uint32_t out)
+{
+   unsigned int index = registers.trace_start + registers.trace_count;
+   registers.out = out;
+   if(registers.trace_count < GPIO_TRACE_SIZE) {
+      registers.trace_count += 1;
+   } else {
+      /* Full; drop the oldest entry. */
+      registers.trace_start = (registers.trace_start + 1) % GPIO_TRACE_SIZE;
+   }
+   index %= GPIO_TRACE_SIZE;
+   registers.trace[index].time_us = GetTimeUs();
+   registers.trace[index].out = out;
+#ifdef JL_SIMULATOR
+   SimOutput();
+#endif
+}
+
+void WriteSet(uint32_t mask)
+{
+   RecordOutput(registers.out | mask);
+}
+
+void WriteClear(uint32_t mask)
+{
+   RecordOutput(registers.out & ~mask);
+}
+
+void WriteToggle(uint32_t mask)
+{
+   RecordOutput(registers.out ^ mask);
+}
+
+uint32_t ReadOutput()
+{
+   return registers.out;
+}
+
+uint32_t ReadInput()
+{
+   /* Output pins read back what they drive. */
+   return (registers.in & ~registers.oe) | (registers.out & registers.oe);
+}
+
+void JLDriveGpio(uint32_t mask, uint32_t value)
+{
+   const uint32_t old = registers.in;
+   registers.in = (old & ~mask) | (value & mask);
+   QueueEdges(registers.in & ~old, old & ~registers.in, JLGetTimeUs());
+}
+
+#endif /* RP2040 */
+
+char GetMask(JLContext *context, JLValue *args, uint32_t *mask)
+{
+   JLValue *arg;
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return 0;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return 0;
+   }
+   arg = JLEvaluate(context, args->next);
+   if(arg == NULL || arg->tag != JLVALUE_NUMBER) {
+      JLRelease(context, arg);
+      InvalidArgumentError(context, args);
+      return 0;
+   }
+   *mask = Number::ToBits(arg->value.number);
+   JLRelease(context, arg);
+   return 1;
+}
+
+JLValue *GpioMaskFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *vp;
+   uint32_t mask = 0;
+
+   /* (gpio-mask pin ...) works whatever the number type. */
+   for(vp = args->next; vp; vp = vp->next) {
+      JLValue *pin = JLEvaluate(context, vp);
+      long long n;
+      if(pin == NULL || pin->tag != JLVALUE_NUMBER) {
+         JLRelease(context, pin);
+         InvalidArgumentError(context, args);
+         return NULL;
+      }
+      n = Number::ToInt(pin->value.number);
+      JLRelease(context, pin);
+      if(n < 0 || n > 31) {
+         InvalidArgumentError(context, args);
+         return NULL;
+      }
+      mask |= (uint32_t)1 << n;
+   }
+   return JLDefineNumber(context, NULL, Number::FromBits(mask));
+}
+
+JLValue *GpioInitMaskFunc(JLContext *context, JLValue *args, void *extra)
+{
+   uint32_t mask;
+   if(GetMask(context, args, &mask)) {
+#ifdef RP2040
+      gpio_init_mask(mask);
+      gpio_set_dir_out_masked(mask);
+#else
+      registers.oe |= mask;
+      RecordOutput(registers.out & ~mask);
+#endif
+   }
+   return NULL;
+}
+
+JLValue *GpioSetMaskFunc(JLContext *context, JLValue *args, void *extra)
+{
+   uint32_t mask;
+   if(GetMask(context, args, &mask)) {
+      WriteSet(mask);
+   }
+   return NULL;
+}
+
+JLValue *GpioClrMaskFunc(JLContext *context, JLValue *args, void *extra)
+{
+   uint32_t mask;
+   if(GetMask(context, args, &mask)) {
+      WriteClear(mask);
+   }
+   return NULL;
+}
+
+JLValue *GpioXorMaskFunc(JLContext *context, JLValue *args, void *extra)
+{
+   uint32_t mask;
+   if(GetMask(context, args, &mask)) {
+      WriteToggle(mask);
+   }
+   return NULL;
+}
+
+JLValue *GpioGetAllFunc(JLContext *context, JLValue *args, void *extra)
+{
+   if(args->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   return JLDefineNumber(context, NULL, Number::FromBits(ReadInput()));
+}
+
+JLValue *GpioWriteSeqFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *mval = NULL;
+   JLValue *lst = NULL;
+   JLValue *vp;
+   JLValue *result = NULL;
+   uint32_t stack_values[SEQ_STACK_SIZE];
+   uint32_t *values = stack_values;
+   uint32_t mask;
+   size_t count = 0;
+   size_t i;
+
+   if(args->next == NULL || args->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   PushRelease(context, &mval);
+   PushRelease(context, &lst);
+   mval = JLEvaluate(context, args->next);
+   if(mval == NULL || mval->tag != JLVALUE_NUMBER) {
+      InvalidArgumentError(context, args);
+      goto seq_done;
+   }
+   mask = Number::ToBits(mval->value.number);
+
+   lst = JLEvaluate(context, args->next->next);
+   if(lst != NULL && lst->tag != JLVALUE_LIST) {
+      InvalidArgumentError(context, args);
+      goto seq_done;
+   }
+
+   /* Stage the whole sequence first so the writes happen back-to-back. */
+   if(lst) {
+      for(vp = lst->value.lst; vp; vp = vp->next) {
+         const JLValue *element = GetElement(vp);
+         if(element == NULL || element->tag != JLVALUE_NUMBER) {
+            InvalidArgumentError(context, args);
+            goto seq_done;
+         }
+         count += 1;
+      }
+   }
+   if(count > SEQ_STACK_SIZE) {
+      values = (uint32_t*)AllocMemory(context, count * sizeof(uint32_t));
+   }
+   i = 0;
+   if(lst) {
+      for(vp = lst->value.lst; vp; vp = vp->next) {
+         const NUMBER_TYPE value = GetElement(vp)->value.number;
+         values[i++] = Number::ToBits(value) & mask;
+      }
+   }
+
+   for(i = 0; i < count; i++) {
+      WriteToggle((ReadOutput() ^ values[i]) & mask);
+   }
+
+   if(values != stack_values) {
+      FreeMemory(context, values);
+   }
+   result = JLDefineNumber(context, NULL, Number::FromInt(count));
+
+seq_done:
+
+   JLRelease(context, mval);
+   JLRelease(context, lst);
+   return result;
+}
+
+#ifndef RP2040
+
+JLValue *GpioTraceFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *result = NULL;
+   JLValue **item = &result;
+   unsigned int i;
+
+   /* Return ((time out) ...) for the recorded writes and reset the log. */
+   if(registers.trace_count > 0) {
+      result = CreateValue(context, NULL, JLVALUE_LIST);
+      item = &result->value.lst;
+   }
+   for(i = 0; i < registers.trace_count; i++) {
+      const GpioTraceNode *node
+         = &registers.trace[(registers.trace_start + i) % GPIO_TRACE_SIZE];
+      JLValue *entry = CreateValue(context, NULL, JLVALUE_LIST);
+      JLValue *time = JLDefineNumber(context, NULL,
+                                     Number::FromCounter(node->time_us));
+      time->next = JLDefineNumber(context, NULL,
+                                  Number::FromBits(node->out));
+      entry->value.lst = time;
+      *item = entry;
+      item = &entry->next;
+   }
+   registers.trace_start = 0;
+   registers.trace_count = 0;
+   return result;
+}
+
+JLValue *GpioDriveFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *mask = NULL;
+   JLValue *value = NULL;
+
+   /* (gpio-drive mask value) sets the simulated inputs. */
+   if(args->next == NULL || args->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   PushRelease(context, &mask);
+   PushRelease(context, &value);
+   mask = JLEvaluate(context, args->next);
+   value = JLEvaluate(context, args->next->next);
+   if(mask == NULL || mask->tag != JLVALUE_NUMBER ||
+      value == NULL || value->tag != JLVALUE_NUMBER) {
+      InvalidArgumentError(context, args);
+   } else {
+      JLDriveGpio(Number::ToBits(mask->value.number),
+                  Number::ToBits(value->value.number));
+   }
+   JLRelease(context, mask);
+   JLRelease(context, value);
+   return NULL;
+}
+
+#endif /* RP2040 */
+
+void RegisterGpioFunctions(JLContext *context)
+{
+   RegisterBuiltins(context, &GPIO_TABLE);
+}
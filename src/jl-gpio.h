@@ -0,0 +1,42 @@
+/**
+ * @file jl-gpio.h
+ *
+ * Batched GPIO functions.
+ * On the RP2040 these drive the SIO registers directly; host builds
+ * use a simulated register file that records every output write.
+ */
+
+#ifndef JL_GPIO_H
+#define JL_GPIO_H
+
+#include <stdint.h>
+
+struct JLContext;
+
+#ifndef RP2040
+
+#define GPIO_TRACE_SIZE 256
+
+/** One recorded write to the simulated output register. */
+typedef struct GpioTraceNode {
+   uint64_t time_us;
+   uint32_t out;
+} GpioTraceNode;
+
+/** Simulated SIO register file. */
+typedef struct GpioRegisters {
+   uint32_t out;        /**< Output values. */
+   uint32_t oe;         /**< Output enables. */
+   uint32_t in;         /**< Externally driven input values. */
+   GpioTraceNode trace[GPIO_TRACE_SIZE];
+   unsigned int trace_start;
+   unsigned int trace_count;
+} GpioRegisters;
+
+GpioRegisters *GetGpioRegisters();
+
+#endif /* RP2040 */
+
+void RegisterGpioFunctions(struct JLContext *context);
+
+#endif /* JL_GPIO_H */
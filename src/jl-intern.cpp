@@ -0,0 +1,239 @@
+/**
+ * @file jl-intern.cpp
+ *
+ * Hash-consing of immutable data.
+ * The table is weak: it holds no references, and values remove themselves
+ * when they are released.  Lists are interned a cell at a time, keyed by
+ * the element and the (already interned) rest of the list, so equal lists
+ * are the same cells and can be compared by pointer.
+ */
+
+#include "jl.h"
+#include "jl-intern.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-number.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#define INITIAL_INTERN_SIZE   256
+
+static uint32_t HashKey(const JLValue *value);
+static char EqualKeys(const JLValue *a, const JLValue *b);
+static char IsInterned(const JLValue *value);
+static size_t FindSlot(JLContext *context, const JLValue *value);
+static void GrowTable(JLContext *context);
+static JLValue *FindOrInsert(JLContext *context, JLValue *value);
+
+static JLValue *HashConsFunc(JLContext *context, JLValue *args, void *extra);
+
+static constexpr InternalFunctionNode INTERN_FUNCTIONS[] = {
+   { "hash-cons", HashConsFunc, JLEVAL_STRICT }
+};
+DEFINE_BUILTIN_TABLE(INTERN_TABLE, INTERN_FUNCTIONS)
+
+uint32_t HashKey(const JLValue *value)
+{
+   uint32_t hash;
+   switch(value->tag) {
+   case JLVALUE_STRING:
+      return HashName(value->value.str, 0);
+   case JLVALUE_NUMBER:
+      hash = (uint32_t)value->value.number;
+      break;
+   case JLVALUE_LIST:
+      hash = (uint32_t)(uintptr_t)value->value.lst;
+      break;
+   default:
+      hash = (uint32_t)(uintptr_t)value->value.lst
+           ^ ((uint32_t)(uintptr_t)value->next * 31);
+      break;
+   }
+   hash = (hash ^ value->tag) * 0x9E3779B9u;
+   return hash ^ (hash >> 16);
+}
+
+char EqualKeys(const JLValue *a, const JLValue *b)
+{
+   if(a->tag != b->tag) {
+      return 0;
+   }
+   switch(a->tag) {
+   case JLVALUE_STRING:
+      return !strcmp(a->value.str, b->value.str);
+   case JLVALUE_NUMBER:
+      return a->value.number == b->value.number;
+   case JLVALUE_LIST:
+      return a->value.lst == b->value.lst;
+   default:
+      return a->value.lst == b->value.lst && a->next == b->next;
+   }
+}
+
+char IsInterned(const JLValue *value)
+{
+   return value == NULL || (value->flags & JLVALUE_FLAG_INTERNED);
+}
+
+size_t FindSlot(JLContext *context, const JLValue *value)
+{
+   const size_t mask = context->intern_size - 1;
+   size_t index = HashKey(value) & mask;
+   while(context->interned[index] &&
+         !EqualKeys(context->interned[index], value)) {
+      index = (index + 1) & mask;
+   }
+   return index;
+}
+
+void GrowTable(JLContext *context)
+{
+   JLValue **old_table = context->interned;
+   const size_t old_size = context->intern_size;
+   const size_t size = old_size ? old_size * 2 : INITIAL_INTERN_SIZE;
+   size_t i;
+
+   context->interned = (JLValue**)AllocZeroed(context, size,
+                                              sizeof(JLValue*));
+   context->intern_size = size;
+   for(i = 0; i < old_size; i++) {
+      if(old_table[i]) {
+         context->interned[FindSlot(context, old_table[i])] = old_table[i];
+      }
+   }
+   FreeMemory(context, old_table);
+}
+
+JLValue *FindOrInsert(JLContext *context, JLValue *value)
+{
+   size_t index;
+   if((context->intern_count + 1) * 4 > context->intern_size * 3) {
+      GrowTable(context);
+   }
+   index = FindSlot(context, value);
+   if(context->interned[index]) {
+      JLValue *result = context->interned[index];
+      JLRetain(context, result);
+      JLRelease(context, value);
+      return result;
+   }
+   context->interned[index] = value;
+   context->intern_count += 1;
+   value->flags |= JLVALUE_FLAG_INTERNED;
+   return value;
+}
+
+JLValue *InternValue(JLContext *context, JLValue *value)
+{
+   /* Constants in flash can't be marked; they stay unshared. */
+   if(IsInterned(value) || IsRomValue(value)) {
+      return value;
+   }
+   switch(value->tag) {
+   case JLVALUE_STRING:
+   case JLVALUE_NUMBER:
+      return FindOrInsert(context, value);
+   case JLVALUE_LIST:
+      if(IsInterned(value->value.lst)) {
+         return FindOrInsert(context, value);
+      }
+      return value;
+   default:
+      return value;
+   }
+}
+
+JLValue *InternList(JLContext *context, JLValue *list)
+{
+   JLValue *node;
+   JLValue *prev = NULL;
+   JLValue *tail;
+   char shared;
+
+   if(list == NULL || !context->hash_cons) {
+      return list;
+   }
+
+   /* Reverse the new cells so the list can be interned from the end.
+    * A cell with one reference is only reachable through this list. */
+   node = list->value.lst;
+   while(node && !IsInterned(node) && node->count == 1) {
+      JLValue *next = node->next;
+      node->value.lst = InternValue(context, node->value.lst);
+      node->next = prev;
+      prev = node;
+      node = next;
+   }
+
+   tail = node;
+   shared = IsInterned(tail);
+   while(prev) {
+      JLValue *cell = prev;
+      prev = cell->next;
+      cell->next = tail;
+      shared = shared && cell->tag == JLVALUE_CELL
+            && IsInterned(cell->value.lst);
+      tail = shared ? FindOrInsert(context, cell) : cell;
+   }
+   list->value.lst = tail;
+   return InternValue(context, list);
+}
+
+void ForgetInterned(JLContext *context, JLValue *value)
+{
+   const size_t mask = context->intern_size - 1;
+   size_t index = FindSlot(context, value);
+   size_t next;
+
+   /* Shift later entries back so probe sequences stay unbroken. */
+   context->interned[index] = NULL;
+   context->intern_count -= 1;
+   next = (index + 1) & mask;
+   while(context->interned[next]) {
+      JLValue *temp = context->interned[next];
+      context->interned[next] = NULL;
+      context->interned[FindSlot(context, temp)] = temp;
+      next = (next + 1) & mask;
+   }
+}
+
+void ReleaseInternTable(JLContext *context)
+{
+   FreeMemory(context, context->interned);
+   context->interned = NULL;
+   context->intern_size = 0;
+   context->intern_count = 0;
+}
+
+JLValue *HashConsFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   JLValue *result = NULL;
+
+   /* Return the old setting; set it if an argument is given. */
+   if(context->hash_cons) {
+      result = JLDefineNumber(context, NULL, Number::FromInt(1));
+   }
+   if(args->next == NULL) {
+      return result;
+   }
+   if(args->next->next) {
+      JLRelease(context, result);
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   PushRelease(context, &result);
+   arg = JLEvaluate(context, args->next);
+   context->hash_cons = arg != NULL && (arg->tag != JLVALUE_NUMBER ||
+                                        !Number::IsZero(arg->value.number));
+   JLRelease(context, arg);
+   return result;
+}
+
+void RegisterInternFunctions(JLContext *context)
+{
+   RegisterBuiltins(context, &INTERN_TABLE);
+}
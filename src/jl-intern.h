@@ -0,0 +1,31 @@
+/**
+ * @file jl-intern.h
+ *
+ * Hash-consing of immutable data.
+ * When enabled, string literals and the lists built by list and cons are
+ * looked up in a weak intern table so identical data shares one copy.
+ */
+
+#ifndef JL_INTERN_H
+#define JL_INTERN_H
+
+struct JLContext;
+struct JLValue;
+
+/** Get the shared copy of a value.
+ * The reference to value is transferred; the result is retained.
+ * Values that can't be shared are returned as is.
+ */
+struct JLValue *InternValue(struct JLContext *context, struct JLValue *value);
+
+/** Intern a list that was just built from fresh cells. */
+struct JLValue *InternList(struct JLContext *context, struct JLValue *list);
+
+/** Remove a value from the intern table (called when it is released). */
+void ForgetInterned(struct JLContext *context, struct JLValue *value);
+
+void ReleaseInternTable(struct JLContext *context);
+
+void RegisterInternFunctions(struct JLContext *context);
+
+#endif /* JL_INTERN_H */
@@ -0,0 +1,338 @@
+/**
+ * @file jl-load.cpp
+ *
+ * Loading source files.
+ * Files come from those added with JLAddFile (for example, text linked
+ * into flash) and then from the loader, which reads them with stdio on
+ * the host.  The cache is keyed by a 64-bit hash and the length of the
+ * contents, so an unchanged file is found again under any path; a file
+ * that changed replaces the entry for its path.
+ */
+
+#include "jl.h"
+#include "jl-load.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-macro.h"
+#include "jl-number.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdio.h>
+
+static uint64_t HashText(const char *text, size_t *length);
+static JLValue *ParseSource(JLContext *context, const char *source);
+static LoadEntry *GetEntry(JLContext *context, const char *path);
+static LoadEntry *StoreEntry(JLContext *context, const char *path,
+                             const char *source, uint64_t hash,
+                             size_t length);
+#ifndef RP2040
+static char *ReadFile(void *arg, const char *path);
+#endif
+
+static JLValue *LoadFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *LoadStatsFunc(JLContext *context, JLValue *args, void *extra);
+
+static constexpr InternalFunctionNode LOAD_FUNCTIONS[] = {
+   { "load",         LoadFunc,         JLEVAL_STRICT },
+   { "load-stats",   LoadStatsFunc,    JLEVAL_STRICT }
+};
+DEFINE_BUILTIN_TABLE(LOAD_TABLE, LOAD_FUNCTIONS)
+
+uint64_t HashText(const char *text, size_t *length)
+{
+   /* FNV-1a; 64 bits, since a collision would run the wrong code. */
+   uint64_t hash = 14695981039346656037ull;
+   const char *ch;
+   for(ch = text; *ch; ch++) {
+      hash ^= (unsigned char)*ch;
+      hash *= 1099511628211ull;
+   }
+   *length = (size_t)(ch - text);
+   return hash;
+}
+
+JLValue *ParseSource(JLContext *context, const char *source)
+{
+   JLValue *forms = CreateValue(context, NULL, JLVALUE_LIST);
+   JLValue **item = &forms->value.lst;
+   const unsigned int line = context->line;
+
+   forms->value.lst = NULL;
+
+   /* Errors report the line in the file.  Each form is preceded by the
+    * line it starts on, so errors while running it can report it too. */
+   PushRelease(context, &forms);
+   context->line = 1;
+   while(*source) {
+      JLValue *value;
+      unsigned int start;
+      SkipSpace(context, &source);
+      start = context->line;
+      value = JLParse(context, &source);
+      if(value) {
+         *item = JLDefineNumber(context, NULL, Number::FromBits(start));
+         item = &(*item)->next;
+         *item = value;
+         item = &value->next;
+      }
+   }
+   context->line = line;
+   context->unwind_count -= 1;
+   return forms;
+}
+
+LoadEntry *StoreEntry(JLContext *context, const char *path,
+                      const char *source, uint64_t hash, size_t length)
+{
+   JLValue *forms = ParseSource(context, source);
+   LoadEntry *entry;
+
+   PushRelease(context, &forms);
+   for(entry = context->loads; entry; entry = entry->next) {
+      if(entry->path && !strcmp(entry->path, path)) {
+         break;
+      }
+   }
+   if(entry == NULL) {
+      entry = (LoadEntry*)AllocMemory(context, sizeof(LoadEntry));
+      entry->path = NULL;
+      entry->forms = NULL;
+      entry->hash = 0;
+      entry->length = 0;
+      entry->next = context->loads;
+      context->loads = entry;
+      entry->path = CopyString(context, path);
+   }
+   context->unwind_count -= 1;
+
+   /* A load still running the old forms holds its own reference. */
+   JLRelease(context, entry->forms);
+   entry->forms = forms;
+   entry->hash = hash;
+   entry->length = length;
+   return entry;
+}
+
+LoadEntry *GetEntry(JLContext *context, const char *path)
+{
+   const LoadFile *file;
+   LoadEntry *entry;
+   CatchNode node;
+   const char *source;
+   char *text = NULL;
+   uint64_t hash;
+   size_t length;
+
+   for(file = context->files; file; file = file->next) {
+      if(!strcmp(file->path, path)) {
+         break;
+      }
+   }
+   if(file) {
+      source = file->text;
+   } else {
+      if(context->loader) {
+         text = (context->loader)(context->loader_arg, path);
+      }
+      if(text == NULL) {
+         Error(context, "cannot load %s", path);
+         return NULL;
+      }
+      source = text;
+   }
+
+   hash = HashText(source, &length);
+   for(entry = context->loads; entry; entry = entry->next) {
+      if(entry->hash == hash && entry->length == length) {
+         context->load_hits += 1;
+         free(text);
+         return entry;
+      }
+   }
+   context->load_misses += 1;
+
+   /* The text is from the loader, so free it before passing on errors. */
+   EnterCatch(context, &node);
+   if(setjmp(node.env) != 0) {
+      free(text);
+      Raise(context);
+   }
+   entry = StoreEntry(context, path, source, hash, length);
+   LeaveCatch(context, &node);
+   free(text);
+   return entry;
+}
+
+#ifndef RP2040
+char *ReadFile(void *arg, const char *path)
+{
+   FILE *fd = fopen(path, "rb");
+   char *text = NULL;
+   long size;
+
+   if(fd == NULL) {
+      return NULL;
+   }
+   if(fseek(fd, 0, SEEK_END) != 0 || (size = ftell(fd)) < 0 ||
+      fseek(fd, 0, SEEK_SET) != 0) {
+      goto read_done;
+   }
+   text = (char*)malloc((size_t)size + 1);
+   if(text && fread(text, 1, (size_t)size, fd) != (size_t)size) {
+      free(text);
+      text = NULL;
+   } else if(text) {
+      text[size] = 0;
+   }
+read_done:
+   fclose(fd);
+   return text;
+}
+#endif
+
+JLValue *LoadFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *path;
+   JLValue *forms;
+   JLValue *result = NULL;
+   JLValue *vp;
+   ScopeNode *scope;
+   CatchNode node;
+   const unsigned int line = context->line;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   path = JLEvaluate(context, args->next);
+   if(path == NULL || path->tag != JLVALUE_STRING) {
+      JLRelease(context, path);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   PushRelease(context, &path);
+
+   /* Errors report the line in the file; the caller's line is back
+    * once they leave it. */
+   EnterCatch(context, &node);
+   if(setjmp(node.env) != 0) {
+      context->line = line;
+      Raise(context);
+   }
+   forms = GetEntry(context, path->value.str)->forms;
+   JLRetain(context, forms);
+   PushRelease(context, &forms);
+   PushRelease(context, &result);
+
+   /* Run the forms at the top level, as if they were typed there.
+    * Errors return to the scope of their catch. */
+   scope = context->scope;
+   while(context->scope->next) {
+      context->scope = context->scope->next;
+   }
+   for(vp = forms->value.lst; vp; vp = vp->next->next) {
+      JLRelease(context, result);
+      result = NULL;
+      context->line = Number::ToBits(vp->value.number);
+      ExpandCode(context, vp->next);
+      result = JLEvaluate(context, vp->next);
+   }
+   LeaveCatch(context, &node);
+   context->line = line;
+   context->scope = scope;
+
+   JLRelease(context, forms);
+   JLRelease(context, path);
+   return result;
+}
+
+JLValue *LoadStatsFunc(JLContext *context, JLValue *args, void *extra)
+{
+   const LoadEntry *entry;
+   unsigned long values[3];
+   JLValue *result;
+   JLValue **item;
+   size_t i;
+
+   if(args->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   /* Return (hits misses entries). */
+   values[0] = context->load_hits;
+   values[1] = context->load_misses;
+   values[2] = 0;
+   for(entry = context->loads; entry; entry = entry->next) {
+      values[2] += 1;
+   }
+   result = CreateValue(context, NULL, JLVALUE_LIST);
+   item = &result->value.lst;
+   for(i = 0; i < 3; i++) {
+      *item = JLDefineNumber(context, NULL, Number::FromInt(values[i]));
+      item = &(*item)->next;
+   }
+   return result;
+}
+
+void JLSetLoader(JLContext *context, JLLoadFunction func, void *arg)
+{
+   context->loader = func;
+   context->loader_arg = arg;
+}
+
+void JLAddFile(JLContext *context, const char *path, const char *text)
+{
+   LoadFile *file = (LoadFile*)AllocMemory(context, sizeof(LoadFile));
+   file->path = path;
+   file->text = text;
+   file->next = context->files;
+   context->files = file;
+}
+
+JLValue *JLLoad(JLContext *context, const char *path)
+{
+   JLValue *form = CreateValue(context, NULL, JLVALUE_LIST);
+   JLValue *arg;
+   JLValue *result;
+
+   form->value.lst = CreateValue(context, NULL, JLVALUE_VARIABLE);
+   form->value.lst->value.str = CopyString(context, "load");
+   arg = CreateValue(context, NULL, JLVALUE_STRING);
+   arg->value.str = CopyString(context, path);
+   form->value.lst->next = arg;
+   result = JLEvaluate(context, form);
+   JLRelease(context, form);
+   return result;
+}
+
+void ReleaseLoads(JLContext *context)
+{
+   while(context->loads) {
+      LoadEntry *entry = context->loads;
+      context->loads = entry->next;
+      JLRelease(context, entry->forms);
+      FreeMemory(context, entry->path);
+      FreeMemory(context, entry);
+   }
+   while(context->files) {
+      LoadFile *file = context->files;
+      context->files = file->next;
+      FreeMemory(context, file);
+   }
+}
+
+void RegisterLoadFunctions(JLContext *context)
+{
+#ifndef RP2040
+   JLSetLoader(context, ReadFile, NULL);
+#endif
+   RegisterBuiltins(context, &LOAD_TABLE);
+}
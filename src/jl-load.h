@@ -0,0 +1,38 @@
+/**
+ * @file jl-load.h
+ *
+ * Loading source files.
+ * The forms parsed from a file are cached by a hash of its contents, so a
+ * prelude shared by several configurations is only parsed once.
+ */
+
+#ifndef JL_LOAD_H
+#define JL_LOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct JLContext;
+struct JLValue;
+
+/** Parsed forms, keyed by the contents they came from. */
+typedef struct LoadEntry {
+   struct LoadEntry *next;
+   char *path;                   /**< Path the forms were parsed for. */
+   struct JLValue *forms;        /**< List of line, form, line, ... */
+   uint64_t hash;
+   size_t length;
+} LoadEntry;
+
+/** A file added with JLAddFile (the contents are not copied). */
+typedef struct LoadFile {
+   struct LoadFile *next;
+   const char *path;
+   const char *text;
+} LoadFile;
+
+void ReleaseLoads(struct JLContext *context);
+
+void RegisterLoadFunctions(struct JLContext *context);
+
+#endif /* JL_LOAD_H */
@@ -0,0 +1,276 @@
+/**
+ * @file jl-macro.cpp
+ *
+ * Macros.
+ * A macro holds a lambda that is called with the unevaluated arguments
+ * of a call and returns the code to run in its place.  The returned data
+ * is converted back to code and stored in the call form, which is marked
+ * so the expansion is not repeated.
+ */
+
+#include "jl.h"
+#include "jl-macro.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-rom.h"
+
+#include <cstring>
+
+static JLValue *FindMacro(JLContext *context, const JLValue *head);
+static void ExpandList(JLContext *context, JLValue *list);
+static JLValue *ToCode(JLContext *context, JLValue *value);
+static char IsForm(const JLValue *value, const char *name);
+static JLValue *Quasiquote(JLContext *context, JLValue *node);
+
+static JLValue *DefmacroFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *QuasiquoteFunc(JLContext *context, JLValue *args, void *extra);
+
+static constexpr InternalFunctionNode MACRO_FUNCTIONS[] = {
+   { "defmacro",   DefmacroFunc,   JLEVAL_CODE },
+   { "quasiquote", QuasiquoteFunc, JLEVAL_CODE }
+};
+DEFINE_BUILTIN_TABLE(MACRO_TABLE, MACRO_FUNCTIONS)
+
+JLValue *FindMacro(JLContext *context, const JLValue *head)
+{
+   /* Macros are always global. */
+   if(head && head->tag == JLVALUE_VARIABLE) {
+      JLValue *value = LookupGlobal(context, head->value.str);
+      char found;
+      if(value == NULL) {
+         value = LookupRom(context, head->value.str, &found);
+      }
+      if(value && value->tag == JLVALUE_MACRO) {
+         return value;
+      }
+   }
+   return NULL;
+}
+
+void ExpandMacros(JLContext *context, JLValue *code)
+{
+   JLValue *vp;
+   if(context->macro_count == 0) {
+      return;
+   }
+   for(vp = code; vp; vp = vp->next) {
+      if(vp->tag == JLVALUE_LIST) {
+         ExpandList(context, vp);
+      }
+   }
+}
+
+void ExpandCode(JLContext *context, JLValue *code)
+{
+   if(context->macro_count > 0 && code && code->tag == JLVALUE_LIST) {
+      ExpandList(context, code);
+   }
+}
+
+void ExpandList(JLContext *context, JLValue *list)
+{
+   JLValue *head;
+   JLValue *macro;
+
+   while(list->tag == JLVALUE_LIST && !(list->flags & JLVALUE_FLAG_EXPANDED)) {
+      macro = FindMacro(context, list->value.lst);
+      if(macro == NULL) {
+         break;
+      }
+      ExpandForm(context, list, macro);
+   }
+   if(list->tag != JLVALUE_LIST || (list->flags & JLVALUE_FLAG_EXPANDED)) {
+      return;
+   }
+   list->flags |= JLVALUE_FLAG_EXPANDED;
+
+   /* Skip templates and the names bound by lambda and defmacro. */
+   head = list->value.lst;
+   if(IsForm(list, "quasiquote")) {
+      return;
+   } else if(IsForm(list, "lambda") && head->next) {
+      head = head->next;
+   } else if(IsForm(list, "defmacro") && head->next && head->next->next) {
+      head = head->next->next;
+   }
+   if(head) {
+      ExpandMacros(context, head->next);
+   }
+}
+
+void ExpandForm(JLContext *context, JLValue *form, JLValue *macro)
+{
+   const size_t mark = context->unwind_count;
+   JLValue *head;
+   JLValue *call;
+   JLValue *expansion = NULL;
+   JLValue *code;
+   JLValue **item;
+   JLValue *vp;
+
+   if(IsRomValue(form)) {
+      /* The macro was defined after the code was put in flash. */
+      Error(context, "cannot expand %s in constant code",
+            form->value.lst->tag == JLVALUE_VARIABLE
+            ? form->value.lst->value.str : "macro");
+      return;
+   }
+
+   /* Pass the argument code itself; cells keep it from being evaluated.
+    * The head names the macro in errors (see CreateCallForm). */
+   call = CreateValue(context, NULL, JLVALUE_NIL);
+   head = form->value.lst;
+   call->value.str = head->tag == JLVALUE_VARIABLE
+                   ? head->value.str : (char*)"macro";
+   item = &call->next;
+   for(vp = head->next; vp; vp = vp->next) {
+      JLRetain(context, vp);
+      *item = CreateCell(context, vp);
+      item = &(*item)->next;
+   }
+   PushRelease(context, &call);
+   PushRelease(context, &expansion);
+   expansion = ApplyFunction(context, macro->value.lst, call);
+   context->unwind_count = mark;
+   JLRelease(context, call);
+
+   code = ToCode(context, expansion);
+   JLRelease(context, expansion);
+
+   /* Move the code into the form; its next link stays in place. */
+   JLRelease(context, form->value.lst);
+   form->flags &= ~JLVALUE_FLAG_EXPANDED;
+   if(code->tag == JLVALUE_LIST) {
+      form->value.lst = code->value.lst;
+      code->value.lst = NULL;
+   } else {
+      form->tag = code->tag;
+      form->value = code->value;
+      code->tag = JLVALUE_NIL;
+   }
+   JLRelease(context, code);
+}
+
+JLValue *ToCode(JLContext *context, JLValue *value)
+{
+   JLValue *result;
+   JLValue **item;
+   JLValue *vp;
+   if(value && value->tag == JLVALUE_LIST) {
+      result = CreateValue(context, NULL, JLVALUE_LIST);
+      result->value.lst = NULL;
+      item = &result->value.lst;
+      for(vp = value->value.lst; vp; vp = vp->next) {
+         *item = ToCode(context, GetElement(vp));
+         item = &(*item)->next;
+      }
+      return result;
+   } else if(value && (value->tag == JLVALUE_VARIABLE ||
+                       value->tag == JLVALUE_NUMBER)) {
+      result = CopyValue(context, value);
+      result->flags = 0;
+      return result;
+   }
+   /* Anything else evaluates to itself when held in a cell. */
+   JLRetain(context, value);
+   return CreateCell(context, value);
+}
+
+char IsForm(const JLValue *value, const char *name)
+{
+   const JLValue *head = value->value.lst;
+   return head && head->tag == JLVALUE_VARIABLE
+       && !strcmp(head->value.str, name);
+}
+
+JLValue *Quasiquote(JLContext *context, JLValue *node)
+{
+   const size_t mark = context->unwind_count;
+   JLValue *result;
+   JLValue **item;
+   JLValue *vp;
+
+   node = GetElement(node);
+   if(node == NULL || node->tag != JLVALUE_LIST) {
+      JLRetain(context, node);
+      return node;
+   }
+   if(IsForm(node, "unquote")) {
+      return JLEvaluate(context, node->value.lst->next);
+   }
+
+   result = CreateValue(context, NULL, JLVALUE_LIST);
+   result->value.lst = NULL;
+   PushRelease(context, &result);
+   item = &result->value.lst;
+   for(vp = node->value.lst; vp; vp = vp->next) {
+      if(vp->tag == JLVALUE_LIST && IsForm(vp, "unquote-splicing")) {
+         JLValue *lst = JLEvaluate(context, vp->value.lst->next);
+         JLValue *ep;
+         if(lst && lst->tag == JLVALUE_LIST) {
+            for(ep = lst->value.lst; ep; ep = ep->next) {
+               JLValue *element = GetElement(ep);
+               JLRetain(context, element);
+               *item = CreateCell(context, element);
+               item = &(*item)->next;
+            }
+         } else if(lst) {
+            JLRelease(context, lst);
+            Error(context, "unquote-splicing requires a list");
+            lst = NULL;
+         }
+         JLRelease(context, lst);
+      } else {
+         *item = CreateCell(context, Quasiquote(context, vp));
+         item = &(*item)->next;
+      }
+   }
+   context->unwind_count = mark;
+   if(result->value.lst == NULL) {
+      JLRelease(context, result);
+      result = NULL;
+   }
+   return result;
+}
+
+JLValue *DefmacroFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *vp = args->next;
+   JLValue *result;
+
+   if(vp == NULL || vp->next == NULL || vp->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(vp->tag != JLVALUE_VARIABLE || vp->next->tag != JLVALUE_LIST) {
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+
+   /* (defmacro name (params) body) holds (lambda (params) body). */
+   result = CreateValue(context, NULL, JLVALUE_MACRO);
+   result->value.lst = LambdaFunc(context, vp, NULL);
+   DefineGlobal(context, vp->value.str, result);
+   context->macro_count += 1;
+   return result;
+}
+
+JLValue *QuasiquoteFunc(JLContext *context, JLValue *args, void *extra)
+{
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   return Quasiquote(context, args->next);
+}
+
+void RegisterMacroFunctions(JLContext *context)
+{
+   RegisterBuiltins(context, &MACRO_TABLE);
+}
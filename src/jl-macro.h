@@ -0,0 +1,31 @@
+/**
+ * @file jl-macro.h
+ *
+ * Macros.
+ * A macro call is replaced by its expansion the first time the code
+ * containing it is processed, so the expander only runs once per call
+ * site.
+ */
+
+#ifndef JL_MACRO_H
+#define JL_MACRO_H
+
+struct JLContext;
+struct JLValue;
+
+/** Expand the macro calls in a chain of code nodes.
+ * Lists are marked as they are expanded, so walking the same code again
+ * returns immediately.
+ */
+void ExpandMacros(struct JLContext *context, struct JLValue *code);
+
+/** Expand the macro calls in one form, but not in the code after it. */
+void ExpandCode(struct JLContext *context, struct JLValue *code);
+
+/** Replace a macro call form with its expansion. */
+void ExpandForm(struct JLContext *context, struct JLValue *form,
+                struct JLValue *macro);
+
+void RegisterMacroFunctions(struct JLContext *context);
+
+#endif /* JL_MACRO_H */
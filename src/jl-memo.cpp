@@ -0,0 +1,297 @@
+/**
+ * @file jl-memo.cpp
+ *
+ * Memoized functions.
+ * Results are cached in a hash table keyed by the structure of the
+ * evaluated arguments; the least recently used entry is dropped when
+ * the table is full.
+ */
+
+#include "jl.h"
+#include "jl-memo.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-number.h"
+
+#include <cstdlib>
+
+#define DEFAULT_MEMO_CAPACITY    64
+
+static MemoEntry *FindEntry(Memo *memo, const JLValue *key, uint32_t hash);
+static void Unlink(Memo *memo, MemoEntry *entry);
+static void PushNewest(Memo *memo, MemoEntry *entry);
+static void RemoveEntry(JLContext *context, Memo *memo, MemoEntry *entry);
+static void InsertEntry(JLContext *context, Memo *memo, JLValue *key,
+                        uint32_t hash, JLValue *result);
+
+static JLValue *MemoizeFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *MemoStatsFunc(JLContext *context, JLValue *args, void *extra);
+
+static constexpr InternalFunctionNode MEMO_FUNCTIONS[] = {
+   { "memoize",    MemoizeFunc,   JLEVAL_STRICT },
+   { "memo-stats", MemoStatsFunc, JLEVAL_STRICT }
+};
+DEFINE_BUILTIN_TABLE(MEMO_TABLE, MEMO_FUNCTIONS)
+
+MemoEntry *FindEntry(Memo *memo, const JLValue *key, uint32_t hash)
+{
+   MemoEntry *entry = memo->buckets[hash & memo->mask];
+   while(entry) {
+      if(entry->hash == hash && EqualValues(entry->key, key)) {
+         return entry;
+      }
+      entry = entry->chain;
+   }
+   return NULL;
+}
+
+void Unlink(Memo *memo, MemoEntry *entry)
+{
+   if(entry->newer) {
+      entry->newer->older = entry->older;
+   } else {
+      memo->newest = entry->older;
+   }
+   if(entry->older) {
+      entry->older->newer = entry->newer;
+   } else {
+      memo->oldest = entry->newer;
+   }
+}
+
+void PushNewest(Memo *memo, MemoEntry *entry)
+{
+   entry->newer = NULL;
+   entry->older = memo->newest;
+   if(memo->newest) {
+      memo->newest->newer = entry;
+   } else {
+      memo->oldest = entry;
+   }
+   memo->newest = entry;
+}
+
+void RemoveEntry(JLContext *context, Memo *memo, MemoEntry *entry)
+{
+   MemoEntry **link = &memo->buckets[entry->hash & memo->mask];
+   while(*link != entry) {
+      link = &(*link)->chain;
+   }
+   *link = entry->chain;
+   Unlink(memo, entry);
+   memo->size -= 1;
+   JLRelease(context, entry->key);
+   JLRelease(context, entry->result);
+   FreeMemory(context, entry);
+}
+
+void InsertEntry(JLContext *context, Memo *memo, JLValue *key,
+                 uint32_t hash, JLValue *result)
+{
+   MemoEntry *entry;
+   MemoEntry **bucket;
+
+   /* The call may have filled in the same key (recursion). */
+   entry = FindEntry(memo, key, hash);
+   if(entry) {
+      RemoveEntry(context, memo, entry);
+   }
+   if(memo->size >= memo->capacity) {
+      RemoveEntry(context, memo, memo->oldest);
+   }
+
+   entry = (MemoEntry*)AllocMemory(context, sizeof(MemoEntry));
+   bucket = &memo->buckets[hash & memo->mask];
+   entry->key = key;
+   entry->result = result;
+   entry->hash = hash;
+   entry->chain = *bucket;
+   *bucket = entry;
+   PushNewest(memo, entry);
+   memo->size += 1;
+   JLRetain(context, key);
+   JLRetain(context, result);
+}
+
+JLValue *CallMemo(JLContext *context, Memo *memo, JLValue *args)
+{
+   JLValue *key = NULL;
+   JLValue *form = NULL;
+   JLValue *result;
+   JLValue **item = &key;
+   JLValue *vp;
+
+   /* Evaluate the arguments into a list used as the key. */
+   PushRelease(context, &key);
+   PushRelease(context, &form);
+   for(vp = args->next; vp; vp = vp->next) {
+      JLValue *arg = JLEvaluate(context, vp);
+      if(key == NULL) {
+         key = CreateValue(context, NULL, JLVALUE_LIST);
+         item = &key->value.lst;
+      }
+      *item = CreateCell(context, arg);
+      item = &(*item)->next;
+   }
+
+   if(FindMemo(context, memo, key, &result)) {
+      JLRelease(context, key);
+      return result;
+   }
+
+   /* Call with the evaluated arguments. */
+   form = CreateValue(context, NULL, JLVALUE_NIL);
+   form->value.str = args->value.str;
+   if(key) {
+      form->next = key->value.lst;
+      JLRetain(context, form->next);
+   }
+   result = ApplyFunction(context, memo->func, form);
+   JLRelease(context, form);
+
+   StoreMemo(context, memo, key, result);
+   JLRelease(context, key);
+   return result;
+}
+
+char FindMemo(JLContext *context, Memo *memo, JLValue *key, JLValue **result)
+{
+   MemoEntry *entry = FindEntry(memo, key, HashValue(key));
+   if(entry) {
+      memo->hits += 1;
+      Unlink(memo, entry);
+      PushNewest(memo, entry);
+      JLRetain(context, entry->result);
+      *result = entry->result;
+      return 1;
+   }
+   memo->misses += 1;
+   return 0;
+}
+
+void StoreMemo(JLContext *context, Memo *memo, JLValue *key, JLValue *result)
+{
+   InsertEntry(context, memo, key, HashValue(key), result);
+}
+
+void ReleaseMemo(JLContext *context, Memo *memo)
+{
+   memo->count -= 1;
+   if(memo->count == 0) {
+      while(memo->oldest) {
+         RemoveEntry(context, memo, memo->oldest);
+      }
+      JLRelease(context, memo->func);
+      FreeMemory(context, memo->buckets);
+      FreeMemory(context, memo);
+   }
+}
+
+JLValue *MemoizeFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *func;
+   JLValue *result;
+   Memo *memo;
+   size_t capacity = DEFAULT_MEMO_CAPACITY;
+   size_t buckets = 8;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next && args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   func = JLEvaluate(context, args->next);
+   if(func == NULL || (func->tag != JLVALUE_LAMBDA &&
+                       func->tag != JLVALUE_SPECIAL &&
+                       func->tag != JLVALUE_MEMO)) {
+      JLRelease(context, func);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   PushRelease(context, &func);
+   if(args->next->next) {
+      JLValue *arg;
+      arg = JLEvaluate(context, args->next->next);
+      if(arg == NULL || arg->tag != JLVALUE_NUMBER ||
+         Number::ToInt(arg->value.number) < 1) {
+         JLRelease(context, arg);
+         InvalidArgumentError(context, args);
+         return NULL;
+      }
+      capacity = (size_t)Number::ToInt(arg->value.number);
+      JLRelease(context, arg);
+   }
+
+   while(buckets < capacity) {
+      buckets *= 2;
+   }
+   memo = (Memo*)AllocMemory(context, sizeof(Memo));
+   memo->buckets = (MemoEntry**)AllocZeroed(context, buckets,
+                                            sizeof(MemoEntry*));
+   memo->func = func;
+   memo->newest = NULL;
+   memo->oldest = NULL;
+   memo->mask = buckets - 1;
+   memo->capacity = capacity;
+   memo->size = 0;
+   memo->hits = 0;
+   memo->misses = 0;
+   memo->count = 1;
+
+   result = CreateValue(context, NULL, JLVALUE_MEMO);
+   result->value.memo = memo;
+   return result;
+}
+
+JLValue *MemoStatsFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   JLValue *result;
+   JLValue **item;
+   Memo *memo;
+   long long values[4];
+   size_t i;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   arg = JLEvaluate(context, args->next);
+   if(arg == NULL || arg->tag != JLVALUE_MEMO) {
+      JLRelease(context, arg);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+
+   /* Return (hits misses size capacity). */
+   memo = arg->value.memo;
+   values[0] = memo->hits;
+   values[1] = memo->misses;
+   values[2] = memo->size;
+   values[3] = memo->capacity;
+   result = CreateValue(context, NULL, JLVALUE_LIST);
+   item = &result->value.lst;
+   for(i = 0; i < 4; i++) {
+      *item = CreateCell(context, JLDefineNumber(context, NULL,
+                                                 Number::FromInt(values[i])));
+      item = &(*item)->next;
+   }
+   JLRelease(context, arg);
+   return result;
+}
+
+void RegisterMemoFunctions(JLContext *context)
+{
+   RegisterBuiltins(context, &MEMO_TABLE);
+}
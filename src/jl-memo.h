@@ -0,0 +1,58 @@
+/**
+ * @file jl-memo.h
+ *
+ * Memoized functions.
+ */
+
+#ifndef JL_MEMO_H
+#define JL_MEMO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct JLContext;
+struct JLValue;
+
+/** A cached result, keyed by the evaluated arguments. */
+typedef struct MemoEntry {
+   struct JLValue *key;          /**< List of the arguments. */
+   struct JLValue *result;
+   struct MemoEntry *chain;      /**< Next entry in the bucket. */
+   struct MemoEntry *newer;
+   struct MemoEntry *older;
+   uint32_t hash;
+} MemoEntry;
+
+/** Storage for a memoized function. */
+typedef struct Memo {
+   struct JLValue *func;
+   MemoEntry **buckets;
+   MemoEntry *newest;
+   MemoEntry *oldest;
+   size_t mask;
+   size_t capacity;
+   size_t size;
+   unsigned long hits;
+   unsigned long misses;
+   unsigned int count;
+} Memo;
+
+/** Call a memoized function; args is the call form. */
+struct JLValue *CallMemo(struct JLContext *context, Memo *memo,
+                         struct JLValue *args);
+
+/** Look up the result for key, the list of evaluated arguments.
+ * On a hit, returns 1 with a new reference in *result.
+ */
+char FindMemo(struct JLContext *context, Memo *memo, struct JLValue *key,
+              struct JLValue **result);
+
+/** Record the result of a call that missed. */
+void StoreMemo(struct JLContext *context, Memo *memo, struct JLValue *key,
+               struct JLValue *result);
+
+void ReleaseMemo(struct JLContext *context, Memo *memo);
+
+void RegisterMemoFunctions(struct JLContext *context);
+
+#endif /* JL_MEMO_H */
@@ -0,0 +1,284 @@
+/**
+ * @file jl-number.h
+ *
+ * Number policies.
+ * All arithmetic, parsing and formatting of JL numbers goes through the
+ * policy selected with JL_NUMBER, so each build only carries the code
+ * for the representation it uses (and never needs floating point).
+ */
+
+#ifndef JL_NUMBER_H
+#define JL_NUMBER_H
+
+#include "jl.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** Buffer size large enough for any formatted number (base 2). */
+#define NUMBER_BUFFER_SIZE 72
+
+/** Parse the magnitude of a number.
+ * Accepts decimal digits or a "0x" prefix followed by hex digits.
+ * Returns the number of characters consumed (0 if none).
+ */
+static inline size_t ParseMagnitude(const char *str, size_t len,
+                                    uint64_t *value)
+{
+   size_t i = 0;
+   unsigned base = 10;
+   *value = 0;
+   if(len > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+      base = 16;
+      i = 2;
+   }
+   const size_t start = i;
+   for(; i < len; i++) {
+      unsigned digit;
+      if(str[i] >= '0' && str[i] <= '9') {
+         digit = str[i] - '0';
+      } else if(base == 16 && str[i] >= 'a' && str[i] <= 'f') {
+         digit = str[i] - 'a' + 10;
+      } else if(base == 16 && str[i] >= 'A' && str[i] <= 'F') {
+         digit = str[i] - 'A' + 10;
+      } else {
+         break;
+      }
+      *value = *value * base + digit;
+   }
+   return i == start ? 0 : i;
+}
+
+/** Format an unsigned magnitude in the specified base (2 - 36).
+ * Returns the number of characters written (not NULL-terminated).
+ */
+static inline size_t FormatMagnitude(char *buffer, uint64_t value,
+                                     unsigned base)
+{
+   char temp[NUMBER_BUFFER_SIZE];
+   size_t len = 0;
+   size_t i;
+   do {
+      const unsigned digit = (unsigned)(value % base);
+      temp[len++] = digit < 10 ? '0' + digit : 'A' + digit - 10;
+      value /= base;
+   } while(value);
+   for(i = 0; i < len; i++) {
+      buffer[i] = temp[len - i - 1];
+   }
+   return len;
+}
+
+/** Two's complement integers with wrapping arithmetic. */
+template<typename T, typename U>
+struct IntegerNumber {
+
+   typedef T Type;
+
+   static Type FromInt(long long value) { return (Type)value; }
+   static long long ToInt(Type value) { return value; }
+
+   /** A 32-bit word such as a pin mask. */
+   static Type FromBits(uint32_t value) { return (Type)value; }
+   static uint32_t ToBits(Type value) { return (uint32_t)value; }
+
+   /** A free-running count such as time-us, which wraps around. */
+   static Type FromCounter(uint64_t value) { return (Type)(U)value; }
+
+   static Type Add(Type a, Type b) { return (Type)((U)a + (U)b); }
+   static Type Sub(Type a, Type b) { return (Type)((U)a - (U)b); }
+   static Type Mul(Type a, Type b) { return (Type)((U)a * (U)b); }
+   /* The minimum divided by -1 overflows; it wraps to itself. */
+   static Type Div(Type a, Type b)
+   {
+      return b == -1 ? (Type)((U)0 - (U)a) : a / b;
+   }
+   static Type Mod(Type a, Type b) { return b == -1 ? 0 : a % b; }
+
+   static Type And(Type a, Type b) { return a & b; }
+   static Type Or(Type a, Type b) { return a | b; }
+   static Type Xor(Type a, Type b) { return a ^ b; }
+   static Type Not(Type a) { return ~a; }
+   static Type Shl(Type a, Type b)
+   {
+      return (Type)((U)a << (b & (sizeof(Type) * 8 - 1)));
+   }
+   static Type Shr(Type a, Type b)
+   {
+      return a >> (b & (sizeof(Type) * 8 - 1));
+   }
+
+   static int Compare(Type a, Type b) { return a < b ? -1 : (a > b); }
+   static bool IsZero(Type a) { return a == 0; }
+
+   /** Parse exactly len characters; returns false if not a number. */
+   static bool Parse(const char *str, size_t len, Type *result)
+   {
+      uint64_t mag;
+      size_t i = 0;
+      char neg = 0;
+      if(len > 0 && (str[0] == '-' || str[0] == '+')) {
+         neg = str[0] == '-';
+         i = 1;
+      }
+      const size_t used = ParseMagnitude(&str[i], len - i, &mag);
+      if(used == 0 || i + used != len) {
+         return false;
+      }
+      *result = (Type)(neg ? (U)0 - (U)mag : (U)mag);
+      return true;
+   }
+
+   /** Format a number; base 10 is signed, other bases are raw bits. */
+   static size_t Format(char *buffer, Type value, unsigned base)
+   {
+      if(base == 10 && value < 0) {
+         buffer[0] = '-';
+         return 1 + FormatMagnitude(&buffer[1], (U)0 - (U)value, base);
+      }
+      return FormatMagnitude(buffer, (U)value, base);
+   }
+
+};
+
+/** Signed Q(31-FRAC).FRAC fixed point with saturating arithmetic.
+ * Bit operations work on the raw representation.
+ */
+template<int FRAC>
+struct FixedNumber {
+
+   typedef int32_t Type;
+
+   static constexpr int64_t ONE = (int64_t)1 << FRAC;
+
+   static Type Saturate(int64_t value)
+   {
+      if(value > INT32_MAX) {
+         return INT32_MAX;
+      } else if(value < INT32_MIN) {
+         return INT32_MIN;
+      }
+      return (Type)value;
+   }
+
+   static Type FromInt(long long value)
+   {
+      if(value > (INT32_MAX >> FRAC)) {
+         return INT32_MAX;
+      } else if(value < (INT32_MIN >> FRAC)) {
+         return INT32_MIN;
+      }
+      return (Type)(value * ONE);
+   }
+   static long long ToInt(Type value) { return value / ONE; }
+
+   /* Masks are the raw representation, as for the bit operations, since
+    * the integer range holds only 31 - FRAC bits. */
+   static Type FromBits(uint32_t value) { return (Type)value; }
+   static uint32_t ToBits(Type value) { return (uint32_t)value; }
+
+   /* Counts wrap within the non-negative integers. */
+   static Type FromCounter(uint64_t value)
+   {
+      return (Type)((value & (((uint64_t)1 << (31 - FRAC)) - 1)) << FRAC);
+   }
+
+   static Type Add(Type a, Type b) { return Saturate((int64_t)a + b); }
+   static Type Sub(Type a, Type b) { return Saturate((int64_t)a - b); }
+   static Type Mul(Type a, Type b)
+   {
+      return Saturate(((int64_t)a * b) >> FRAC);
+   }
+   static Type Div(Type a, Type b)
+   {
+      return Saturate(((int64_t)a * ONE) / b);
+   }
+   static Type Mod(Type a, Type b) { return b == -1 ? 0 : a % b; }
+
+   static Type And(Type a, Type b) { return a & b; }
+   static Type Or(Type a, Type b) { return a | b; }
+   static Type Xor(Type a, Type b) { return a ^ b; }
+   static Type Not(Type a) { return ~a; }
+   static Type Shl(Type a, Type b)
+   {
+      return (Type)((uint32_t)a << (ToInt(b) & 31));
+   }
+   static Type Shr(Type a, Type b)
+   {
+      return a >> (ToInt(b) & 31);
+   }
+
+   static int Compare(Type a, Type b) { return a < b ? -1 : (a > b); }
+   static bool IsZero(Type a) { return a == 0; }
+
+   static bool Parse(const char *str, size_t len, Type *result)
+   {
+      uint64_t whole;
+      uint64_t frac = 0;
+      uint64_t scale = 1;
+      size_t i = 0;
+      char neg = 0;
+      if(len > 0 && (str[0] == '-' || str[0] == '+')) {
+         neg = str[0] == '-';
+         i = 1;
+      }
+      size_t used = ParseMagnitude(&str[i], len - i, &whole);
+      i += used;
+      if(i < len && str[i] == '.') {
+         i += 1;
+         while(i < len && str[i] >= '0' && str[i] <= '9') {
+            if(scale < 1000000000ULL) {
+               frac = frac * 10 + (str[i] - '0');
+               scale *= 10;
+            }
+            used += 1;
+            i += 1;
+         }
+      }
+      if(used == 0 || i != len) {
+         return false;
+      }
+      int64_t value;
+      if(whole > (uint64_t)(INT32_MAX >> FRAC) + 1) {
+         value = (int64_t)INT32_MAX + 1;
+      } else {
+         value = (int64_t)(whole << FRAC)
+               + (int64_t)((frac * ONE + scale / 2) / scale);
+      }
+      *result = Saturate(neg ? -value : value);
+      return true;
+   }
+
+   static size_t Format(char *buffer, Type value, unsigned base)
+   {
+      const int64_t raw = value;
+      const uint64_t mag = raw < 0 ? -raw : raw;
+      uint64_t frac = mag & (ONE - 1);
+      size_t len = 0;
+      int digits;
+      if(raw < 0) {
+         buffer[len++] = '-';
+      }
+      len += FormatMagnitude(&buffer[len], mag >> FRAC, base);
+      if(frac && base == 10) {
+         buffer[len++] = '.';
+         for(digits = 0; frac && digits < 6; digits++) {
+            frac *= 10;
+            buffer[len++] = '0' + (char)(frac >> FRAC);
+            frac &= ONE - 1;
+         }
+      }
+      return len;
+   }
+
+};
+
+#if JL_NUMBER == JL_NUMBER_INT64
+typedef IntegerNumber<int64_t, uint64_t> Number;
+#elif JL_NUMBER == JL_NUMBER_FIXED
+typedef FixedNumber<JL_FIXED_FRACTION_BITS> Number;
+#else
+typedef IntegerNumber<int32_t, uint32_t> Number;
+#endif
+
+#endif /* JL_NUMBER_H */
@@ -0,0 +1,318 @@
+/**
+ * @file jl-profile.cpp
+ *
+ * Allocation-site heap profiler.
+ * Sites are kept in an append-only array so their IDs stay valid, with an
+ * open-addressed index for lookup.  The current site is cached until the
+ * function being applied (see ApplyFunction) or the line changes.
+ */
+
+#include "jl.h"
+#include "jl-profile.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-bytes.h"
+#include "jl-memo.h"
+#include "jl-number.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#ifdef JL_HEAP_PROFILE
+
+/* Site IDs are 16 bits; further sites are counted with the last one. */
+#define MAX_HEAP_SITES        0xFFFF
+#define INITIAL_SITE_SIZE     64
+
+/** Live values from one site (or the change since an earlier report). */
+typedef struct SiteUsage {
+   long count;
+   long bytes;
+} SiteUsage;
+
+static uint32_t HashSite(const char *name, unsigned int line);
+static char SameName(const char *a, const char *b);
+static unsigned short FindSite(JLContext *context, const char *name,
+                               unsigned int line);
+static void GrowSites(JLContext *context);
+static size_t GetValueBytes(const JLValue *value);
+static void CountValue(JLValue *value, void *arg);
+static char SubtractReport(JLContext *context, JLValue *report,
+                           SiteUsage *usage);
+static JLValue *CreateEntry(JLContext *context, const HeapSite *site,
+                            const SiteUsage *usage);
+
+static JLValue *HeapProfileFunc(JLContext *context, JLValue *args, void *extra);
+
+static constexpr InternalFunctionNode PROFILE_FUNCTIONS[] = {
+   { "heap-profile", HeapProfileFunc, JLEVAL_STRICT }
+};
+DEFINE_BUILTIN_TABLE(PROFILE_TABLE, PROFILE_FUNCTIONS)
+
+uint32_t HashSite(const char *name, unsigned int line)
+{
+   const uint32_t hash = (name ? HashName(name, 0) : 0) ^ (line * 0x9E3779B9u);
+   return hash ^ (hash >> 16);
+}
+
+char SameName(const char *a, const char *b)
+{
+   if(a == NULL || b == NULL) {
+      return a == b;
+   }
+   return !strcmp(a, b);
+}
+
+unsigned short FindSite(JLContext *context, const char *name,
+                        unsigned int line)
+{
+   size_t slot;
+   unsigned short id;
+   if(context->site_size == 0) {
+      return 0;
+   }
+   slot = HashSite(name, line) & (context->site_size - 1);
+   while((id = context->site_index[slot]) != 0) {
+      const HeapSite *site = &context->sites[id - 1];
+      if(site->line == line && SameName(site->name, name)) {
+         return id;
+      }
+      slot = (slot + 1) & (context->site_size - 1);
+   }
+   return 0;
+}
+
+void GrowSites(JLContext *context)
+{
+   const size_t size = context->site_size ? context->site_size * 2
+                                          : INITIAL_SITE_SIZE;
+   size_t i;
+   context->sites = (HeapSite*)ResizeMemory(context, context->sites,
+                                            size / 2 * sizeof(HeapSite));
+   FreeMemory(context, context->site_index);
+   context->site_index = (unsigned short*)AllocZeroed(context, size,
+                                                      sizeof(unsigned short));
+   context->site_size = size;
+   for(i = 0; i < context->site_count; i++) {
+      const HeapSite *site = &context->sites[i];
+      size_t slot = HashSite(site->name, site->line) & (size - 1);
+      while(context->site_index[slot]) {
+         slot = (slot + 1) & (size - 1);
+      }
+      context->site_index[slot] = (unsigned short)(i + 1);
+   }
+}
+
+unsigned short GetHeapSite(JLContext *context)
+{
+   const char *name = context->site_name;
+   const unsigned int line = context->line;
+   HeapSite *site;
+   size_t slot;
+   unsigned short id;
+
+   if(context->site && context->sites[context->site - 1].line == line) {
+      return context->site;
+   }
+   id = FindSite(context, name, line);
+   if(id == 0 && context->site_count == MAX_HEAP_SITES) {
+      id = MAX_HEAP_SITES;
+   } else if(id == 0) {
+      if((context->site_count + 1) * 2 > context->site_size) {
+         GrowSites(context);
+      }
+      site = &context->sites[context->site_count];
+      site->name = name ? CopyString(context, name) : NULL;
+      site->line = line;
+      context->site_count += 1;
+      id = (unsigned short)context->site_count;
+      slot = HashSite(name, line) & (context->site_size - 1);
+      while(context->site_index[slot]) {
+         slot = (slot + 1) & (context->site_size - 1);
+      }
+      context->site_index[slot] = id;
+   }
+   context->site = id;
+   return id;
+}
+
+void ReleaseHeapSites(JLContext *context)
+{
+   size_t i;
+   for(i = 0; i < context->site_count; i++) {
+      FreeMemory(context, context->sites[i].name);
+   }
+   FreeMemory(context, context->sites);
+   FreeMemory(context, context->site_index);
+   context->sites = NULL;
+   context->site_index = NULL;
+   context->site_count = 0;
+   context->site_size = 0;
+   context->site = 0;
+}
+
+size_t GetValueBytes(const JLValue *value)
+{
+   size_t bytes = sizeof(JLValue);
+   const Memo *memo;
+   switch(value->tag) {
+   case JLVALUE_STRING:
+   case JLVALUE_VARIABLE:
+      if(value->value.str) {
+         bytes += strlen(value->value.str) + 1;
+      }
+      break;
+   case JLVALUE_BYTES:
+      bytes += sizeof(ByteBuffer);
+      if(value->value.bytes->base == NULL) {
+         bytes += value->value.bytes->capacity;
+      }
+      break;
+   case JLVALUE_MEMO:
+      memo = value->value.memo;
+      bytes += sizeof(Memo) + (memo->mask + 1) * sizeof(MemoEntry*)
+             + memo->size * sizeof(MemoEntry);
+      break;
+   default:
+      break;
+   }
+   return bytes;
+}
+
+void CountValue(JLValue *value, void *arg)
+{
+   SiteUsage *usage = &((SiteUsage*)arg)[value->site - 1];
+   usage->count += 1;
+   usage->bytes += (long)GetValueBytes(value);
+}
+
+char SubtractReport(JLContext *context, JLValue *report, SiteUsage *usage)
+{
+   JLValue *vp;
+
+   /* Each entry is (name line count bytes). */
+   for(vp = report ? report->value.lst : NULL; vp; vp = vp->next) {
+      const JLValue *entry = GetElement(vp);
+      const JLValue *fields[4];
+      const JLValue *fp;
+      const char *name;
+      unsigned short id;
+      size_t i = 0;
+      if(entry == NULL || entry->tag != JLVALUE_LIST) {
+         return 0;
+      }
+      for(fp = entry->value.lst; fp && i < 4; fp = fp->next) {
+         fields[i++] = GetElement((JLValue*)fp);
+      }
+      if(i < 4 || (fields[0] && fields[0]->tag != JLVALUE_STRING) ||
+         fields[1] == NULL || fields[1]->tag != JLVALUE_NUMBER ||
+         fields[2] == NULL || fields[2]->tag != JLVALUE_NUMBER ||
+         fields[3] == NULL || fields[3]->tag != JLVALUE_NUMBER) {
+         return 0;
+      }
+      name = fields[0] ? fields[0]->value.str : NULL;
+      id = FindSite(context, name,
+                    (unsigned int)Number::ToInt(fields[1]->value.number));
+      if(id) {
+         usage[id - 1].count -= (long)Number::ToInt(fields[2]->value.number);
+         usage[id - 1].bytes -= (long)Number::ToInt(fields[3]->value.number);
+      }
+   }
+   return 1;
+}
+
+JLValue *CreateEntry(JLContext *context, const HeapSite *site,
+                     const SiteUsage *usage)
+{
+   JLValue *entry = CreateValue(context, NULL, JLVALUE_LIST);
+   JLValue *name = NULL;
+   JLValue **item = &entry->value.lst;
+   if(site->name) {
+      name = CreateValue(context, NULL, JLVALUE_STRING);
+      name->value.str = CopyString(context, site->name);
+   }
+   *item = CreateCell(context, name);
+   item = &(*item)->next;
+   *item = JLDefineNumber(context, NULL, Number::FromInt(site->line));
+   item = &(*item)->next;
+   *item = JLDefineNumber(context, NULL, Number::FromInt(usage->count));
+   item = &(*item)->next;
+   *item = JLDefineNumber(context, NULL, Number::FromInt(usage->bytes));
+   return entry;
+}
+
+JLValue *HeapProfileFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *earlier = NULL;
+   JLValue *result = NULL;
+   JLValue **item = &result;
+   SiteUsage *usage;
+   unsigned short *order;
+   size_t count = 0;
+   size_t i, j;
+
+   if(args->next && args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next) {
+      earlier = JLEvaluate(context, args->next);
+      if(earlier && earlier->tag != JLVALUE_LIST) {
+         JLRelease(context, earlier);
+         InvalidArgumentError(context, args);
+         return NULL;
+      }
+   }
+
+   /* Tally first, so nothing allocated here is counted. */
+   JLDrainReleases(context, 0);
+   usage = (SiteUsage*)AllocZeroed(context, context->site_count + 1,
+                                   sizeof(SiteUsage));
+   ForEachValue(context, CountValue, usage);
+   if(!SubtractReport(context, earlier, usage)) {
+      FreeMemory(context, usage);
+      JLRelease(context, earlier);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   JLRelease(context, earlier);
+
+   /* Largest first; earlier reports (made here) are left out. */
+   order = (unsigned short*)AllocMemory(context, (context->site_count + 1)
+                                                 * sizeof(unsigned short));
+   for(i = 0; i < context->site_count; i++) {
+      const HeapSite *site = &context->sites[i];
+      if((usage[i].count || usage[i].bytes) &&
+         !SameName(site->name, args->value.str)) {
+         for(j = count; j > 0 && usage[order[j - 1]].bytes < usage[i].bytes;
+             j--) {
+            order[j] = order[j - 1];
+         }
+         order[j] = (unsigned short)i;
+         count += 1;
+      }
+   }
+
+   if(count > 0) {
+      result = CreateValue(context, NULL, JLVALUE_LIST);
+      item = &result->value.lst;
+   }
+   for(i = 0; i < count; i++) {
+      *item = CreateCell(context, CreateEntry(context,
+                                              &context->sites[order[i]],
+                                              &usage[order[i]]));
+      item = &(*item)->next;
+   }
+   FreeMemory(context, order);
+   FreeMemory(context, usage);
+   return result;
+}
+
+void RegisterProfileFunctions(JLContext *context)
+{
+   RegisterBuiltins(context, &PROFILE_TABLE);
+}
+
+#endif /* JL_HEAP_PROFILE */
@@ -0,0 +1,32 @@
+/**
+ * @file jl-profile.h
+ *
+ * Allocation-site heap profiler.
+ * With JL_HEAP_PROFILE, each value records the site that allocated it:
+ * the function being applied and the source line.  (heap-profile) walks
+ * the live values and reports count and bytes (including strings and byte
+ * buffers) by site; (heap-profile earlier) reports the change since an
+ * earlier report.
+ */
+
+#ifndef JL_PROFILE_H
+#define JL_PROFILE_H
+
+#include <stddef.h>
+
+struct JLContext;
+
+/** A place values are allocated from. */
+typedef struct HeapSite {
+   char *name;                   /**< Function being applied (or NULL). */
+   unsigned int line;
+} HeapSite;
+
+/** Get the ID of the current site (never 0, which marks free nodes). */
+unsigned short GetHeapSite(struct JLContext *context);
+
+void ReleaseHeapSites(struct JLContext *context);
+
+void RegisterProfileFunctions(struct JLContext *context);
+
+#endif /* JL_PROFILE_H */
@@ -0,0 +1,379 @@
+/**
+ * @file jl-reclaim.cpp
+ *
+ * Background reclamation (JL_BACKGROUND_RELEASE).
+ * Roots go to the reclaimer through a single-producer, single-consumer
+ * ring, and freed nodes come back the same way as chains that are spliced
+ * onto the freelist in one step.  Reference counts are only ever changed
+ * by the evaluating thread: the reclaimer frees a value only if the dead
+ * structure holds its last reference (which nothing else can then take),
+ * and passes every other reference back to be released there.  Interned
+ * values, which the intern table can still hand out, and values such as
+ * scopes whose contents need the context are passed back as well.
+ */
+
+#include "jl.h"
+#include "jl-reclaim.h"
+#include "jl-value.h"
+#include "jl-context.h"
+
+#ifdef JL_BACKGROUND_RELEASE
+
+#ifdef RP2040
+#include <pico/multicore.h>
+#include <hardware/sync.h>
+#else
+#include <thread>
+#endif
+
+#include <atomic>
+#include <new>
+
+/** A single-producer, single-consumer ring. */
+template<typename T>
+struct ReclaimRing {
+   T items[JL_RECLAIM_QUEUE];
+   std::atomic<size_t> head;     /**< Next item to take. */
+   std::atomic<size_t> tail;     /**< Next slot to fill. */
+};
+
+static_assert((JL_RECLAIM_QUEUE & (JL_RECLAIM_QUEUE - 1)) == 0,
+              "JL_RECLAIM_QUEUE must be a power of two");
+
+/** A chain of free nodes (see ChainFree). */
+typedef struct FreeBatch {
+   void *first;
+   void *last;
+} FreeBatch;
+
+typedef struct Reclaimer {
+   JLContext *context;
+   ReclaimRing<JLValue*> dead;      /**< Roots to free. */
+   ReclaimRing<JLValue*> passed;    /**< References to release. */
+   ReclaimRing<FreeBatch> freed;
+   std::atomic<char> busy;
+   std::atomic<char> stop;
+   std::atomic<char> stopped;
+   FreeBatch batch;              /**< Nodes freed since the last batch. */
+   size_t batch_count;
+#ifndef RP2040
+   std::thread thread;
+#endif
+} Reclaimer;
+
+#ifdef RP2040
+/* The second core runs the reclaimer of one context at most. */
+static Reclaimer *volatile core1_reclaimer = NULL;
+static void RunCore1();
+#else
+static void RunThread(Reclaimer *reclaimer);
+#endif
+
+template<typename T>
+static char PushRing(ReclaimRing<T> *ring, const T &item);
+template<typename T>
+static char PopRing(ReclaimRing<T> *ring, T *item);
+template<typename T>
+static char IsRingEmpty(ReclaimRing<T> *ring);
+
+static void Pause();
+static char IsReclaimable(const JLValue *value);
+static char IsOwned(const JLValue *value);
+static void PassBack(Reclaimer *reclaimer, JLValue *value);
+static void AddFreed(Reclaimer *reclaimer, JLValue *value);
+static void FlushFreed(Reclaimer *reclaimer);
+static void ReclaimValue(Reclaimer *reclaimer, JLValue *value);
+static char RunReclaimer(Reclaimer *reclaimer);
+
+template<typename T>
+char PushRing(ReclaimRing<T> *ring, const T &item)
+{
+   const size_t tail = ring->tail.load(std::memory_order_relaxed);
+   if(tail - ring->head.load(std::memory_order_acquire) == JL_RECLAIM_QUEUE) {
+      return 0;
+   }
+   ring->items[tail & (JL_RECLAIM_QUEUE - 1)] = item;
+   ring->tail.store(tail + 1, std::memory_order_release);
+   return 1;
+}
+
+template<typename T>
+char PopRing(ReclaimRing<T> *ring, T *item)
+{
+   const size_t head = ring->head.load(std::memory_order_relaxed);
+   if(head == ring->tail.load(std::memory_order_acquire)) {
+      return 0;
+   }
+   *item = ring->items[head & (JL_RECLAIM_QUEUE - 1)];
+   ring->head.store(head + 1, std::memory_order_release);
+   return 1;
+}
+
+template<typename T>
+char IsRingEmpty(ReclaimRing<T> *ring)
+{
+   return ring->head.load(std::memory_order_acquire)
+       == ring->tail.load(std::memory_order_acquire);
+}
+
+void Pause()
+{
+#ifdef RP2040
+   tight_loop_contents();
+#else
+   std::this_thread::yield();
+#endif
+}
+
+char IsReclaimable(const JLValue *value)
+{
+   switch(value->tag) {
+   case JLVALUE_NIL:
+   case JLVALUE_NUMBER:
+   case JLVALUE_STRING:
+   case JLVALUE_VARIABLE:
+   case JLVALUE_SPECIAL:
+   case JLVALUE_LIST:
+   case JLVALUE_LAMBDA:
+   case JLVALUE_CELL:
+   case JLVALUE_MACRO:
+      return 1;
+   default:
+      return 0;
+   }
+}
+
+char IsOwned(const JLValue *value)
+{
+   /* Only the evaluating thread changes counts, and it can't reach a
+    * value whose last reference is in a dead structure, so a count of
+    * one read here stays one.  The fence pairs with the one in JLRelease
+    * so the evaluating thread is done with the value. */
+   if(value->count == 1 && !(value->flags & JLVALUE_FLAG_INTERNED)
+      && IsReclaimable(value)) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return 1;
+   }
+   return 0;
+}
+
+void PassBack(Reclaimer *reclaimer, JLValue *value)
+{
+   while(!PushRing(&reclaimer->passed, value)) {
+      Pause();
+   }
+}
+
+void AddFreed(Reclaimer *reclaimer, JLValue *value)
+{
+   if(reclaimer->batch_count == 0) {
+      reclaimer->batch.last = value;
+   }
+   reclaimer->batch.first = ChainFree(value, reclaimer->batch.first);
+   reclaimer->batch_count += 1;
+   if(reclaimer->batch_count == JL_RECLAIM_BATCH) {
+      FlushFreed(reclaimer);
+   }
+}
+
+void FlushFreed(Reclaimer *reclaimer)
+{
+   if(reclaimer->batch_count > 0) {
+      while(!PushRing(&reclaimer->freed, reclaimer->batch)) {
+         Pause();
+      }
+      reclaimer->batch.first = NULL;
+      reclaimer->batch.last = NULL;
+      reclaimer->batch_count = 0;
+   }
+}
+
+void ReclaimValue(Reclaimer *reclaimer, JLValue *value)
+{
+   JLValue *stack[JL_RECLAIM_DEPTH];
+   size_t depth = 0;
+
+   /* Follow next links in place and stack the lists they contain; lists
+    * nested too deeply go back to be queued again. */
+   for(;;) {
+      while(value) {
+         JLValue *next = value->next;
+         JLValue *child;
+         switch(value->tag) {
+         case JLVALUE_LIST:
+         case JLVALUE_LAMBDA:
+         case JLVALUE_CELL:
+         case JLVALUE_MACRO:
+            child = value->value.lst;
+            if(child && IsOwned(child) && depth < JL_RECLAIM_DEPTH) {
+               stack[depth++] = child;
+            } else if(child) {
+               PassBack(reclaimer, child);
+            }
+            break;
+         case JLVALUE_STRING:
+         case JLVALUE_VARIABLE:
+            FreeMemory(reclaimer->context, value->value.str);
+            break;
+         default:
+            break;
+         }
+         AddFreed(reclaimer, value);
+         if(next && !IsOwned(next)) {
+            PassBack(reclaimer, next);
+            next = NULL;
+         }
+         value = next;
+      }
+      if(depth == 0) {
+         break;
+      }
+      depth -= 1;
+      value = stack[depth];
+   }
+}
+
+char RunReclaimer(Reclaimer *reclaimer)
+{
+   JLValue *value;
+
+   /* Busy is set before the ring is checked, so a root is never in
+    * flight without it. */
+   reclaimer->busy.store(1);
+   if(!PopRing(&reclaimer->dead, &value)) {
+      FlushFreed(reclaimer);
+      reclaimer->busy.store(0);
+      return 0;
+   }
+   ReclaimValue(reclaimer, value);
+   return 1;
+}
+
+#ifdef RP2040
+
+void RunCore1()
+{
+   Reclaimer *reclaimer = core1_reclaimer;
+   while(!reclaimer->stop.load()) {
+      if(!RunReclaimer(reclaimer)) {
+         __wfe();
+      }
+   }
+   reclaimer->stopped.store(1);
+   for(;;) {
+      __wfe();
+   }
+}
+
+#else
+
+void RunThread(Reclaimer *reclaimer)
+{
+   while(!reclaimer->stop.load()) {
+      if(!RunReclaimer(reclaimer)) {
+         std::this_thread::sleep_for(std::chrono::microseconds(
+            JL_RECLAIM_IDLE_US));
+      }
+   }
+   reclaimer->stopped.store(1);
+}
+
+#endif
+
+void StartReclaimer(JLContext *context)
+{
+   Reclaimer *reclaimer;
+#ifdef RP2040
+   if(core1_reclaimer) {
+      return;
+   }
+#endif
+   if(context->arena) {
+      return;
+   }
+   reclaimer = new(std::nothrow) Reclaimer();
+   if(reclaimer == NULL) {
+      return;
+   }
+   reclaimer->context = context;
+   context->reclaimer = reclaimer;
+#ifdef RP2040
+   core1_reclaimer = reclaimer;
+   multicore_launch_core1(RunCore1);
+#else
+   reclaimer->thread = std::thread(RunThread, reclaimer);
+#endif
+}
+
+void StopReclaimer(JLContext *context)
+{
+   Reclaimer *reclaimer = context->reclaimer;
+   if(reclaimer == NULL) {
+      return;
+   }
+   JLDrainReleases(context, 0);
+   reclaimer->stop.store(1);
+#ifdef RP2040
+   __sev();
+   while(!reclaimer->stopped.load()) {
+      tight_loop_contents();
+   }
+   multicore_reset_core1();
+   core1_reclaimer = NULL;
+#else
+   reclaimer->thread.join();
+#endif
+   context->reclaimer = NULL;
+   delete reclaimer;
+}
+
+char OfferReclaim(JLContext *context, JLValue *value)
+{
+   Reclaimer *reclaimer = context->reclaimer;
+   if(reclaimer == NULL || !IsReclaimable(value) ||
+      !PushRing(&reclaimer->dead, value)) {
+      return 0;
+   }
+#ifdef RP2040
+   __sev();
+#endif
+   return 1;
+}
+
+size_t CollectReclaimed(JLContext *context, size_t limit)
+{
+   Reclaimer *reclaimer = context->reclaimer;
+   FreeBatch batch;
+   JLValue *value;
+   size_t steps = 0;
+
+   if(reclaimer == NULL) {
+      return 0;
+   }
+   while(PopRing(&reclaimer->freed, &batch)) {
+      PutFreeChain(context, batch.first, batch.last);
+   }
+   while((limit == 0 || steps < limit) &&
+         PopRing(&reclaimer->passed, &value)) {
+      JLRelease(context, value);
+      steps += 1;
+   }
+   return steps;
+}
+
+char WaitReclaimer(JLContext *context)
+{
+   Reclaimer *reclaimer = context->reclaimer;
+   if(reclaimer == NULL) {
+      return 0;
+   }
+
+   /* Check the roots first: one taken since then has busy set. */
+   if(!IsRingEmpty(&reclaimer->dead) || reclaimer->busy.load()) {
+      Pause();
+      return 1;
+   }
+   return !IsRingEmpty(&reclaimer->passed) || !IsRingEmpty(&reclaimer->freed);
+}
+
+#endif /* JL_BACKGROUND_RELEASE */
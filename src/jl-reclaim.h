@@ -0,0 +1,47 @@
+/**
+ * @file jl-reclaim.h
+ *
+ * Background reclamation (JL_BACKGROUND_RELEASE).
+ * Dead values are freed by a reclaimer on another thread (the second core
+ * on the RP2040), so the evaluating thread only hands over their roots and
+ * takes the freed nodes back in batches.
+ */
+
+#ifndef JL_RECLAIM_H
+#define JL_RECLAIM_H
+
+#include <stddef.h>
+
+struct JLContext;
+struct JLValue;
+
+#ifdef JL_BACKGROUND_RELEASE
+
+/** Start the reclaimer for a context.
+ * Real-time contexts have none, since the arena is not shared between
+ * threads, and on the RP2040 only one context can have the second core.
+ */
+void StartReclaimer(struct JLContext *context);
+
+/** Stop the reclaimer once everything handed to it is freed. */
+void StopReclaimer(struct JLContext *context);
+
+/** Hand a dead value to the reclaimer.
+ * Returns zero if the value must be freed here instead.
+ */
+char OfferReclaim(struct JLContext *context, struct JLValue *value);
+
+/** Take back the nodes the reclaimer has freed and release the values it
+ * passed back (at most limit of them, or all that are ready for 0).
+ * Returns the number of values released.
+ */
+size_t CollectReclaimed(struct JLContext *context, size_t limit);
+
+/** Give the reclaimer a chance to run.
+ * Returns zero once it has nothing in flight.
+ */
+char WaitReclaimer(struct JLContext *context);
+
+#endif /* JL_BACKGROUND_RELEASE */
+
+#endif /* JL_RECLAIM_H */
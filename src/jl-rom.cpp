@@ -0,0 +1,57 @@
+/**
+ * @file jl-rom.cpp
+ *
+ * Constant bindings in flash.
+ * These are looked up after the globals, so a program can still define
+ * its own value for a name, and before the built-in functions.
+ */
+
+#include "jl.h"
+#include "jl-rom.h"
+#include "jl-func.h"
+#include "jl-context.h"
+
+#include <cstring>
+
+JLValue *LookupRom(JLContext *context, const char *name, char *found)
+{
+   const JLRom *rom = context->rom;
+   const uint32_t hash = HashName(name, 0);
+   size_t low = 0;
+   size_t high;
+   size_t i;
+
+   *found = 0;
+   if(rom == NULL) {
+      return NULL;
+   }
+
+   /* Find the first binding with the hash. */
+   high = rom->count;
+   while(low < high) {
+      const size_t mid = low + (high - low) / 2;
+      if(rom->bindings[mid].hash < hash) {
+         low = mid + 1;
+      } else {
+         high = mid;
+      }
+   }
+   for(i = low; i < rom->count && rom->bindings[i].hash == hash; i++) {
+      if(!strcmp(rom->bindings[i].name, name)) {
+         *found = 1;
+         return const_cast<JLValue*>(rom->bindings[i].value);
+      }
+   }
+   return NULL;
+}
+
+void JLUseRom(JLContext *context, const JLRom *rom)
+{
+   if(context->rom) {
+      context->macro_count -= context->rom->macros;
+   }
+   context->rom = rom;
+   if(rom) {
+      context->macro_count += rom->macros;
+   }
+}
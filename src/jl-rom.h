@@ -0,0 +1,52 @@
+/**
+ * @file jl-rom.h
+ *
+ * Constant bindings in flash.
+ * jlrom turns JL code into a source file of constant values and the
+ * bindings it defined; linked into the firmware and passed to JLUseRom,
+ * these take no RAM and nothing is parsed at boot.  The values have the
+ * count JLVALUE_ROM_COUNT, which JLRetain and JLRelease leave alone.
+ */
+
+#ifndef JL_ROM_H
+#define JL_ROM_H
+
+#include "jl.h"
+#include "jl-value.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Build a constant value.
+ * data is a value pointer, string or NUMBER_TYPE (see JLValueData).
+ */
+#ifdef JL_HEAP_PROFILE
+#define JL_ROM_VALUE(data, next, tag, flags) \
+   { JLValueData(data), const_cast<JLValue*>(next), \
+     JLVALUE_ROM_COUNT, tag, flags, 0 }
+#else
+#define JL_ROM_VALUE(data, next, tag, flags) \
+   { JLValueData(data), const_cast<JLValue*>(next), \
+     JLVALUE_ROM_COUNT, tag, flags }
+#endif
+
+/** A binding; hash is HashName(name, 0). */
+typedef struct JLRomBinding {
+   const char *name;
+   uint32_t hash;
+   const JLValue *value;
+} JLRomBinding;
+
+/** The output of jlrom. */
+typedef struct JLRom {
+   const JLRomBinding *bindings;    /**< Sorted by hash. */
+   size_t count;
+   unsigned int macros;             /**< Bindings that are macros. */
+} JLRom;
+
+/** Look up a constant binding.
+ * found is set to zero if there is none (the value can be nil).
+ */
+JLValue *LookupRom(struct JLContext *context, const char *name, char *found);
+
+#endif /* JL_ROM_H */
@@ -6,12 +6,42 @@
 #include "jl-scope.h"
 #include "jl-context.h"
 #include "jl-value.h"
+#include "jl-func.h"
+#include "jl-rom.h"
 
 #include <stdlib.h>
 #include <string.h>
 
+static char IsScopeCycle(const JLValue *value, const ScopeNode *scope);
 static unsigned int CountScopeBindings(BindingNode *binding, ScopeNode *scope);
-static void ReleaseBindings(JLContext *context, BindingNode *binding);
+static void ReleaseBindings(JLContext *context, BindingNode *binding,
+                            ScopeNode *scope);
+static BindingNode **FindBinding(ScopeNode *scope, const char *name);
+static char IsScopeEscaped(ScopeNode *scope);
+static void PromoteFrame(JLContext *context, ScopeNode *scope);
+static GlobalNode *FindGlobal(GlobalNode *globals, size_t size,
+                              const char *name, uint32_t hash);
+static void GrowGlobals(JLContext *context);
+static JLValue *LookupBuiltin(JLContext *context, const char *name,
+                              char *found);
+
+#define INITIAL_GLOBAL_SIZE   64
+#define FRAME_CHUNK_SIZE      256
+
+/** Storage for frame bindings; used as a stack. */
+typedef struct FrameChunk {
+   struct FrameChunk *prev;
+   unsigned int used;
+   FrameBinding bindings[FRAME_CHUNK_SIZE];
+} FrameChunk;
+
+/** Determine if a value is a closure over scope that only its binding
+ * refers to, so the two only keep each other alive. */
+char IsScopeCycle(const JLValue *value, const ScopeNode *scope)
+{
+   return value && value->tag == JLVALUE_LAMBDA && value->count == 1
+       && value->value.lst->value.scope == scope;
+}
 
 unsigned int CountScopeBindings(BindingNode *binding, ScopeNode *scope)
 {
@@ -19,34 +49,42 @@ unsigned int CountScopeBindings(BindingNode *binding, ScopeNode *scope)
    if(binding) {
       count += CountScopeBindings(binding->left, scope);
       count += CountScopeBindings(binding->right, scope);
-      if(binding->value &&
-         binding->value->tag == JLVALUE_LAMBDA &&
-         binding->value->count == 1) {
-         if(binding->value->value.lst->value.scope == scope) {
-            count += 1;
-         }
+      if(IsScopeCycle(binding->value, scope)) {
+         count += 1;
       }
    }
    return count;
 }
 
-void ReleaseBindings(JLContext *context, BindingNode *binding)
+void ReleaseBindings(JLContext *context, BindingNode *binding,
+                     ScopeNode *scope)
 {
    if(binding) {
-      ReleaseBindings(context, binding->left);
-      ReleaseBindings(context, binding->right);
-      free(binding->name);
+      ReleaseBindings(context, binding->left, scope);
+      ReleaseBindings(context, binding->right, scope);
+      FreeMemory(context, binding->name);
+      if(IsScopeCycle(binding->value, scope)) {
+         /* The closure goes with the scope; its reference was counted
+          * above, and releasing it later would find the scope gone. */
+         binding->value->value.lst->value.scope = NULL;
+      }
       JLRelease(context, binding->value);
-      PutFree(context, binding);
+      PutFreeScope(context, binding);
    }
 }
 
 void JLEnterScope(JLContext *context)
 {
-   ScopeNode *scope = (ScopeNode*)GetFree(context);
+   ScopeNode *scope = (ScopeNode*)GetFreeScope(context);
    scope->count = 1;
    scope->bindings = NULL;
+   scope->frame = NULL;
+   scope->frame_count = 0;
    scope->next = context->scope;
+   if(scope->next) {
+      /* Closures created here can outlive the enclosing scope. */
+      scope->next->count += 1;
+   }
    context->scope = scope;
 }
 
@@ -59,21 +97,307 @@ void JLLeaveScope(JLContext *context)
 
 void ReleaseScope(JLContext *context, ScopeNode *scope)
 {
-   const unsigned int new_count = scope->count - 1
-                                - CountScopeBindings(scope->bindings, scope);
-   if(new_count == 0) {
-      ReleaseBindings(context, scope->bindings);
-      PutFree(context, scope);
+   /* Walk up the chain in a loop; closure chains can be deep. */
+   while(scope) {
+      const unsigned int new_count = scope->count - 1
+                                   - CountScopeBindings(scope->bindings,
+                                                        scope);
+      if(new_count == 0) {
+         ScopeNode *next = scope->next;
+         ReleaseBindings(context, scope->bindings, scope);
+         PutFreeScope(context, scope);
+         scope = next;
+      } else {
+         scope->count -= 1;
+         break;
+      }
+   }
+}
+
+BindingNode **FindBinding(ScopeNode *scope, const char *name)
+{
+   BindingNode **root = &scope->bindings;
+   while(*root) {
+      const int v = strcmp((*root)->name, name);
+      if(v < 0) {
+         root = &(*root)->left;
+      } else if(v > 0) {
+         root = &(*root)->right;
+      } else {
+         break;
+      }
+   }
+   return root;
+}
+
+void DefineBinding(JLContext *context, ScopeNode *scope,
+                   const char *name, JLValue *value)
+{
+   BindingNode **root = FindBinding(scope, name);
+   if(*root) {
+      /* Overwrite the old binding. */
+      JLRetain(context, value);
+      JLRelease(context, (*root)->value);
+      (*root)->value = value;
    } else {
-      scope->count -= 1;
+      /* Allocate before linking in case memory runs out. */
+      BindingNode *node = (BindingNode*)GetFreeScope(context);
+      node->name = CopyString(context, name);
+      node->value = value;
+      node->left = NULL;
+      node->right = NULL;
+      JLRetain(context, value);
+      *root = node;
    }
 }
 
-JLValue *Lookup(JLContext *context, const char *name)
+FrameBinding *PushFrame(JLContext *context, unsigned int count)
+{
+   FrameChunk *chunk = context->frames;
+   FrameBinding *result;
+   if(count > FRAME_CHUNK_SIZE) {
+      return NULL;
+   }
+   if(chunk == NULL || chunk->used + count > FRAME_CHUNK_SIZE) {
+      if(context->spare_frames) {
+         chunk = context->spare_frames;
+         context->spare_frames = NULL;
+      } else {
+         chunk = (FrameChunk*)AllocMemory(context, sizeof(FrameChunk));
+      }
+      chunk->prev = context->frames;
+      chunk->used = 0;
+      context->frames = chunk;
+   }
+   result = &chunk->bindings[chunk->used];
+   chunk->used += count;
+   return result;
+}
+
+void PopFrame(JLContext *context, unsigned int count)
+{
+   FrameChunk *chunk = context->frames;
+   chunk->used -= count;
+   if(chunk->used == 0 && chunk->prev) {
+      /* Keep one chunk around so calls at a boundary don't thrash. */
+      context->frames = chunk->prev;
+      FreeMemory(context, context->spare_frames);
+      context->spare_frames = chunk;
+   }
+}
+
+/** Determine if something other than the scope itself still refers
+ * to it: a closure created in it or a scope nested in it. */
+char IsScopeEscaped(ScopeNode *scope)
+{
+   unsigned int cycles = CountScopeBindings(scope->bindings, scope);
+   unsigned int i;
+   for(i = 0; i < scope->frame_count; i++) {
+      if(IsScopeCycle(scope->frame[i].value, scope)) {
+         cycles += 1;
+      }
+   }
+   return scope->count > 1 + cycles;
+}
+
+void PromoteFrame(JLContext *context, ScopeNode *scope)
+{
+   unsigned int i;
+   for(i = 0; i < scope->frame_count; i++) {
+      FrameBinding *binding = &scope->frame[i];
+      /* A define in the body shadows the parameter. */
+      if(*FindBinding(scope, binding->name) == NULL) {
+         DefineBinding(context, scope, binding->name, binding->value);
+      }
+      JLRelease(context, binding->value);
+      binding->value = NULL;
+   }
+   scope->frame = NULL;
+   scope->frame_count = 0;
+}
+
+void LeaveFrameScope(JLContext *context, FrameBinding *frame,
+                     unsigned int size)
+{
+   ScopeNode *scope = context->scope;
+   unsigned int i;
+   if(IsScopeEscaped(scope)) {
+      /* A closure outlives the call; its bindings move to the heap. */
+      PromoteFrame(context, scope);
+   }
+   for(i = 0; i < scope->frame_count; i++) {
+      JLRelease(context, frame[i].value);
+   }
+   scope->frame = NULL;
+   scope->frame_count = 0;
+   if(frame) {
+      PopFrame(context, size);
+   }
+   JLLeaveScope(context);
+}
+
+void ReleaseFrames(JLContext *context)
+{
+   FreeMemory(context, context->spare_frames);
+   context->spare_frames = NULL;
+   while(context->frames) {
+      FrameChunk *prev = context->frames->prev;
+      FreeMemory(context, context->frames);
+      context->frames = prev;
+   }
+}
+
+GlobalNode *FindGlobal(GlobalNode *globals, size_t size,
+                       const char *name, uint32_t hash)
+{
+   size_t index = hash & (size - 1);
+   for(;;) {
+      GlobalNode *node = &globals[index];
+      if(node->name == NULL) {
+         return node;
+      }
+      if(node->hash == hash && !strcmp(node->name, name)) {
+         return node;
+      }
+      index = (index + 1) & (size - 1);
+   }
+}
+
+void GrowGlobals(JLContext *context)
 {
-   const ScopeNode *scope = context->scope;
+   const size_t old_size = context->global_size;
+   const size_t size = old_size ? old_size * 2 : INITIAL_GLOBAL_SIZE;
+   GlobalNode *old_globals = context->globals;
+   size_t i;
+
+   context->globals = (GlobalNode*)AllocZeroed(context, size,
+                                               sizeof(GlobalNode));
+   context->global_size = size;
+   for(i = 0; i < old_size; i++) {
+      if(old_globals[i].name) {
+         GlobalNode *node = FindGlobal(context->globals,
+                                       context->global_size,
+                                       old_globals[i].name,
+                                       old_globals[i].hash);
+         *node = old_globals[i];
+      }
+   }
+   FreeMemory(context, old_globals);
+}
+
+void DefineGlobal(JLContext *context, const char *name, JLValue *value)
+{
+   const uint32_t hash = HashName(name, 0);
+   GlobalNode *node;
+
+   /* Keep the load factor under 3/4 so probe sequences stay short. */
+   if((context->global_count + 1) * 4 > context->global_size * 3) {
+      GrowGlobals(context);
+   }
+
+   node = FindGlobal(context->globals, context->global_size, name, hash);
+   if(node->name) {
+      /* Overwrite the old binding. */
+      JLRetain(context, value);
+      JLRelease(context, node->value);
+   } else {
+      node->name = CopyString(context, name);
+      node->hash = hash;
+      context->global_count += 1;
+      JLRetain(context, value);
+   }
+   node->value = value;
+}
+
+void ReleaseGlobals(JLContext *context)
+{
+   size_t i;
+   for(i = 0; i < context->global_size; i++) {
+      GlobalNode *node = &context->globals[i];
+      if(node->name) {
+         JLValue *value = node->value;
+         FreeMemory(context, node->name);
+         node->name = NULL;
+         node->value = NULL;
+         JLRelease(context, value);
+      }
+   }
+   FreeMemory(context, context->globals);
+   context->globals = NULL;
+   context->global_size = 0;
+   context->global_count = 0;
+}
+
+void RegisterBuiltins(JLContext *context, const BuiltinTable *table)
+{
+   const unsigned int index = context->builtin_count;
+   if(index >= JL_MAX_BUILTIN_TABLES) {
+      Error(context, "too many builtin tables");
+      return;
+   }
+
+   /* Values are created on first use. */
+   context->builtins[index] = table;
+   context->builtin_values[index]
+      = (JLValue**)AllocZeroed(context, table->count, sizeof(JLValue*));
+   context->builtin_count += 1;
+}
+
+void ReleaseBuiltins(JLContext *context)
+{
+   unsigned int t;
+   size_t i;
+   for(t = 0; t < context->builtin_count; t++) {
+      for(i = 0; i < context->builtins[t]->count; i++) {
+         JLRelease(context, context->builtin_values[t][i]);
+      }
+      FreeMemory(context, context->builtin_values[t]);
+   }
+   context->builtin_count = 0;
+}
+
+JLValue *LookupBuiltin(JLContext *context, const char *name, char *found)
+{
+   unsigned int t = context->builtin_count;
+
+   /* Later tables take precedence. */
+   while(t > 0) {
+      const BuiltinTable *table = context->builtins[--t];
+      const uint32_t slot = HashName(name, table->seed) & table->mask;
+      const unsigned int index = table->slots[slot];
+      if(index && !strcmp(table->functions[index - 1].name, name)) {
+         JLValue **value = &context->builtin_values[t][index - 1];
+         if(*value == NULL) {
+            *value = CreateValue(context, NULL, JLVALUE_SPECIAL);
+            (*value)->value.special = AddSpecial(
+               context, table->functions[index - 1].function, NULL,
+               table->functions[index - 1].eval);
+         }
+         *found = 1;
+         return *value;
+      }
+   }
+   *found = 0;
+   return NULL;
+}
+
+JLValue *LookupGlobal(JLContext *context, const char *name)
+{
+   if(context->globals) {
+      const GlobalNode *node = FindGlobal(context->globals,
+                                          context->global_size,
+                                          name, HashName(name, 0));
+      return node->value;
+   }
+   return NULL;
+}
+
+JLValue **FindValue(JLContext *context, const char *name)
+{
+   ScopeNode *scope = context->scope;
+   unsigned int i;
    while(scope) {
-      const BindingNode *binding = scope->bindings;
+      BindingNode *binding = scope->bindings;
       while(binding) {
          const int v = strcmp(binding->name, name);
          if(v < 0) {
@@ -81,12 +405,54 @@ JLValue *Lookup(JLContext *context, const char *name)
          } else if(v > 0) {
             binding = binding->right;
          } else {
-            return binding->value;
+            return &binding->value;
+         }
+      }
+      for(i = scope->frame_count; i > 0; i--) {
+         if(!strcmp(scope->frame[i - 1].name, name)) {
+            return &scope->frame[i - 1].value;
          }
       }
       scope = scope->next;
    }
-   Error(context, "symbol not found: %s", name);
+   if(context->globals) {
+      GlobalNode *node = FindGlobal(context->globals, context->global_size,
+                                    name, HashName(name, 0));
+      if(node->name) {
+         return &node->value;
+      }
+   }
    return NULL;
 }
 
+ScopeNode *GetLambdaScope(JLContext *context, const JLValue *lambda)
+{
+   ScopeNode *scope = (ScopeNode*)lambda->value.lst->value.scope;
+   if(scope == NULL) {
+      /* Find the global scope; the chain is as deep as the nesting. */
+      scope = context->scope;
+      while(scope->next) {
+         scope = scope->next;
+      }
+   }
+   return scope;
+}
+
+JLValue *Lookup(JLContext *context, const char *name)
+{
+   JLValue **slot = FindValue(context, name);
+   JLValue *value;
+   char found;
+   if(slot) {
+      return *slot;
+   }
+   value = LookupRom(context, name, &found);
+   if(found) {
+      return value;
+   }
+   value = LookupBuiltin(context, name, &found);
+   if(!found) {
+      Error(context, "symbol not found: %s", name);
+   }
+   return value;
+}
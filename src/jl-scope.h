@@ -6,8 +6,12 @@
 #ifndef JL_SCOPE_H
 #define JL_SCOPE_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 struct JLContext;
 struct JLValue;
+struct BuiltinTable;
 
 typedef struct BindingNode {
    char *name;
@@ -16,14 +20,77 @@ typedef struct BindingNode {
    struct BindingNode *right;
 } BindingNode;
 
+/** A parameter binding in a stack frame.
+ * The name is borrowed from the lambda's parameter list.
+ */
+typedef struct FrameBinding {
+   const char *name;
+   struct JLValue *value;
+} FrameBinding;
+
 typedef struct ScopeNode {
    BindingNode *bindings;
+   FrameBinding *frame;       /**< Parameters in the frame region. */
    struct ScopeNode *next;
    unsigned int count;
+   unsigned int frame_count;
 } ScopeNode;
 
+/** A binding in the global scope.
+ * The global scope is an open-addressing hash table (name is NULL for
+ * empty slots); inner scopes use a BindingNode tree.
+ */
+typedef struct GlobalNode {
+   char *name;
+   struct JLValue *value;
+   uint32_t hash;
+} GlobalNode;
+
 void ReleaseScope(struct JLContext *context, ScopeNode *scope);
 
+void DefineBinding(struct JLContext *context, ScopeNode *scope,
+                   const char *name, struct JLValue *value);
+
+/** Reserve count bindings in the frame region (NULL if too many). */
+FrameBinding *PushFrame(struct JLContext *context, unsigned int count);
+
+void PopFrame(struct JLContext *context, unsigned int count);
+
+/** Leave the current scope, releasing the bindings in its frame.
+ * If a closure still refers to the scope, the frame bindings are moved
+ * to the heap first, so closures that don't escape cost nothing.
+ * frame and size are as passed to PushFrame (frame can be NULL).
+ */
+void LeaveFrameScope(struct JLContext *context, FrameBinding *frame,
+                     unsigned int size);
+
+void ReleaseFrames(struct JLContext *context);
+
+/** Get the scope a lambda was created in.
+ * Lambdas in flash (see jl-rom.h) have no scope value of their own; they
+ * were created at the top level.
+ */
+ScopeNode *GetLambdaScope(struct JLContext *context,
+                          const struct JLValue *lambda);
+
 struct JLValue *Lookup(struct JLContext *context, const char *name);
 
+/** Find the slot holding a binding so it can be updated in place.
+ * Returns NULL if the name is not bound (built-ins have no slot).
+ */
+struct JLValue **FindValue(struct JLContext *context, const char *name);
+
+/** Look up a global binding without reporting an error (NULL if none). */
+struct JLValue *LookupGlobal(struct JLContext *context, const char *name);
+
+void DefineGlobal(struct JLContext *context, const char *name,
+                  struct JLValue *value);
+
+void ReleaseGlobals(struct JLContext *context);
+
+void RegisterBuiltins(struct JLContext *context,
+                      const struct BuiltinTable *table);
+
+void ReleaseBuiltins(struct JLContext *context);
+
 #endif /* JL_SCOPE_H */
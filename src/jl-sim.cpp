@@ -0,0 +1,477 @@
+/**
+ * @file jl-sim.cpp
+ *
+ * Host simulator (JL_SIMULATOR).
+ * There is one simulated board, like the simulated GPIO registers, so
+ * the clock and events are shared by every context.  Events are kept in
+ * time order and fire once the clock reaches them, either between
+ * evaluation steps or while a sleep moves the clock forward.
+ */
+
+#include "jl.h"
+#include "jl-sim.h"
+#include "jl-bus.h"
+#include "jl-bytes.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-number.h"
+
+#ifdef JL_SIMULATOR
+
+#include <cstdlib>
+#include <cstring>
+
+#define SIM_EVENT_GPIO     0
+#define SIM_EVENT_UART     1
+
+/** A scripted input. */
+typedef struct SimEvent {
+   struct SimEvent *next;
+   uint64_t time_ns;
+   uint32_t mask;                /**< Pins to drive (GPIO). */
+   uint32_t value;               /**< Levels for those pins (GPIO). */
+   size_t len;                   /**< Bytes received (UART). */
+   char kind;                    /**< SIM_EVENT_* */
+   unsigned char data[1];
+} SimEvent;
+
+typedef struct Simulator {
+   uint64_t now_ns;
+   uint32_t step_ns;             /**< Cost of an evaluation step. */
+   SimEvent *events;             /**< Pending events, earliest first. */
+   uint64_t wake_ns;             /**< When the last sleep ended. */
+   uint64_t period_ns;           /**< Time from wake to wake before that. */
+   uint64_t input_ns;            /**< Oldest input not yet answered. */
+   char awake;                   /**< A sleep has ended. */
+   char periodic;                /**< period_ns is set. */
+   char input_pending;
+   JLOutputFunction uart_func;
+   void *uart_arg;
+   SimHistogram latency;
+   SimHistogram jitter;
+   SimHistogram response;
+} Simulator;
+
+static Simulator sim = { 0, JL_SIM_STEP_NS };
+
+static void AddEvent(SimEvent *event);
+static void FireEvents();
+static char Advance(uint64_t time_ns, char edges);
+static void Record(SimHistogram *histogram, uint64_t ns);
+static JLValue *CreateHistogram(JLContext *context,
+                                const SimHistogram *histogram);
+static void ReportHistogram(JLContext *context, const char *name,
+                            const SimHistogram *histogram);
+static char GetNumber(JLContext *context, JLValue *args, JLValue *vp,
+                      NUMBER_TYPE *value);
+
+static JLValue *SimInputAtFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *SimUartAtFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *SimStepCostFunc(JLContext *context, JLValue *args,
+                                void *extra);
+static JLValue *SimStatsFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *SimReportFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *SimResetFunc(JLContext *context, JLValue *args, void *extra);
+
+static constexpr InternalFunctionNode SIM_FUNCTIONS[] = {
+   { "sim-input-at",  SimInputAtFunc,  JLEVAL_STRICT },
+   { "sim-uart-at",   SimUartAtFunc,   JLEVAL_STRICT },
+   { "sim-step-cost", SimStepCostFunc, JLEVAL_STRICT },
+   { "sim-stats",     SimStatsFunc,    JLEVAL_STRICT },
+   { "sim-report",    SimReportFunc,   JLEVAL_STRICT },
+   { "sim-reset",     SimResetFunc,    JLEVAL_STRICT }
+};
+DEFINE_BUILTIN_TABLE(SIM_TABLE, SIM_FUNCTIONS)
+
+void AddEvent(SimEvent *event)
+{
+   SimEvent **link = &sim.events;
+
+   /* Events at the same time fire in the order they were added. */
+   while(*link && (*link)->time_ns <= event->time_ns) {
+      link = &(*link)->next;
+   }
+   event->next = *link;
+   *link = event;
+}
+
+void FireEvents()
+{
+   while(sim.events && sim.events->time_ns <= sim.now_ns) {
+      SimEvent *event = sim.events;
+      sim.events = event->next;
+      if(event->kind == SIM_EVENT_GPIO) {
+         JLDriveGpio(event->mask, event->value);
+      } else {
+         ReceiveUart(event->data, event->len);
+      }
+      if(!sim.input_pending) {
+         sim.input_pending = 1;
+         sim.input_ns = event->time_ns;
+      }
+      free(event);
+   }
+}
+
+/** Move the clock to time_ns, firing events on the way.
+ * With edges set, stop at an event that queues a pin edge and return 0.
+ */
+char Advance(uint64_t time_ns, char edges)
+{
+   /* Stop at each event so it sees the clock at its own time. */
+   while(sim.events && sim.events->time_ns <= time_ns) {
+      if(sim.now_ns < sim.events->time_ns) {
+         sim.now_ns = sim.events->time_ns;
+      }
+      FireEvents();
+      if(edges && EdgesPending()) {
+         return 0;
+      }
+   }
+   if(sim.now_ns < time_ns) {
+      sim.now_ns = time_ns;
+   }
+   return 1;
+}
+
+void Record(SimHistogram *histogram, uint64_t ns)
+{
+   const uint64_t us = ns / 1000;
+   unsigned int bucket = 0;
+   while(bucket < SIM_BUCKETS - 1 && (us >> bucket) != 0) {
+      bucket += 1;
+   }
+   histogram->count += 1;
+   histogram->buckets[bucket] += 1;
+   if(us > histogram->max_us) {
+      histogram->max_us = us;
+   }
+}
+
+void SimStep()
+{
+   sim.now_ns += sim.step_ns;
+   if(sim.events && sim.events->time_ns <= sim.now_ns) {
+      FireEvents();
+   }
+}
+
+uint64_t SimGetTimeUs()
+{
+   return sim.now_ns / 1000;
+}
+
+char SimSleep(uint64_t us)
+{
+   const uint64_t start = sim.now_ns;
+   const uint64_t wake = start + us * 1000;
+
+   if(sim.awake) {
+      const uint64_t period = wake - sim.wake_ns;
+      Record(&sim.latency, start - sim.wake_ns);
+      if(sim.periodic) {
+         Record(&sim.jitter, period > sim.period_ns
+                             ? period - sim.period_ns
+                             : sim.period_ns - period);
+      }
+      sim.period_ns = period;
+      sim.periodic = 1;
+   }
+
+   /* Until it ends, the rest of the sleep is part of this one. */
+   sim.awake = 0;
+   if(!Advance(wake, 1)) {
+      return 0;
+   }
+   sim.wake_ns = sim.now_ns;
+   sim.awake = 1;
+   return 1;
+}
+
+void SimOutput()
+{
+   if(sim.input_pending) {
+      Record(&sim.response, sim.now_ns - sim.input_ns);
+      sim.input_pending = 0;
+   }
+}
+
+void SimUartWrite(const unsigned char *data, size_t len, unsigned long baud)
+{
+   /* Ten bits a byte: start, eight data bits and stop. */
+   SimOutput();
+   if(sim.uart_func) {
+      (sim.uart_func)(sim.uart_arg, (const char*)data, len);
+   }
+   Advance(sim.now_ns + (uint64_t)len * 10 * 1000000000 / baud, 0);
+}
+
+JLValue *CreateHistogram(JLContext *context, const SimHistogram *histogram)
+{
+   JLValue *result = CreateValue(context, NULL, JLVALUE_LIST);
+   JLValue *buckets;
+   JLValue **item;
+   unsigned int i;
+
+   /* (count max-us (bucket ...)) */
+   result->value.lst = NULL;
+   PushRelease(context, &result);
+   result->value.lst = JLDefineNumber(context, NULL,
+                                      Number::FromInt(histogram->count));
+   item = &result->value.lst->next;
+   *item = JLDefineNumber(context, NULL, Number::FromInt(histogram->max_us));
+   item = &(*item)->next;
+   buckets = CreateValue(context, NULL, JLVALUE_LIST);
+   buckets->value.lst = NULL;
+   *item = buckets;
+   item = &buckets->value.lst;
+   for(i = 0; i < SIM_BUCKETS; i++) {
+      *item = JLDefineNumber(context, NULL,
+                             Number::FromInt(histogram->buckets[i]));
+      item = &(*item)->next;
+   }
+   context->unwind_count -= 1;
+   return result;
+}
+
+void ReportHistogram(JLContext *context, const char *name,
+                     const SimHistogram *histogram)
+{
+   unsigned int i;
+
+   OutputFormat(context, "%-9s count %lu max %llu us\n", name,
+                histogram->count, (unsigned long long)histogram->max_us);
+   for(i = 0; i < SIM_BUCKETS; i++) {
+      if(histogram->buckets[i] == 0) {
+         continue;
+      }
+      if(i == 0) {
+         OutputFormat(context, "          < 1 us      %lu\n",
+                      histogram->buckets[i]);
+      } else if(i == SIM_BUCKETS - 1) {
+         OutputFormat(context, "          >= %-8lu %lu\n",
+                      1ul << (i - 1), histogram->buckets[i]);
+      } else {
+         OutputFormat(context, "          < %-9lu %lu\n",
+                      1ul << i, histogram->buckets[i]);
+      }
+   }
+}
+
+char GetNumber(JLContext *context, JLValue *args, JLValue *vp,
+               NUMBER_TYPE *value)
+{
+   JLValue *arg = JLEvaluate(context, vp);
+   if(arg == NULL || arg->tag != JLVALUE_NUMBER) {
+      JLRelease(context, arg);
+      InvalidArgumentError(context, args);
+      return 0;
+   }
+   *value = arg->value.number;
+   JLRelease(context, arg);
+   return 1;
+}
+
+JLValue *SimInputAtFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *vp;
+   NUMBER_TYPE values[3];
+   size_t count = 0;
+
+   /* (sim-input-at time-us mask value) */
+   for(vp = args->next; vp && count < 3; vp = vp->next) {
+      if(!GetNumber(context, args, vp, &values[count])) {
+         return NULL;
+      }
+      count += 1;
+   }
+   if(count < 3) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(vp) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   if(Number::ToInt(values[0]) < 0) {
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   JLSimInputAt((uint64_t)Number::ToInt(values[0]),
+                Number::ToBits(values[1]), Number::ToBits(values[2]));
+   return NULL;
+}
+
+JLValue *SimUartAtFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   NUMBER_TYPE time_us;
+
+   /* (sim-uart-at time-us data) */
+   if(args->next == NULL || args->next->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   if(!GetNumber(context, args, args->next, &time_us)) {
+      return NULL;
+   }
+   if(Number::ToInt(time_us) < 0) {
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   arg = JLEvaluate(context, args->next->next);
+   if(arg && arg->tag == JLVALUE_BYTES) {
+      JLSimUartAt((uint64_t)Number::ToInt(time_us),
+                  (const char*)arg->value.bytes->data,
+                  arg->value.bytes->length);
+   } else if(arg && arg->tag == JLVALUE_STRING) {
+      JLSimUartAt((uint64_t)Number::ToInt(time_us), arg->value.str,
+                  strlen(arg->value.str));
+   } else {
+      JLRelease(context, arg);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   JLRelease(context, arg);
+   return NULL;
+}
+
+JLValue *SimStepCostFunc(JLContext *context, JLValue *args, void *extra)
+{
+   const uint32_t previous = sim.step_ns;
+   NUMBER_TYPE step_ns;
+
+   /* (sim-step-cost [ns]) returns the previous cost. */
+   if(args->next && args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next) {
+      if(!GetNumber(context, args, args->next, &step_ns)) {
+         return NULL;
+      }
+      if(Number::ToInt(step_ns) < 0) {
+         InvalidArgumentError(context, args);
+         return NULL;
+      }
+      JLSimSetStepCost((uint32_t)Number::ToInt(step_ns));
+   }
+   return JLDefineNumber(context, NULL, Number::FromInt(previous));
+}
+
+JLValue *SimStatsFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *result;
+   JLValue *item;
+
+   if(args->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+
+   /* (latency jitter response) */
+   result = CreateValue(context, NULL, JLVALUE_LIST);
+   result->value.lst = NULL;
+   PushRelease(context, &result);
+   item = CreateHistogram(context, &sim.latency);
+   result->value.lst = item;
+   item->next = CreateHistogram(context, &sim.jitter);
+   item = item->next;
+   item->next = CreateHistogram(context, &sim.response);
+   context->unwind_count -= 1;
+   return result;
+}
+
+JLValue *SimReportFunc(JLContext *context, JLValue *args, void *extra)
+{
+   if(args->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   JLSimReport(context);
+   return NULL;
+}
+
+JLValue *SimResetFunc(JLContext *context, JLValue *args, void *extra)
+{
+   if(args->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   JLSimReset();
+   return NULL;
+}
+
+void JLSimSetStepCost(uint32_t step_ns)
+{
+   sim.step_ns = step_ns;
+}
+
+void JLSimInputAt(uint64_t time_us, uint32_t mask, uint32_t value)
+{
+   SimEvent *event = (SimEvent*)malloc(sizeof(SimEvent));
+   if(event) {
+      event->time_ns = time_us * 1000;
+      event->mask = mask;
+      event->value = value;
+      event->len = 0;
+      event->kind = SIM_EVENT_GPIO;
+      AddEvent(event);
+   }
+}
+
+void JLSimUartAt(uint64_t time_us, const char *data, size_t len)
+{
+   SimEvent *event = (SimEvent*)malloc(sizeof(SimEvent) + len);
+   if(event) {
+      event->time_ns = time_us * 1000;
+      event->mask = 0;
+      event->value = 0;
+      event->len = len;
+      event->kind = SIM_EVENT_UART;
+      memcpy(event->data, data, len);
+      AddEvent(event);
+   }
+}
+
+void JLSimSetUartOutput(JLOutputFunction func, void *arg)
+{
+   sim.uart_func = func;
+   sim.uart_arg = arg;
+}
+
+void JLSimReport(JLContext *context)
+{
+   ReportHistogram(context, "latency", &sim.latency);
+   ReportHistogram(context, "jitter", &sim.jitter);
+   ReportHistogram(context, "response", &sim.response);
+   JLFlush(context);
+}
+
+void JLSimReset()
+{
+   while(sim.events) {
+      SimEvent *event = sim.events;
+      sim.events = event->next;
+      free(event);
+   }
+   sim.awake = 0;
+   sim.periodic = 0;
+   sim.input_pending = 0;
+   memset(&sim.latency, 0, sizeof(sim.latency));
+   memset(&sim.jitter, 0, sizeof(sim.jitter));
+   memset(&sim.response, 0, sizeof(sim.response));
+}
+
+void RegisterSimFunctions(JLContext *context)
+{
+   RegisterBuiltins(context, &SIM_TABLE);
+}
+
+#endif /* JL_SIMULATOR */
@@ -0,0 +1,63 @@
+/**
+ * @file jl-sim.h
+ *
+ * Host simulator (JL_SIMULATOR).
+ * Time is virtual: each evaluation step costs a fixed time and sleeping
+ * moves the clock forward at once, so a control loop takes the same time
+ * on every run and every machine.  Scripted events drive the simulated
+ * GPIO inputs and UART, and the timing of the loop is collected in
+ * histograms.
+ */
+
+#ifndef JL_SIM_H
+#define JL_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct JLContext;
+
+#ifdef JL_SIMULATOR
+
+/* The time charged for an evaluation step until sim-step-cost changes
+ * it.  This is only a rough figure for the RP2040 at 125 MHz; calibrate
+ * it against the board (gpio-trace times on both, say) for real work. */
+#ifndef JL_SIM_STEP_NS
+#define JL_SIM_STEP_NS 1000
+#endif
+
+/** Bucket 0 counts times under 1 us and bucket i times in
+ * [2^(i-1), 2^i) us; the last bucket also takes anything longer. */
+#define SIM_BUCKETS 16
+
+typedef struct SimHistogram {
+   unsigned long count;
+   uint64_t max_us;
+   unsigned long buckets[SIM_BUCKETS];
+} SimHistogram;
+
+/** Charge one evaluation step to the clock. */
+void SimStep();
+
+uint64_t SimGetTimeUs();
+
+/** Sleep on the virtual clock.
+ * Each sleep ends one pass of a loop: the time run since the last sleep
+ * ended is its latency, and the change in the time from wake to wake is
+ * its jitter.  A sleep stops early at an event that queues a pin edge;
+ * sleeping for the rest of the time continues the same sleep.
+ * @return 1 if the time passed, 0 if an edge is waiting.
+ */
+char SimSleep(uint64_t us);
+
+/** Note an output, which answers the oldest unanswered input. */
+void SimOutput();
+
+/** Send data on the simulated UART, taking the time it would at baud. */
+void SimUartWrite(const unsigned char *data, size_t len, unsigned long baud);
+
+void RegisterSimFunctions(struct JLContext *context);
+
+#endif /* JL_SIMULATOR */
+
+#endif /* JL_SIM_H */
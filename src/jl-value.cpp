@@ -5,33 +5,53 @@
 
 #include "jl-value.h"
 #include "jl-context.h"
+#include "jl-bytes.h"
+#include "jl-memo.h"
+#include "jl-func.h"
 #include <cstring>
 
 JLValue *CreateValue(JLContext *context, const char *name, JLValueType tag)
 {
    JLValue *result = (JLValue*)GetFree(context);
    result->tag = tag;
+   result->flags = 0;
    result->next = NULL;
    result->count = 1;
    JLDefineValue(context, name, result);
    return result;
 }
 
+JLValue *CreateCell(JLContext *context, JLValue *element)
+{
+   JLValue *result = CreateValue(context, NULL, JLVALUE_CELL);
+   result->value.lst = element;
+   return result;
+}
+
 JLValue *CopyValue(JLContext *context, const JLValue *other)
 {
    JLValue *result = NULL;
    if(other) {
       result = CreateValue(context, NULL, other->tag);
       result->value = other->value;
+      result->flags = other->flags & ~JLVALUE_FLAG_INTERNED;
       switch(result->tag) {
       case JLVALUE_LIST:
       case JLVALUE_LAMBDA:
       case JLVALUE_SCOPE:
+      case JLVALUE_CELL:
+      case JLVALUE_MACRO:
          JLRetain(context, result->value.lst);
          break;
       case JLVALUE_STRING:
       case JLVALUE_VARIABLE:
-         result->value.str = strdup(result->value.str);
+         result->value.str = CopyString(context, result->value.str);
+         break;
+      case JLVALUE_BYTES:
+         result->value.bytes->count += 1;
+         break;
+      case JLVALUE_MEMO:
+         result->value.memo->count += 1;
          break;
       default:
          break;
@@ -42,3 +62,80 @@ JLValue *CopyValue(JLContext *context, const JLValue *other)
    return result;
 }
 
+
+uint32_t HashValue(const JLValue *value)
+{
+   uint32_t hash = 0;
+   const JLValue *vp;
+   size_t i;
+   if(value == NULL || value->tag == JLVALUE_NIL) {
+      return 0;
+   }
+   switch(value->tag) {
+   case JLVALUE_NUMBER:
+      hash = (uint32_t)value->value.number * 0x9E3779B9u;
+      return hash ^ (hash >> 16);
+   case JLVALUE_STRING:
+      return HashName(value->value.str, 0);
+   case JLVALUE_LIST:
+      hash = 0x811C9DC5u;
+      for(vp = value->value.lst; vp; vp = vp->next) {
+         hash = (hash ^ HashValue(GetElement((JLValue*)vp))) * 16777619u;
+      }
+      return hash;
+   case JLVALUE_BYTES:
+      hash = 0x811C9DC5u;
+      for(i = 0; i < value->value.bytes->length; i++) {
+         hash = (hash ^ value->value.bytes->data[i]) * 16777619u;
+      }
+      return hash;
+   default:
+      hash = (uint32_t)(uintptr_t)value * 0x9E3779B9u;
+      return hash ^ (hash >> 16);
+   }
+}
+
+char EqualValues(const JLValue *a, const JLValue *b)
+{
+   const JLValue *ap;
+   const JLValue *bp;
+   if(a && a->tag == JLVALUE_NIL) {
+      a = NULL;
+   }
+   if(b && b->tag == JLVALUE_NIL) {
+      b = NULL;
+   }
+   if(a == b) {
+      return 1;
+   }
+   if(a == NULL || b == NULL || a->tag != b->tag) {
+      return 0;
+   }
+   switch(a->tag) {
+   case JLVALUE_NUMBER:
+      return a->value.number == b->value.number;
+   case JLVALUE_STRING:
+      return !strcmp(a->value.str, b->value.str);
+   case JLVALUE_LIST:
+      ap = a->value.lst;
+      bp = b->value.lst;
+      while(ap && bp) {
+         if((ap->flags & bp->flags) & JLVALUE_FLAG_INTERNED) {
+            /* Interned lists are equal only if they are the same cells. */
+            return ap == bp;
+         }
+         if(!EqualValues(GetElement((JLValue*)ap), GetElement((JLValue*)bp))) {
+            return 0;
+         }
+         ap = ap->next;
+         bp = bp->next;
+      }
+      return ap == bp;
+   case JLVALUE_BYTES:
+      return a->value.bytes->length == b->value.bytes->length
+          && !memcmp(a->value.bytes->data, b->value.bytes->data,
+                     a->value.bytes->length);
+   default:
+      return 0;
+   }
+}
@@ -8,6 +8,8 @@
 
 #include "jl.h"
 
+#include <stdint.h>
+
 /** Possible value types. */
 typedef char JLValueType;
 #define JLVALUE_NIL        0     /**< Nil. */
@@ -18,32 +20,121 @@ typedef char JLValueType;
 #define JLVALUE_SPECIAL    5     /**< Special form. */
 #define JLVALUE_SCOPE      6     /**< A scope (internal use). */
 #define JLVALUE_VARIABLE   7     /**< A variable. */
+#define JLVALUE_BYTES      8     /**< Mutable byte buffer. */
+#define JLVALUE_CELL       9     /**< List cell (value.lst is the element). */
+#define JLVALUE_MEMO       10    /**< Memoized function. */
+#define JLVALUE_MACRO      11    /**< Macro (value.lst is the expander). */
+
+/** Value flags. */
+#define JLVALUE_FLAG_INTERNED 0x02  /**< Value is in the intern table. */
+#define JLVALUE_FLAG_EXPANDED 0x04  /**< Macros in this code are expanded. */
+#define JLVALUE_FLAG_SCANNED  0x08  /**< begin form checked for define. */
+#define JLVALUE_FLAG_DEFINES  0x10  /**< begin form needs its own scope. */
+
+/** How the arguments of a special function are evaluated.
+ * The stackless evaluator (see jl-eval.cpp) evaluates the arguments of
+ * strict functions itself and runs the control forms directly; the rest
+ * are called with their code.
+ */
+#define JLEVAL_CODE        0     /**< Arguments are passed as code. */
+#define JLEVAL_STRICT      1     /**< Each argument is evaluated in order. */
+#define JLEVAL_IF          2
+#define JLEVAL_BEGIN       3
+#define JLEVAL_AND         4
+#define JLEVAL_OR          5
+#define JLEVAL_DEFINE      6
+#define JLEVAL_SET         7
+#define JLEVAL_LET         8
 
 /** Special function and extra parameter. */
 typedef struct SpecialFunction {
    JLFunction func;
    void *extra;
+   unsigned char eval;           /**< JLEVAL_* */
 } SpecialFunction;
 
+/** The contents of a value.
+ * The constructors let constant values be built at compile time (see
+ * jl-rom.h).
+ */
+typedef union JLValueData {
+   struct JLValue *lst;
+   unsigned int special;         /**< Index of a native function. */
+   char *str;
+   NUMBER_TYPE number;
+   void *scope;
+   struct ByteBuffer *bytes;
+   struct Memo *memo;
+
+   JLValueData() = default;
+   constexpr JLValueData(const struct JLValue *value)
+      : lst(const_cast<struct JLValue*>(value)) {}
+   constexpr JLValueData(const char *value)
+      : str(const_cast<char*>(value)) {}
+   constexpr JLValueData(NUMBER_TYPE value) : number(value) {}
+} JLValueData;
+
 /** Values in the JL environment.
- * Note that these are reference counted.
+ * Note that these are reference counted, except for constant values in
+ * flash, whose count is JLVALUE_ROM_COUNT and is never changed.
  */
 typedef struct JLValue {
-   union {
-      struct JLValue *lst;
-      SpecialFunction special;
-      char *str;
-      NUMBER_TYPE number;
-      void *scope;
-   } value;
+   JLValueData value;
    struct JLValue *next;
+#ifdef JL_COMPACT_VALUES
+   unsigned int count : 19;
+   unsigned int tag : 5;
+   unsigned int flags : 8;
+#else
    unsigned int count;
    JLValueType tag;
+   unsigned char flags;
+#endif
+#ifdef JL_HEAP_PROFILE
+   unsigned short site;          /**< Allocation site (0 when free). */
+#endif
 } JLValue;
 
+#ifdef JL_COMPACT_VALUES
+#define JLVALUE_ROM_COUNT  0x7FFFF
+#else
+#define JLVALUE_ROM_COUNT  0xFFFFFFFFu
+#endif
+
+/** Determine if a value is a constant in flash (see jl-rom.h). */
+static inline char IsRomValue(const JLValue *value)
+{
+   return value->count == JLVALUE_ROM_COUNT;
+}
+
 JLValue *CreateValue(struct JLContext *context,
                      const char *name, JLValueType tag);
 
 JLValue *CopyValue(struct JLContext *context, const JLValue *other);
 
+/** Create a list cell holding element.
+ * The reference to element is transferred to the cell.
+ */
+JLValue *CreateCell(struct JLContext *context, JLValue *element);
+
+/** Compute a structural hash of a value.
+ * Numbers, strings and lists hash by content; other values by identity.
+ */
+uint32_t HashValue(const JLValue *value);
+
+/** Determine if two values are structurally equal (see HashValue). */
+char EqualValues(const JLValue *a, const JLValue *b);
+
+/** Get the element at a list node.
+ * Lists built at run time are made of cells that share their elements;
+ * in parsed code the nodes are the elements themselves.
+ */
+static inline JLValue *GetElement(JLValue *node)
+{
+   if(node && node->tag == JLVALUE_CELL) {
+      return node->value.lst;
+   }
+   return node;
+}
+
 #endif /* JL_VALUE_H */
@@ -0,0 +1,637 @@
+/**
+ * @file jl-wire.cpp
+ *
+ * Binary wire format (see jl-wire.h).
+ * Both directions stream: the encoder writes while it walks a value and
+ * the decoder reads exactly the bytes of one value, so neither holds a
+ * second copy of a large list.  The state lives in memory from
+ * AllocMemory so it is intact when an error unwinds to the cleanup.
+ */
+
+#include "jl.h"
+#include "jl-wire.h"
+#include "jl-bytes.h"
+#include "jl-func.h"
+#include "jl-value.h"
+#include "jl-context.h"
+#include "jl-scope.h"
+#include "jl-intern.h"
+#include "jl-number.h"
+
+#include <cstring>
+
+/** A string or symbol sent in full (writer side). */
+typedef struct WireRef {
+   const char *str;              /**< NULL if the slot is free. */
+   size_t index;
+   JLValueType tag;
+} WireRef;
+
+typedef struct WireWriter {
+   JLOutputFunction func;        /**< NULL to only count the bytes. */
+   void *arg;
+   size_t total;                 /**< Bytes written so far. */
+   size_t used;                  /**< Bytes in buffer. */
+   WireRef *refs;                /**< Open-addressed table of strings. */
+   size_t ref_size;
+   size_t ref_count;
+   JLValue **stack;              /**< Where to continue each open list. */
+   size_t stack_size;
+   size_t depth;
+   char use_refs;
+   char buffer[WIRE_BUFFER_SIZE];
+} WireWriter;
+
+/** A list being decoded. */
+typedef struct WireFrame {
+   JLValue *list;
+   JLValue **item;               /**< Where the next cell goes. */
+} WireFrame;
+
+typedef struct WireReader {
+   JLInputFunction func;
+   void *arg;
+   JLValue **refs;               /**< Strings received in full (retained). */
+   size_t ref_size;
+   size_t ref_count;
+   WireFrame *stack;
+   size_t stack_size;
+   size_t depth;
+   JLValue *pending;             /**< A value not yet in a list. */
+   size_t max_length;            /**< Longest string or buffer (0: any). */
+   char use_refs;
+} WireReader;
+
+/** Memory being decoded by the decode builtin. */
+typedef struct WireSource {
+   const unsigned char *data;
+   size_t left;
+} WireSource;
+
+static void PutData(WireWriter *writer, const char *data, size_t len);
+static void PutByte(WireWriter *writer, unsigned char value);
+static void PutVarint(WireWriter *writer, uint64_t value);
+static void FlushWriter(WireWriter *writer);
+static char FindRef(JLContext *context, WireWriter *writer,
+                    JLValueType tag, const char *str, size_t *index);
+static void GrowRefs(JLContext *context, WireWriter *writer);
+static void PutString(JLContext *context, WireWriter *writer,
+                      unsigned char tag, JLValueType type, const char *str);
+static void PutAtom(JLContext *context, WireWriter *writer,
+                    const JLValue *value);
+static void EncodeValue(JLContext *context, WireWriter *writer,
+                        JLValue *value);
+static void FreeWriter(JLContext *context, WireWriter *writer);
+
+static void GetData(JLContext *context, WireReader *reader,
+                    char *data, size_t len);
+static unsigned char GetByte(JLContext *context, WireReader *reader);
+static uint64_t GetVarint(JLContext *context, WireReader *reader);
+static size_t GetLength(JLContext *context, WireReader *reader);
+static JLValue *GetAtom(JLContext *context, WireReader *reader,
+                        unsigned char tag);
+static JLValue *DecodeValue(JLContext *context, WireReader *reader);
+static void FreeReader(JLContext *context, WireReader *reader);
+
+static void CopyOutput(void *arg, const char *data, size_t len);
+static size_t ReadSource(void *arg, char *data, size_t len);
+
+static JLValue *EncodeFunc(JLContext *context, JLValue *args, void *extra);
+static JLValue *DecodeFunc(JLContext *context, JLValue *args, void *extra);
+
+static constexpr InternalFunctionNode WIRE_FUNCTIONS[] = {
+   { "decode",       DecodeFunc,       JLEVAL_STRICT },
+   { "encode",       EncodeFunc,       JLEVAL_STRICT }
+};
+DEFINE_BUILTIN_TABLE(WIRE_TABLE, WIRE_FUNCTIONS)
+
+void PutData(WireWriter *writer, const char *data, size_t len)
+{
+   writer->total += len;
+   if(writer->func == NULL) {
+      return;
+   }
+   if(writer->used + len > WIRE_BUFFER_SIZE) {
+      FlushWriter(writer);
+   }
+   if(len >= WIRE_BUFFER_SIZE) {
+      (writer->func)(writer->arg, data, len);
+   } else {
+      memcpy(&writer->buffer[writer->used], data, len);
+      writer->used += len;
+   }
+}
+
+void PutByte(WireWriter *writer, unsigned char value)
+{
+   writer->total += 1;
+   if(writer->func) {
+      if(writer->used == WIRE_BUFFER_SIZE) {
+         FlushWriter(writer);
+      }
+      writer->buffer[writer->used++] = (char)value;
+   }
+}
+
+void PutVarint(WireWriter *writer, uint64_t value)
+{
+   while(value >= 0x80) {
+      PutByte(writer, (unsigned char)(value | 0x80));
+      value >>= 7;
+   }
+   PutByte(writer, (unsigned char)value);
+}
+
+void FlushWriter(WireWriter *writer)
+{
+   if(writer->func && writer->used > 0) {
+      (writer->func)(writer->arg, writer->buffer, writer->used);
+   }
+   writer->used = 0;
+}
+
+char FindRef(JLContext *context, WireWriter *writer,
+             JLValueType tag, const char *str, size_t *index)
+{
+   size_t slot;
+
+   /* Strings are added in the order they are sent, which is the order
+    * the decoder numbers them in. */
+   if(writer->ref_count * 4 >= writer->ref_size * 3) {
+      GrowRefs(context, writer);
+   }
+   slot = HashName(str, (uint32_t)tag) & (writer->ref_size - 1);
+   while(writer->refs[slot].str) {
+      const WireRef *ref = &writer->refs[slot];
+      if(ref->tag == tag && !strcmp(ref->str, str)) {
+         *index = ref->index;
+         return 1;
+      }
+      slot = (slot + 1) & (writer->ref_size - 1);
+   }
+   if(writer->ref_count < WIRE_MAX_REFS) {
+      writer->refs[slot].str = str;
+      writer->refs[slot].tag = tag;
+      writer->refs[slot].index = writer->ref_count;
+      writer->ref_count += 1;
+   }
+   return 0;
+}
+
+void GrowRefs(JLContext *context, WireWriter *writer)
+{
+   const size_t size = writer->ref_size ? writer->ref_size * 2 : 16;
+   WireRef *refs = (WireRef*)AllocZeroed(context, size, sizeof(WireRef));
+   size_t i;
+
+   for(i = 0; i < writer->ref_size; i++) {
+      const WireRef *ref = &writer->refs[i];
+      if(ref->str) {
+         size_t slot = HashName(ref->str, (uint32_t)ref->tag) & (size - 1);
+         while(refs[slot].str) {
+            slot = (slot + 1) & (size - 1);
+         }
+         refs[slot] = *ref;
+      }
+   }
+   FreeMemory(context, writer->refs);
+   writer->refs = refs;
+   writer->ref_size = size;
+}
+
+void PutString(JLContext *context, WireWriter *writer,
+               unsigned char tag, JLValueType type, const char *str)
+{
+   size_t index;
+   size_t len;
+
+   if(writer->use_refs && FindRef(context, writer, type, str, &index)) {
+      PutByte(writer, WIRE_REF);
+      PutVarint(writer, index);
+      return;
+   }
+   len = strlen(str);
+   PutByte(writer, tag);
+   PutVarint(writer, len);
+   PutData(writer, str, len);
+}
+
+void PutAtom(JLContext *context, WireWriter *writer, const JLValue *value)
+{
+   int64_t number;
+
+   if(value == NULL) {
+      PutByte(writer, WIRE_NIL);
+      return;
+   }
+   switch(value->tag) {
+   case JLVALUE_NIL:
+      PutByte(writer, WIRE_NIL);
+      break;
+   case JLVALUE_NUMBER:
+      /* Zigzag, so small negative numbers stay short. */
+      number = (int64_t)value->value.number;
+      PutByte(writer, WIRE_NUMBER);
+      PutVarint(writer, ((uint64_t)number << 1) ^ (uint64_t)(number >> 63));
+      break;
+   case JLVALUE_STRING:
+      PutString(context, writer, WIRE_STRING, value->tag, value->value.str);
+      break;
+   case JLVALUE_VARIABLE:
+      PutString(context, writer, WIRE_SYMBOL, value->tag, value->value.str);
+      break;
+   case JLVALUE_BYTES:
+      PutByte(writer, WIRE_BYTES);
+      PutVarint(writer, value->value.bytes->length);
+      PutData(writer, (const char*)value->value.bytes->data,
+              value->value.bytes->length);
+      break;
+   default:
+      Error(context, "cannot encode value");
+      break;
+   }
+}
+
+void EncodeValue(JLContext *context, WireWriter *writer, JLValue *value)
+{
+   JLValue *node = NULL;
+
+   /* Walk the list nodes in place; an open list keeps the node to
+    * continue from once its items are written. */
+   for(;;) {
+      if(value && value->tag == JLVALUE_LIST) {
+         if(writer->depth == writer->stack_size) {
+            const size_t size = writer->stack_size
+                              ? writer->stack_size * 2 : 8;
+            writer->stack = (JLValue**)ResizeMemory(context, writer->stack,
+                                                    size * sizeof(JLValue*));
+            writer->stack_size = size;
+         }
+         PutByte(writer, WIRE_LIST);
+         writer->stack[writer->depth++] = node;
+         node = value->value.lst;
+      } else {
+         PutAtom(context, writer, value);
+      }
+      while(node == NULL && writer->depth > 0) {
+         PutByte(writer, WIRE_END);
+         node = writer->stack[--writer->depth];
+      }
+      if(node == NULL) {
+         break;
+      }
+      value = GetElement(node);
+      node = node->next;
+   }
+}
+
+void FreeWriter(JLContext *context, WireWriter *writer)
+{
+   FreeMemory(context, writer->refs);
+   FreeMemory(context, writer->stack);
+   FreeMemory(context, writer);
+}
+
+void GetData(JLContext *context, WireReader *reader, char *data, size_t len)
+{
+   while(len > 0) {
+      const size_t got = (reader->func)(reader->arg, data, len);
+      if(got == 0) {
+         Error(context, "invalid encoding");
+      }
+      data += got;
+      len -= got;
+   }
+}
+
+unsigned char GetByte(JLContext *context, WireReader *reader)
+{
+   char value;
+   GetData(context, reader, &value, 1);
+   return (unsigned char)value;
+}
+
+uint64_t GetVarint(JLContext *context, WireReader *reader)
+{
+   uint64_t result = 0;
+   unsigned shift = 0;
+   unsigned char value;
+
+   do {
+      if(shift >= 64) {
+         Error(context, "invalid encoding");
+      }
+      value = GetByte(context, reader);
+      result |= (uint64_t)(value & 0x7F) << shift;
+      shift += 7;
+   } while(value & 0x80);
+   return result;
+}
+
+size_t GetLength(JLContext *context, WireReader *reader)
+{
+   /* Check before allocating; the length comes from the sender. */
+   const uint64_t raw = GetVarint(context, reader);
+   if(raw >= (uint64_t)(size_t)-1 ||
+      (reader->max_length && raw > reader->max_length)) {
+      Error(context, "invalid encoding");
+   }
+   return (size_t)raw;
+}
+
+JLValue *GetAtom(JLContext *context, WireReader *reader, unsigned char tag)
+{
+   JLValue *result = NULL;
+   uint64_t raw;
+   size_t length;
+   int64_t number;
+
+   switch(tag) {
+   case WIRE_NIL:
+      break;
+   case WIRE_NUMBER:
+      raw = GetVarint(context, reader);
+      number = (int64_t)(raw >> 1) ^ -(int64_t)(raw & 1);
+      if((int64_t)(NUMBER_TYPE)number != number) {
+         Error(context, "invalid encoding");
+      }
+      result = JLDefineNumber(context, NULL, (NUMBER_TYPE)number);
+      break;
+   case WIRE_STRING:
+   case WIRE_SYMBOL:
+      length = GetLength(context, reader);
+      result = CreateValue(context, NULL, tag == WIRE_STRING
+                           ? JLVALUE_STRING : JLVALUE_VARIABLE);
+      result->value.str = NULL;
+      reader->pending = result;
+      result->value.str = (char*)AllocMemory(context, length + 1);
+      GetData(context, reader, result->value.str, length);
+      result->value.str[length] = 0;
+      if(reader->use_refs && reader->ref_count < WIRE_MAX_REFS) {
+         if(reader->ref_count == reader->ref_size) {
+            const size_t size = reader->ref_size ? reader->ref_size * 2 : 16;
+            reader->refs = (JLValue**)ResizeMemory(context, reader->refs,
+                                                   size * sizeof(JLValue*));
+            reader->ref_size = size;
+         }
+         JLRetain(context, result);
+         reader->refs[reader->ref_count++] = result;
+      }
+      break;
+   case WIRE_REF:
+      raw = GetVarint(context, reader);
+      if(raw >= reader->ref_count) {
+         Error(context, "invalid encoding");
+      }
+      result = reader->refs[raw];
+      JLRetain(context, result);
+      break;
+   case WIRE_BYTES:
+      length = GetLength(context, reader);
+      result = JLCreateBytes(context, length);
+      reader->pending = result;
+      GetData(context, reader, (char*)result->value.bytes->data, length);
+      break;
+   default:
+      Error(context, "invalid encoding");
+      break;
+   }
+   return result;
+}
+
+JLValue *DecodeValue(JLContext *context, WireReader *reader)
+{
+   JLValue *value;
+   WireFrame *frame;
+   unsigned char header = GetByte(context, reader);
+   unsigned char flags = WIRE_VERSION;
+
+#if JL_NUMBER == JL_NUMBER_FIXED
+   flags |= WIRE_FLAG_FIXED;
+#endif
+   if((header & ~WIRE_FLAG_REFS) != flags) {
+      Error(context, "invalid encoding");
+   }
+   reader->use_refs = (header & WIRE_FLAG_REFS) != 0;
+
+   for(;;) {
+      const unsigned char tag = GetByte(context, reader);
+      if(tag == WIRE_LIST) {
+         if(reader->depth == reader->stack_size) {
+            const size_t size = reader->stack_size
+                              ? reader->stack_size * 2 : 8;
+            reader->stack = (WireFrame*)ResizeMemory(context, reader->stack,
+                                                     size * sizeof(WireFrame));
+            reader->stack_size = size;
+         }
+         frame = &reader->stack[reader->depth];
+         frame->list = CreateValue(context, NULL, JLVALUE_LIST);
+         frame->list->value.lst = NULL;
+         frame->item = &frame->list->value.lst;
+         reader->depth += 1;
+         continue;
+      } else if(tag == WIRE_END) {
+         if(reader->depth == 0) {
+            Error(context, "invalid encoding");
+         }
+
+         /* Empty lists are nil, as from list. */
+         value = reader->stack[reader->depth - 1].list;
+         reader->pending = value;
+         reader->depth -= 1;
+         if(value->value.lst == NULL) {
+            reader->pending = NULL;
+            JLRelease(context, value);
+            value = NULL;
+         } else {
+            value = InternList(context, value);
+         }
+      } else {
+         value = GetAtom(context, reader, tag);
+      }
+
+      reader->pending = value;
+      if(reader->depth == 0) {
+         reader->pending = NULL;
+         return value;
+      }
+      frame = &reader->stack[reader->depth - 1];
+      *frame->item = CreateCell(context, value);
+      frame->item = &(*frame->item)->next;
+      reader->pending = NULL;
+   }
+}
+
+void FreeReader(JLContext *context, WireReader *reader)
+{
+   size_t i;
+   JLRelease(context, reader->pending);
+   for(i = 0; i < reader->depth; i++) {
+      JLRelease(context, reader->stack[i].list);
+   }
+   for(i = 0; i < reader->ref_count; i++) {
+      JLRelease(context, reader->refs[i]);
+   }
+   FreeMemory(context, reader->refs);
+   FreeMemory(context, reader->stack);
+   FreeMemory(context, reader);
+}
+
+void CopyOutput(void *arg, const char *data, size_t len)
+{
+   unsigned char **dest = (unsigned char**)arg;
+   memcpy(*dest, data, len);
+   *dest += len;
+}
+
+size_t ReadSource(void *arg, char *data, size_t len)
+{
+   WireSource *source = (WireSource*)arg;
+   if(len > source->left) {
+      len = source->left;
+   }
+   memcpy(data, source->data, len);
+   source->data += len;
+   source->left -= len;
+   return len;
+}
+
+JLValue *EncodeFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *value;
+   JLValue *refs;
+   JLValue *result = NULL;
+   unsigned char *dest;
+   size_t count = 0;
+   int flags = JL_ENCODE_REFS;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next && args->next->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   value = JLEvaluate(context, args->next);
+   PushRelease(context, &value);
+   if(args->next->next) {
+      refs = JLEvaluate(context, args->next->next);
+      if(!IsTrue(refs)) {
+         flags = 0;
+      }
+      JLRelease(context, refs);
+   }
+
+   /* Count the bytes, then write them into a buffer of that size. */
+   count = JLEncode(context, value, flags, NULL, NULL);
+   result = JLCreateBytes(context, count);
+   dest = result->value.bytes->data;
+   PushRelease(context, &result);
+   JLEncode(context, value, flags, CopyOutput, &dest);
+   JLRelease(context, value);
+   return result;
+}
+
+JLValue *DecodeFunc(JLContext *context, JLValue *args, void *extra)
+{
+   JLValue *arg;
+   JLValue *result = NULL;
+   WireSource source;
+
+   if(args->next == NULL) {
+      TooFewArgumentsError(context, args);
+      return NULL;
+   }
+   if(args->next->next) {
+      TooManyArgumentsError(context, args);
+      return NULL;
+   }
+   arg = JLEvaluate(context, args->next);
+   if(arg == NULL || arg->tag != JLVALUE_BYTES) {
+      JLRelease(context, arg);
+      InvalidArgumentError(context, args);
+      return NULL;
+   }
+   PushRelease(context, &arg);
+   source.data = arg->value.bytes->data;
+   source.left = arg->value.bytes->length;
+
+   /* Nothing in the buffer can be longer than the buffer. */
+   JLDecode(context, ReadSource, &source, source.left, &result);
+   PushRelease(context, &result);
+   if(source.left > 0) {
+      Error(context, "invalid encoding");
+   }
+   JLRelease(context, arg);
+   return result;
+}
+
+size_t JLEncode(JLContext *context, JLValue *value, int flags,
+                JLOutputFunction func, void *arg)
+{
+   WireWriter *writer;
+   CatchNode node;
+   unsigned char header = WIRE_VERSION;
+   size_t total;
+
+   writer = (WireWriter*)AllocZeroed(context, 1, sizeof(WireWriter));
+   writer->func = func;
+   writer->arg = arg;
+   writer->use_refs = (flags & JL_ENCODE_REFS) != 0;
+
+   EnterCatch(context, &node);
+   if(setjmp(node.env) != 0) {
+      FreeWriter(context, writer);
+      if(context->catches) {
+         Raise(context);
+      }
+      ReportError(context);
+      return 0;
+   }
+#if JL_NUMBER == JL_NUMBER_FIXED
+   header |= WIRE_FLAG_FIXED;
+#endif
+   if(writer->use_refs) {
+      header |= WIRE_FLAG_REFS;
+   }
+   PutByte(writer, header);
+   EncodeValue(context, writer, value);
+   FlushWriter(writer);
+   LeaveCatch(context, &node);
+   total = writer->total;
+   FreeWriter(context, writer);
+   return total;
+}
+
+int JLDecode(JLContext *context, JLInputFunction func, void *arg,
+             size_t max_length, JLValue **result)
+{
+   WireReader *reader;
+   CatchNode node;
+
+   *result = NULL;
+   reader = (WireReader*)AllocZeroed(context, 1, sizeof(WireReader));
+   reader->func = func;
+   reader->arg = arg;
+   reader->max_length = max_length;
+
+   EnterCatch(context, &node);
+   if(setjmp(node.env) != 0) {
+      FreeReader(context, reader);
+      if(context->catches) {
+         Raise(context);
+      }
+      ReportError(context);
+      return 0;
+   }
+   *result = DecodeValue(context, reader);
+   LeaveCatch(context, &node);
+   FreeReader(context, reader);
+   return 1;
+}
+
+void RegisterWireFunctions(JLContext *context)
+{
+   RegisterBuiltins(context, &WIRE_TABLE);
+}
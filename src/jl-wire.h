@@ -0,0 +1,47 @@
+/**
+ * @file jl-wire.h
+ *
+ * Binary wire format.
+ * A stream starts with a header byte (WIRE_VERSION, with WIRE_FLAG_REFS
+ * if strings may refer back to earlier ones) followed by one value:
+ *
+ *    WIRE_NIL
+ *    WIRE_NUMBER  varint        zigzag-coded raw number
+ *    WIRE_STRING  varint bytes  length and contents
+ *    WIRE_SYMBOL  varint bytes
+ *    WIRE_REF     varint        the nth string or symbol sent in full
+ *    WIRE_BYTES   varint bytes
+ *    WIRE_LIST    values... WIRE_END
+ *
+ * Varints are little-endian base 128.  Lists are framed rather than
+ * counted, so they can be written while they are walked.
+ */
+
+#ifndef JL_WIRE_H
+#define JL_WIRE_H
+
+#define WIRE_VERSION       0x01
+#define WIRE_FLAG_FIXED    0x40  /**< Numbers are fixed point. */
+#define WIRE_FLAG_REFS     0x80  /**< WIRE_REF may be used. */
+
+#define WIRE_NIL           0x00
+#define WIRE_NUMBER        0x01
+#define WIRE_STRING        0x02
+#define WIRE_SYMBOL        0x03
+#define WIRE_REF           0x04
+#define WIRE_BYTES         0x05
+#define WIRE_LIST          0x06
+#define WIRE_END           0x07
+
+/** Strings after this many are always sent in full, which bounds the
+ * reference table on both sides. */
+#define WIRE_MAX_REFS      1024
+
+/** Bytes the encoder buffers between calls to the output function. */
+#define WIRE_BUFFER_SIZE   64
+
+struct JLContext;
+
+void RegisterWireFunctions(struct JLContext *context);
+
+#endif /* JL_WIRE_H */
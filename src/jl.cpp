@@ -4,46 +4,170 @@
 #include "jl-value.h"
 #include "jl-scope.h"
 #include "jl-func.h"
+#include "jl-gpio.h"
+#include "jl-bytes.h"
+#include "jl-bus.h"
+#include "jl-memo.h"
+#include "jl-intern.h"
+#include "jl-macro.h"
+#include "jl-load.h"
+#include "jl-wire.h"
+#include "jl-sim.h"
+#include "jl-edge.h"
+#include "jl-reclaim.h"
+#include "jl-eval.h"
+#include "jl-profile.h"
+#include "jl-arena.h"
+#include "jl-number.h"
 
+#ifdef JL_BACKGROUND_RELEASE
+#include <atomic>
+#endif
 #include <cstdlib>
 #include <cstring>
 #include <stdio.h>
 
+static void ReleaseContents(JLContext *context, JLValue *value);
+#ifdef JL_DEFERRED_RELEASE
+static void FreeValue(JLContext *context, JLValue *value);
+#endif
+static void InitContext(JLContext *context);
+static void PopulateContext(JLContext *context);
+static JLValue *EvaluateTop(JLContext *context, JLValue *value);
 static JLValue *EvalLambda(JLContext *context,
                            const JLValue *lambda,
                            JLValue *args);
+#ifdef JL_HEAP_PROFILE
+static const char *GetCallName(const JLValue *args);
+#endif
 static JLValue *ParseLiteral(JLContext *context, const char **line);
 static JLValue *ParseList(JLContext *context, const char **line);
+static JLValue *ParseQuoted(JLContext *context, const char **line,
+                            const char *name);
 static JLValue *ParseExpression(JLContext *context, const char **line);
+static void CountOutput(void *arg, const char *data, size_t len);
+static void CopyOutput(void *arg, const char *data, size_t len);
+static char *RenderString(JLContext *context, const JLValue *value,
+                          char internal);
 
 void JLRetain(JLContext *context, JLValue *value)
 {
-   if(value) {
+   if(value && !IsRomValue(value)) {
       value->count += 1;
    }
 }
 
+void ReleaseContents(JLContext *context, JLValue *value)
+{
+   switch(value->tag) {
+   case JLVALUE_LIST:
+   case JLVALUE_LAMBDA:
+   case JLVALUE_CELL:
+   case JLVALUE_MACRO:
+      JLRelease(context, value->value.lst);
+      break;
+   case JLVALUE_STRING:
+   case JLVALUE_VARIABLE:
+      FreeMemory(context, value->value.str);
+      break;
+   case JLVALUE_SCOPE:
+      ReleaseScope(context, (ScopeNode*)value->value.scope);
+      break;
+   case JLVALUE_BYTES:
+      ReleaseByteBuffer(context, value->value.bytes);
+      break;
+   case JLVALUE_MEMO:
+      ReleaseMemo(context, value->value.memo);
+      break;
+   default:
+      break;
+   }
+}
+
+#ifdef JL_DEFERRED_RELEASE
+
+void JLRelease(JLContext *context, JLValue *value)
+{
+   if(value && !IsRomValue(value)) {
+#ifdef JL_BACKGROUND_RELEASE
+      /* Finish using the value before the reclaimer can see the drop. */
+      std::atomic_thread_fence(std::memory_order_release);
+#endif
+      value->count -= 1;
+      if(value->count == 0) {
+         if(value->flags & JLVALUE_FLAG_INTERNED) {
+            ForgetInterned(context, value);
+         }
+         if(context->pending_count == context->pending_size &&
+            !GrowPending(context)) {
+            /* No room to defer it; free it now. */
+            FreeValue(context, value);
+            return;
+         }
+         context->pending[context->pending_count] = value;
+         context->pending_count += 1;
+         if(!context->draining) {
+            JLDrainReleases(context, JL_RELEASE_STEPS);
+         }
+      }
+   }
+}
+
+void FreeValue(JLContext *context, JLValue *value)
+{
+   /* What this refers to is only queued, so this doesn't recurse. */
+   JLValue *next;
+#ifdef JL_BACKGROUND_RELEASE
+   if(OfferReclaim(context, value)) {
+      return;
+   }
+#endif
+   next = value->next;
+   ReleaseContents(context, value);
+   PutFree(context, value);
+   JLRelease(context, next);
+}
+
+size_t JLDrainReleases(JLContext *context, size_t limit)
+{
+   const char draining = context->draining;
+   size_t steps = 0;
+   context->draining = 1;
+   for(;;) {
+#ifdef JL_BACKGROUND_RELEASE
+      if(limit == 0 || steps < limit) {
+         steps += CollectReclaimed(context, limit ? limit - steps : 0);
+      }
+#endif
+      while(context->pending_count > 0 && (limit == 0 || steps < limit)) {
+         context->pending_count -= 1;
+         FreeValue(context, context->pending[context->pending_count]);
+         steps += 1;
+      }
+#ifdef JL_BACKGROUND_RELEASE
+      /* Draining everything includes what the reclaimer has. */
+      if(limit == 0 && WaitReclaimer(context)) {
+         continue;
+      }
+#endif
+      break;
+   }
+   context->draining = draining;
+   return context->pending_count;
+}
+
+#else
+
 void JLRelease(JLContext *context, JLValue *value)
 {
-   while(value) {
+   while(value && !IsRomValue(value)) {
       value->count -= 1;
       if(value->count == 0) {
          JLValue *next = value->next;
-         switch(value->tag) {
-         case JLVALUE_LIST:
-         case JLVALUE_LAMBDA:
-            JLRelease(context, value->value.lst);
-            break;
-         case JLVALUE_STRING:
-         case JLVALUE_VARIABLE:
-            free(value->value.str);
-            break;
-         case JLVALUE_SCOPE:
-            ReleaseScope(context, (ScopeNode*)value->value.scope);
-            break;
-         default:
-            break;
+         if(value->flags & JLVALUE_FLAG_INTERNED) {
+            ForgetInterned(context, value);
          }
+         ReleaseContents(context, value);
          PutFree(context, value);
          value = next;
       } else {
@@ -52,54 +176,175 @@ void JLRelease(JLContext *context, JLValue *value)
    }
 }
 
-JLContext *JLCreateContext()
+size_t JLDrainReleases(JLContext *context, size_t limit)
+{
+   return 0;
+}
+
+#endif /* JL_DEFERRED_RELEASE */
+
+void InitContext(JLContext *context)
 {
-   JLContext *context = (JLContext*)malloc(sizeof(JLContext));
    context->scope = NULL;
+   context->arena = NULL;
    context->freelist = NULL;
    context->blocks = NULL;
+   context->pool = NULL;
+   context->pool_size = 0;
+   context->scope_freelist = NULL;
+   context->scope_blocks = NULL;
+   context->specials = NULL;
+   context->special_count = 0;
+   context->special_size = 0;
+   context->frames = NULL;
+   context->spare_frames = NULL;
+   context->globals = NULL;
+   context->global_size = 0;
+   context->global_count = 0;
+   context->interned = NULL;
+   context->intern_size = 0;
+   context->intern_count = 0;
+   context->hash_cons = 0;
+   context->macro_count = 0;
+   context->builtin_count = 0;
+   context->loads = NULL;
+   context->files = NULL;
+   context->loader = NULL;
+   context->loader_arg = NULL;
+   context->load_hits = 0;
+   context->load_misses = 0;
    context->line = 1;
    context->levels = 0;
    context->max_levels = 1 << 15;
+   context->unwind = NULL;
+   context->unwind_count = 0;
+   context->unwind_size = 0;
+   context->catches = NULL;
+#ifdef JL_STACKLESS
+   context->eval_stack = NULL;
+   context->eval_count = 0;
+   context->eval_size = 0;
+   context->nested = 0;
+   context->stack_base = 0;
+#endif
+#ifdef JL_HEAP_PROFILE
+   context->site_name = NULL;
+   context->sites = NULL;
+   context->site_index = NULL;
+   context->site_size = 0;
+   context->site_count = 0;
+   context->site = 0;
+#endif
+   context->budget_steps = 0;
+   context->budget_count = 0;
+   context->budget_deadline = 0;
+   context->budget = JL_BUDGET_DONE;
+#ifdef JL_DEFERRED_RELEASE
+   context->pending = NULL;
+   context->pending_count = 0;
+   context->pending_size = 0;
+   context->draining = 0;
+#endif
+#ifdef JL_BACKGROUND_RELEASE
+   context->reclaimer = NULL;
+#endif
+   context->edges = NULL;
+   context->rom = NULL;
    context->error = 0;
+   context->error_line = 0;
+   InitOutput(context);
+}
+
+void PopulateContext(JLContext *context)
+{
    JLEnterScope(context);
+   context->true_value = JLDefineNumber(context, NULL, Number::FromInt(1));
    RegisterFunctions(context);
+   RegisterGpioFunctions(context);
+   RegisterBytesFunctions(context);
+   RegisterBusFunctions(context);
+   RegisterMemoFunctions(context);
+   RegisterInternFunctions(context);
+   RegisterMacroFunctions(context);
+   RegisterLoadFunctions(context);
+   RegisterWireFunctions(context);
+   RegisterEdgeFunctions(context);
+#ifdef JL_HEAP_PROFILE
+   RegisterProfileFunctions(context);
+#endif
+#ifdef JL_SIMULATOR
+   RegisterSimFunctions(context);
+#endif
    JLDefineValue(context, "nil", NULL);
+}
+
+JLContext *JLCreateContext()
+{
+   JLContext *context = (JLContext*)malloc(sizeof(JLContext));
+   InitContext(context);
+   PopulateContext(context);
+#ifdef JL_BACKGROUND_RELEASE
+   StartReclaimer(context);
+#endif
+   return context;
+}
+
+JLContext *JLCreateArenaContext(void *memory, size_t size, size_t values)
+{
+   const uintptr_t start = ((uintptr_t)memory + 7) & ~(uintptr_t)7;
+   const size_t header = (sizeof(JLContext) + 7) & ~(size_t)7;
+   const size_t pools = GetPoolBytes(values);
+   const size_t used = (size_t)(start - (uintptr_t)memory) + header + pools;
+   JLContext *context = (JLContext*)start;
+   CatchNode node;
+
+   if(used >= size) {
+      return NULL;
+   }
+   InitContext(context);
+   ReservePools(context, (char*)start + header, values);
+   context->arena = CreateArena((char*)start + header + pools, size - used);
+   if(context->arena == NULL) {
+      return NULL;
+   }
+
+   /* Fail cleanly if the builtins don't fit. */
+   EnterCatch(context, &node);
+   if(setjmp(node.env) != 0) {
+      return NULL;
+   }
+   PopulateContext(context);
+   LeaveCatch(context, &node);
    return context;
 }
 
 void JLDestroyContext(JLContext *context)
 {
+   JLFlush(context);
+   ReleaseGlobals(context);
+   ReleaseBuiltins(context);
    JLLeaveScope(context);
+   ReleaseFrames(context);
+   ReleaseLoads(context);
+   ReleaseEdges(context);
+   JLDrainReleases(context, 0);
+   ReleaseInternTable(context);
+   JLRelease(context, context->true_value);
+#ifdef JL_HEAP_PROFILE
+   ReleaseHeapSites(context);
+#endif
+#ifdef JL_BACKGROUND_RELEASE
+   StopReclaimer(context);
+#endif
    FreeContext(context);
 }
 
 void JLDefineValue(JLContext *context, const char *name, JLValue *value)
 {
-   if(name) {
-      BindingNode **root = &context->scope->bindings;
-      JLRetain(context, value);
-      while(*root) {
-         const int v = strcmp((*root)->name, name);
-         if(v < 0) {
-            root = &(*root)->left;
-         } else if(v > 0) {
-            root = &(*root)->right;
-         } else {
-            /* Overwrite the old binding. */
-            JLRelease(context, (*root)->value);
-            (*root)->value = value;
-            return;
-         }
-      }
-
-      /* New binding. */
-      *root = (BindingNode*)GetFree(context);
-      (*root)->name = strdup(name);
-      (*root)->value = value;
-      (*root)->left = NULL;
-      (*root)->right = NULL;
-
+   if(name && context->scope->next == NULL) {
+      DefineGlobal(context, name, value);
+   } else if(name) {
+      DefineBinding(context, context->scope, name, value);
    }
 }
 
@@ -109,8 +354,7 @@ void JLDefineSpecial(JLContext *context,
                      void *extra)
 {
    JLValue *result = CreateValue(context, name, JLVALUE_SPECIAL);
-   result->value.special.func = func;
-   result->value.special.extra = extra;
+   result->value.special = AddSpecial(context, func, extra, JLEVAL_CODE);
    JLRelease(context, result);
 }
 
@@ -126,37 +370,44 @@ JLValue *JLDefineNumber(JLContext *context,
 JLValue *JLEvaluate(JLContext *context, JLValue *value)
 {
    JLValue *result = NULL;
+   JLValue *temp;
    if(context->levels == 0) {
-      context->error = 0;
-   } else if(context->error) {
+      return EvaluateTop(context, value);
+   }
+   CountStep(context);
+#ifdef JL_STACKLESS
+   if(value && value->tag == JLVALUE_LIST) {
+      return RunEvaluator(context, value);
+   }
+#endif
+   if(context->levels >= context->max_levels) {
+      Error(context, "maximum evaluation depth exceeded");
       return NULL;
    }
    context->levels += 1;
    if(value == NULL) {
       result = NULL;
-   } else if(context->levels > context->max_levels) {
-      Error(context, "maximum evaluation depth exceeded");
-      result = NULL;
    } else if(value->tag == JLVALUE_LIST) {
-      JLValue *temp = JLEvaluate(context, value->value.lst);
+      temp = JLEvaluate(context, value->value.lst);
       if(temp) {
-         switch(temp->tag) {
-         case JLVALUE_SPECIAL:
-            result = (temp->value.special.func)(context, value->value.lst,
-                                                temp->value.special.extra);
-            break;
-         case JLVALUE_LAMBDA:
-            result = EvalLambda(context, temp, value->value.lst);
-            break;
-         default:
-            result = JLEvaluate(context, temp);
-            break;
+         PushRelease(context, &temp);
+         if(temp->tag == JLVALUE_MACRO) {
+            /* Defined after this code was processed; expand it now. */
+            ExpandForm(context, value, temp);
+            result = JLEvaluate(context, value);
+         } else {
+            result = ApplyFunction(context, temp, value->value.lst);
          }
+         context->unwind_count -= 1;
          JLRelease(context, temp);
       }
    } else if(value->tag == JLVALUE_VARIABLE) {
       result = Lookup(context, value->value.str);
       JLRetain(context, result);
+   } else if(value->tag == JLVALUE_CELL) {
+      /* Cells hold values that have already been evaluated. */
+      result = value->value.lst;
+      JLRetain(context, result);
    } else if(value->tag != JLVALUE_NIL) {
       result = value;
       JLRetain(context, result);
@@ -165,17 +416,129 @@ JLValue *JLEvaluate(JLContext *context, JLValue *value)
    return result;
 }
 
+JLValue *EvaluateTop(JLContext *context, JLValue *value)
+{
+   CatchNode node;
+   JLValue *volatile result = NULL;
+
+   /* Errors anywhere in the evaluation unwind to here. */
+   context->error = 0;
+   context->levels = 1;
+   EnterCatch(context, &node);
+   if(setjmp(node.env) == 0) {
+      ExpandMacros(context, value);
+      result = JLEvaluate(context, value);
+      LeaveCatch(context, &node);
+   } else {
+      ReportError(context);
+   }
+   context->levels = 0;
+   return result;
+}
+
+char JLHasError(JLContext *context)
+{
+   return context->error;
+}
+
+char TryEvaluate(JLContext *context, JLValue *value, JLValue **result)
+{
+   CatchNode node;
+   EnterCatch(context, &node);
+   if(setjmp(node.env) == 0) {
+      *result = JLEvaluate(context, value);
+      LeaveCatch(context, &node);
+      return 1;
+   }
+   *result = NULL;
+   if(context->budget != JL_BUDGET_DONE) {
+      /* An exhausted budget unwinds the whole evaluation. */
+      Raise(context);
+   }
+   return 0;
+}
+
+int JLEvaluateWithBudget(JLContext *context, JLValue *value,
+                         unsigned long steps, uint64_t deadline_us,
+                         JLValue **result)
+{
+   int status;
+   context->budget = JL_BUDGET_DONE;
+   context->budget_steps = steps ? steps : (unsigned long)-1;
+   context->budget_deadline = deadline_us;
+   context->budget_count = 1;    /* Check on the first step. */
+   *result = JLEvaluate(context, value);
+   status = context->budget;
+   if(status == JL_BUDGET_DONE && context->error) {
+      status = JL_BUDGET_ERROR;
+   }
+   context->budget_count = 0;
+   context->budget = JL_BUDGET_DONE;
+   return status;
+}
+
+void JLProtect(JLContext *context, JLValue **value)
+{
+   PushRelease(context, value);
+}
+
+JLValue *ApplyFunction(JLContext *context, JLValue *func, JLValue *args)
+{
+   const size_t mark = context->unwind_count;
+   const SpecialFunction *special;
+   JLValue *result;
+#ifdef JL_HEAP_PROFILE
+   const char *site_name = context->site_name;
+   context->site_name = GetCallName(args);
+   context->site = 0;
+#endif
+   switch(func->tag) {
+   case JLVALUE_SPECIAL:
+      special = &context->specials[func->value.special];
+      result = (special->func)(context, args, special->extra);
+      break;
+   case JLVALUE_LAMBDA:
+      result = EvalLambda(context, func, args);
+      break;
+   case JLVALUE_MEMO:
+      result = CallMemo(context, func->value.memo, args);
+      break;
+   default:
+      result = JLEvaluate(context, func);
+      break;
+   }
+   /* The function returned normally; drop its cleanup. */
+   context->unwind_count = mark;
+#ifdef JL_HEAP_PROFILE
+   context->site_name = site_name;
+   context->site = 0;
+#endif
+   return result;
+}
+
+#ifdef JL_HEAP_PROFILE
+const char *GetCallName(const JLValue *args)
+{
+   /* Call forms built by natives have a NIL head naming the function. */
+   if(args->tag == JLVALUE_VARIABLE || args->tag == JLVALUE_NIL) {
+      return args->value.str;
+   }
+   return "lambda";
+}
+#endif
+
 JLValue *EvalLambda(JLContext *context, const JLValue *lambda, JLValue *args)
 {
 
-   JLValue *scope;
    JLValue *params;
    JLValue *code;
    ScopeNode *old_scope;
    ScopeNode *new_scope;
    JLValue *bp;
    JLValue *ap;
-   JLValue *result;
+   JLValue *result = NULL;
+   FrameBinding *frame = NULL;
+   unsigned int frame_size = 0;
 
    /* The value of a lambda is a list containing the following:
     *    - The scope in which to execute.
@@ -192,26 +555,33 @@ JLValue *EvalLambda(JLContext *context, const JLValue *lambda, JLValue *args)
       Error(context, "invalid lambda");
       return NULL;
    }
-   scope = lambda->value.lst;
    params = lambda->value.lst->next->value.lst;
    code = lambda->value.lst->next->next;
 
+   /* Parameters live in the frame region unless a closure over them
+    * outlives the call (see LeaveFrameScope). */
+   for(bp = params; bp; bp = bp->next) {
+      frame_size += 1;
+   }
+   frame = PushFrame(context, frame_size);
+
    /* Insert bindings. */
    old_scope = context->scope;
-   context->scope = (ScopeNode*)scope->value.scope;
+   context->scope = GetLambdaScope(context, lambda);
    JLEnterScope(context);
    new_scope = context->scope;
+   new_scope->frame = frame;
+   PushScopeRelease(context, old_scope, frame, frame_size);
+   PushRelease(context, &result);
    bp = params;
    ap = args->next;  /* Skip the name */
    while(bp) {
       if(ap == NULL) {
          Error(context, "too few arguments");
-         result = NULL;
          goto done_eval_lambda;
       }
       if(bp->tag != JLVALUE_VARIABLE) {
          Error(context, "invalid lambda argument");
-         result = NULL;
          goto done_eval_lambda;
       }
       context->scope = old_scope;
@@ -219,9 +589,10 @@ JLValue *EvalLambda(JLContext *context, const JLValue *lambda, JLValue *args)
 
          /* Make the rest of the arguments into a list parameter. */
          result = CreateValue(context, NULL, JLVALUE_LIST);
+         result->value.lst = NULL;
          JLValue **item = &result->value.lst;
          while(ap) {
-            *item = JLEvaluate(context, ap);
+            *item = CreateCell(context, JLEvaluate(context, ap));
             item = &(*item)->next;
             ap = ap->next;
          }
@@ -235,23 +606,29 @@ JLValue *EvalLambda(JLContext *context, const JLValue *lambda, JLValue *args)
       }
       context->scope = new_scope;
 
-      JLDefineValue(context, bp->value.str, result);
-      JLRelease(context, result);
+      if(frame) {
+         frame[new_scope->frame_count].name = bp->value.str;
+         frame[new_scope->frame_count].value = result;
+         new_scope->frame_count += 1;
+      } else {
+         JLDefineValue(context, bp->value.str, result);
+         JLRelease(context, result);
+      }
+      result = NULL;
       bp = bp->next;
    }
 
-   result = NULL;
    while(code) {
+      /* The slot must not be left dangling while evaluating. */
+      JLRelease(context, result);
+      result = NULL;
       result = JLEvaluate(context, code);
       code = code->next;
-      if(code) {
-         JLRelease(context, result);
-      }
    }
 
 done_eval_lambda:
 
-   JLLeaveScope(context);
+   LeaveFrameScope(context, frame, frame_size);
    context->scope = old_scope;
 
    return result;
@@ -267,7 +644,7 @@ JLValue *ParseLiteral(JLContext *context, const char **line)
     * Otherwise, if a token can be parsed as a number, we treat it as such.
     * Everything else we treat as a string.
     * Note that function lookups happen later, here we only generate
-    * strings and floating-point numbers.
+    * strings and numbers.
     */
 
    JLValue *result = CreateValue(context, NULL, JLVALUE_NIL);
@@ -278,12 +655,14 @@ JLValue *ParseLiteral(JLContext *context, const char **line)
       char in_control = 0;
       char in_hex = 0;
       char in_octal = 0;
-      result->value.str = (char*)malloc(max_len);
+      result->value.str = (char*)AllocMemory(context, max_len);
       *line += 1;
       while(**line && (in_control != 0 || **line != '\"')) {
          if(len + 1 >= max_len) {
             max_len += 16;
-            result->value.str = (char*)realloc(result->value.str, max_len);
+            result->value.str = (char*)ResizeMemory(context,
+                                                    result->value.str,
+                                                    max_len);
          }
          if(in_hex) {
             /* In a hex control sequence. */
@@ -373,7 +752,6 @@ JLValue *ParseLiteral(JLContext *context, const char **line)
    } else {
 
       const char *start = *line;
-      char *end;
       size_t len = 0;
 
       /* Determine how long this token is. */
@@ -384,13 +762,11 @@ JLValue *ParseLiteral(JLContext *context, const char **line)
          *line += 1;
       }
 
-      /* Attempt to parse the token as a double. */
-      result->value.number = strtod(start, &end);
-
-      /* If we couldn't parse the whole thing, treat it as a variable. */
-      if(start + len != end) {
+      /* If we can't parse the whole thing as a number,
+       * treat it as a variable. */
+      if(!Number::Parse(start, len, &result->value.number)) {
          result->tag = JLVALUE_VARIABLE;
-         result->value.str = (char*)malloc(len + 1);
+         result->value.str = (char*)AllocMemory(context, len + 1);
          memcpy(result->value.str, start, len);
          result->value.str[len] = 0;
       } else {
@@ -415,6 +791,7 @@ JLValue *ParseList(JLContext *context, const char **line)
    result->value.lst = NULL;
    item = &result->value.lst;
 
+   PushRelease(context, &result);
    while(**line && **line != ')') {
       JLValue *temp = ParseExpression(context, line);
       if(temp == NULL) {
@@ -423,10 +800,11 @@ JLValue *ParseList(JLContext *context, const char **line)
       *item = temp;
       item = &(*item)->next;
    }
+   context->unwind_count -= 1;
 
    if(**line != ')') {
-      Error(context, "expected ')'");
       JLRelease(context, result);
+      Error(context, "expected ')'");
       return NULL;
    }
 
@@ -436,14 +814,32 @@ JLValue *ParseList(JLContext *context, const char **line)
 
 }
 
-JLValue *ParseExpression(JLContext *context, const char **line)
+JLValue *ParseQuoted(JLContext *context, const char **line,
+                     const char *name)
+{
+   JLValue *result;
+   JLValue *expr = ParseExpression(context, line);
+   if(expr == NULL) {
+      Error(context, "expected expression after %s", name);
+      return NULL;
+   }
+   /* `x is (quasiquote x), ,x is (unquote x), ,@x is (unquote-splicing x) */
+   result = CreateValue(context, NULL, JLVALUE_LIST);
+   result->value.lst = CreateValue(context, NULL, JLVALUE_VARIABLE);
+   result->value.lst->value.str = CopyString(context, name);
+   result->value.lst->next = expr;
+   return result;
+}
+
+void SkipSpace(JLContext *context, const char **line)
 {
-   /* Skip leading white-space. */
    for(;;) {
       if(**line == ';') {
+         /* Stop at the newline so that it is counted. */
          while(**line && **line != '\n') {
             *line += 1;
          }
+         continue;
       } else if(**line == '\n') {
          context->line += 1;
       } else if(  **line != '\t' &&
@@ -453,6 +849,13 @@ JLValue *ParseExpression(JLContext *context, const char **line)
       }
       *line += 1;
    }
+}
+
+JLValue *ParseExpression(JLContext *context, const char **line)
+{
+   JLValue *result;
+
+   SkipSpace(context, line);
 
    switch(**line) {
    case 0:
@@ -460,14 +863,44 @@ JLValue *ParseExpression(JLContext *context, const char **line)
       return NULL;
    case '(':
       return ParseList(context, line);
+   case '`':
+      *line += 1;
+      return ParseQuoted(context, line, "quasiquote");
+   case ',':
+      *line += 1;
+      if(**line == '@') {
+         *line += 1;
+         return ParseQuoted(context, line, "unquote-splicing");
+      }
+      return ParseQuoted(context, line, "unquote");
    default:
-      return ParseLiteral(context, line);
+      break;
+   }
+
+   result = ParseLiteral(context, line);
+   if(context->hash_cons && result->tag == JLVALUE_STRING) {
+      /* Code nodes are linked, so refer to the shared string. */
+      result = CreateCell(context, InternValue(context, result));
    }
+   return result;
 }
 
 JLValue *JLParse(JLContext *context, const char **line)
 {
-   JLValue *result = ParseExpression(context, line);
+   CatchNode node;
+   JLValue *volatile result = NULL;
+   if(context->catches) {
+      result = ParseExpression(context, line);
+   } else {
+      /* Errors (such as running out of memory) unwind to here. */
+      EnterCatch(context, &node);
+      if(setjmp(node.env) != 0) {
+         ReportError(context);
+         return NULL;
+      }
+      result = ParseExpression(context, line);
+      LeaveCatch(context, &node);
+   }
    if(**line == ')') {
       Error(context, "unexpected ')'");
       *line += 1;
@@ -477,6 +910,7 @@ JLValue *JLParse(JLContext *context, const char **line)
 
 char JLIsNumber(JLValue *value)
 {
+   value = GetElement(value);
    if(value && value->tag == JLVALUE_NUMBER) {
       return 1;
    } else {
@@ -486,11 +920,12 @@ char JLIsNumber(JLValue *value)
 
 NUMBER_TYPE JLGetNumber(JLValue *value)
 {
-   return value->value.number;
+   return GetElement(value)->value.number;
 }
 
 char JLIsString(JLValue *value)
 {
+   value = GetElement(value);
    if(value && value->tag == JLVALUE_STRING) {
       return 1;
    } else {
@@ -500,11 +935,12 @@ char JLIsString(JLValue *value)
 
 const char *JLGetString(JLValue *value)
 {
-   return value->value.str;
+   return GetElement(value)->value.str;
 }
 
 char JLIsList(JLValue *value)
 {
+   value = GetElement(value);
    if(value && value->tag == JLVALUE_LIST) {
       return 1;
    } else {
@@ -512,9 +948,48 @@ char JLIsList(JLValue *value)
    }
 }
 
+JLValue *JLCreateBytes(JLContext *context, size_t capacity)
+{
+   ByteBuffer *buffer = CreateByteBuffer(context, capacity);
+   JLValue *result = CreateValue(context, NULL, JLVALUE_BYTES);
+   result->value.bytes = buffer;
+   return result;
+}
+
+char JLIsBytes(JLValue *value)
+{
+   value = GetElement(value);
+   if(value && value->tag == JLVALUE_BYTES) {
+      return 1;
+   } else {
+      return 0;
+   }
+}
+
+unsigned char *JLGetBytes(JLValue *value)
+{
+   return GetElement(value)->value.bytes->data;
+}
+
+size_t JLGetBytesLength(JLValue *value)
+{
+   return GetElement(value)->value.bytes->length;
+}
+
+size_t JLGetBytesCapacity(JLValue *value)
+{
+   return GetElement(value)->value.bytes->capacity;
+}
+
+void JLSetBytesLength(JLValue *value, size_t length)
+{
+   ByteBuffer *buffer = GetElement(value)->value.bytes;
+   buffer->length = length < buffer->capacity ? length : buffer->capacity;
+}
+
 JLValue *JLGetHead(JLValue *value)
 {
-   return value->value.lst;
+   return GetElement(value)->value.lst;
 }
 
 JLValue *JLGetNext(JLValue *value)
@@ -522,50 +997,129 @@ JLValue *JLGetNext(JLValue *value)
    return value->next;
 }
 
-void JLPrint(const JLContext *context, const JLValue *value)
+void JLPrint(JLContext *context, const JLValue *value)
 {
    JLValue *temp;
+   char buffer[NUMBER_BUFFER_SIZE];
+   if(value && value->tag == JLVALUE_CELL) {
+      value = value->value.lst;
+   }
    if(value == NULL || value->tag == JLVALUE_NIL) {
-      printf("nil");
+      OutputString(context, "nil");
       return;
    }
    switch(value->tag) {
    case JLVALUE_NUMBER:
-      printf(NUMBER_FMT, value->value.number);
+      JLWrite(context, buffer,
+              Number::Format(buffer, value->value.number, 10));
       break;
    case JLVALUE_STRING:
-      printf("\"%s\"", value->value.str);
+      JLWrite(context, "\"", 1);
+      OutputString(context, value->value.str);
+      JLWrite(context, "\"", 1);
       break;
    case JLVALUE_LIST:
-      printf("(");
+      JLWrite(context, "(", 1);
       for(temp = value->value.lst; temp; temp = temp->next) {
          JLPrint(context, temp);
          if(temp->next) {
-            printf(" ");
+            JLWrite(context, " ", 1);
          }
       }
-      printf(")");
+      JLWrite(context, ")", 1);
       break;
    case JLVALUE_LAMBDA:
-      printf("(lambda ");
+      OutputString(context, "(lambda ");
       for(temp = value->value.lst->next; temp; temp = temp->next) {
          JLPrint(context, temp);
          if(temp->next) {
-            printf(" ");
+            JLWrite(context, " ", 1);
          }
       }
-      printf(")");
+      JLWrite(context, ")", 1);
+      break;
+   case JLVALUE_MACRO:
+      OutputString(context, "(macro ");
+      JLPrint(context, value->value.lst);
+      JLWrite(context, ")", 1);
+      break;
+   case JLVALUE_MEMO:
+      OutputString(context, "(memoize ");
+      JLPrint(context, value->value.memo->func);
+      JLWrite(context, ")", 1);
       break;
    case JLVALUE_SPECIAL:
-      printf("special@%p(%p)", value->value.special.func,
-             value->value.special.extra);
+      OutputFormat(context, "special@%p(%p)",
+                   (void*)context->specials[value->value.special].func,
+                   context->specials[value->value.special].extra);
       break;
    case JLVALUE_VARIABLE:
-      printf("%s", value->value.str);
+      OutputString(context, value->value.str);
+      break;
+   case JLVALUE_BYTES:
+      OutputString(context, "(bytes");
+      for(size_t i = 0; i < value->value.bytes->length; i++) {
+         JLWrite(context, " ", 1);
+         JLWrite(context, buffer, Number::Format(buffer,
+                 Number::FromInt(value->value.bytes->data[i]), 10));
+      }
+      JLWrite(context, ")", 1);
       break;
    default:
-      printf("\n?\n");
+      OutputString(context, "\n?\n");
       break;
    }
 }
 
+void CountOutput(void *arg, const char *data, size_t len)
+{
+   *(size_t*)arg += len;
+}
+
+void CopyOutput(void *arg, const char *data, size_t len)
+{
+   char **pos = (char**)arg;
+   memcpy(*pos, data, len);
+   *pos += len;
+}
+
+char *RenderString(JLContext *context, const JLValue *value, char internal)
+{
+   const JLOutputFunction old_output = context->output;
+   void *old_arg = context->output_arg;
+   size_t len = 0;
+   char *result;
+   char *pos;
+
+   /* Render twice: once to measure and once to fill a single
+    * allocation of the right size. */
+   JLSetOutput(context, CountOutput, &len);
+   JLPrint(context, value);
+   JLFlush(context);
+   context->output = old_output;
+   context->output_arg = old_arg;
+
+   /* Strings for the host are always from malloc. */
+   result = (char*)(internal ? AllocMemory(context, len + 1)
+                             : malloc(len + 1));
+   pos = result;
+   context->output = CopyOutput;
+   context->output_arg = &pos;
+   JLPrint(context, value);
+   JLFlush(context);
+   result[len] = 0;
+
+   context->output = old_output;
+   context->output_arg = old_arg;
+   return result;
+}
+
+char *JLPrintToString(JLContext *context, const JLValue *value)
+{
+   return RenderString(context, value, 0);
+}
+
+char *PrintToString(JLContext *context, const JLValue *value)
+{
+   return RenderString(context, value, 1);
+}
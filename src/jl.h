@@ -12,11 +12,68 @@
 #define JL_VERSION_MAJOR   0
 #define JL_VERSION_MINOR   1
 
-#define NUMBER_TYPE int
-#define NUMBER_FMT  "%d"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Numeric representations, selected at compile time with JL_NUMBER. */
+#define JL_NUMBER_INT32    1     /**< 32-bit integers. */
+#define JL_NUMBER_INT64    2     /**< 64-bit integers. */
+#define JL_NUMBER_FIXED    3     /**< Saturating 32-bit fixed point. */
+
+#ifndef JL_NUMBER
+#define JL_NUMBER JL_NUMBER_INT32
+#endif
+
+/* Number of fractional bits for JL_NUMBER_FIXED. */
+#ifndef JL_FIXED_FRACTION_BITS
+#define JL_FIXED_FRACTION_BITS 16
+#endif
+
+/* The raw number type; for fixed point this is the scaled value. */
+#if JL_NUMBER == JL_NUMBER_INT64
+#define NUMBER_TYPE int64_t
+#else
+#define NUMBER_TYPE int32_t
+#endif
+
+/* Results of JLEvaluateWithBudget. */
+#define JL_BUDGET_DONE        0     /**< The evaluation finished. */
+#define JL_BUDGET_ERROR       1     /**< An error was reported. */
+#define JL_BUDGET_STEPS       2     /**< The step budget ran out. */
+#define JL_BUDGET_DEADLINE    3     /**< The deadline passed. */
+
+/* Flags for JLEncode. */
+#define JL_ENCODE_REFS        1     /**< Send repeated strings by index. */
 
 struct JLValue;
 struct JLContext;
+struct JLRom;
+
+/** The type of output functions.
+ * Output from JLPrint and error messages is collected in a buffer
+ * owned by the context and handed to the output function a line at a
+ * time (or when the buffer fills).
+ * @param arg Extra parameter from JLSetOutput.
+ * @param data The data to write (not NULL-terminated).
+ * @param len The number of bytes to write.
+ */
+typedef void (*JLOutputFunction)(void *arg, const char *data, size_t len);
+
+/** The type of load functions, which read files for load.
+ * @param arg Extra parameter from JLSetLoader.
+ * @param path The path passed to load.
+ * @return The contents as a NULL-terminated string from malloc (freed
+ *         by the caller), or NULL if the file can't be read.
+ */
+typedef char *(*JLLoadFunction)(void *arg, const char *path);
+
+/** The type of input functions for JLDecode.
+ * @param arg Extra parameter from JLDecode.
+ * @param data Where to put the data.
+ * @param len The number of bytes wanted.
+ * @return The number of bytes read (at most len, 0 at the end).
+ */
+typedef size_t (*JLInputFunction)(void *arg, char *data, size_t len);
 
 /** The type of special functions.
  * @param context The JL context.
@@ -35,12 +92,92 @@ typedef struct JLValue *(*JLFunction)(struct JLContext *context,
 
 struct JLContext *JLCreateContext();
 
+/** Create a real-time context that allocates only from a fixed arena.
+ * The value and scope pools are reserved up front and never grow; strings,
+ * byte buffers and tables come from a buddy allocator in the rest of the
+ * arena, so no allocation calls malloc or takes an unbounded time.
+ * Running out raises an "out of memory" error.
+ * @param memory The arena, which must outlive the context.
+ * @param size The size of the arena in bytes.
+ * @param values The number of values to reserve (with a quarter as many
+ *               scope nodes).
+ * @return The context, or NULL if the arena is too small.
+ */
+
+struct JLContext *JLCreateArenaContext(void *memory, size_t size,
+                                       size_t values);
+
 /** Destroy a JL context.
  * @param context The context to be destroyed.
  */
 
 void JLDestroyContext(struct JLContext *context);
 
+/** Set the output function for a context.
+ * Any buffered output is flushed to the old output function first.
+ * The default output function writes to stdout.
+ * @param context The context.
+ * @param func The output function.
+ * @param arg Extra parameter to pass to func.
+ */
+
+void JLSetOutput(struct JLContext *context, JLOutputFunction func, void *arg);
+
+/** Set the function load uses to read files.
+ * The default reads files with stdio on the host; the RP2040 build has
+ * none, so only files added with JLAddFile can be loaded.
+ * @param context The context.
+ * @param func The load function (NULL for none).
+ * @param arg Extra parameter to pass to func.
+ */
+
+void JLSetLoader(struct JLContext *context, JLLoadFunction func, void *arg);
+
+/** Add a file that load finds without the load function.
+ * This stands in for a file system, for example with a prelude that is
+ * linked into flash.  Neither string is copied.
+ * @param context The context.
+ * @param path The path to load it by.
+ * @param text The contents, which must outlive the context.
+ */
+
+void JLAddFile(struct JLContext *context, const char *path, const char *text);
+
+/** Load and evaluate a file, as (load path) does.
+ * The forms parsed from a file are cached by its contents, so loading
+ * the same contents again does not parse them again.
+ * @param context The context.
+ * @param path The path of the file.
+ * @return The value of the last form in the file.  This value must be
+ *         released if not used.
+ */
+
+struct JLValue *JLLoad(struct JLContext *context, const char *path);
+
+/** Use the constant bindings of a prelude generated by jlrom.
+ * The values stay in flash and are never parsed, copied or counted.
+ * Globals defined later take precedence over them.
+ * @param context The context.
+ * @param rom The generated bindings (NULL for none).
+ */
+
+void JLUseRom(struct JLContext *context, const struct JLRom *rom);
+
+/** Write raw data to the output buffer of a context.
+ * The buffer is flushed when the data contains a newline.
+ * @param context The context.
+ * @param data The data to write.
+ * @param len The number of bytes to write.
+ */
+
+void JLWrite(struct JLContext *context, const char *data, size_t len);
+
+/** Flush the output buffer of a context.
+ * @param context The context.
+ */
+
+void JLFlush(struct JLContext *context);
+
 /** Create and enter a new lexical scope. */
 
 void JLEnterScope(struct JLContext *context);
@@ -49,6 +186,14 @@ void JLEnterScope(struct JLContext *context);
 
 void JLLeaveScope(struct JLContext *context);
 
+/** Free values whose release was deferred (see JL_DEFERRED_RELEASE).
+ * @param context The context.
+ * @param limit The most values to free (0 for all of them).
+ * @return The number of values still waiting to be freed.
+ */
+
+size_t JLDrainReleases(struct JLContext *context, size_t limit);
+
 /** Increase the reference count of a value.
  * @param context The context containing the value.
  * @param value The value (can be NULL).
@@ -94,7 +239,7 @@ void JLDefineSpecial(struct JLContext *context,
  * This will add a number to the current scope.
  * @param context The context in which to define the number.
  * @param name The name of the binding (NULL for no name).
- * @param value The value to define.
+ * @param value The value to define (raw scaled value for fixed point).
  * @return The value.  This value must be released if not used.
  */
 
@@ -112,6 +257,8 @@ struct JLValue *JLDefineNumber(struct JLContext *context,
 struct JLValue *JLParse(struct JLContext *context, const char **line);
 
 /** Evaluate an expression.
+ * Errors are reported when they unwind to the outermost evaluation,
+ * which then returns NULL.
  * @param context The context.
  * @param value The expression to evaluate.
  * @return The result.  This value must be released if not used.
@@ -119,6 +266,112 @@ struct JLValue *JLParse(struct JLContext *context, const char **line);
 
 struct JLValue *JLEvaluate(struct JLContext *context, struct JLValue *value);
 
+/** Determine if the last outermost evaluation reported an error.
+ * Errors stopped by catch are not counted.
+ * @param context The context.
+ * @return 1 if an error was reported, 0 otherwise.
+ */
+
+char JLHasError(struct JLContext *context);
+
+/** Evaluate an expression with a limit on its work and time.
+ * Each evaluation step counts against steps, and the clock is checked
+ * every JL_BUDGET_CHECK_STEPS steps.  When either runs out, the
+ * evaluation is abandoned like an error, except that catch does not stop
+ * it; it can be run again from the start later.
+ * This must not be called from within another evaluation.
+ * @param context The context.
+ * @param value The expression to evaluate.
+ * @param steps The maximum number of steps (0 for no limit).
+ * @param deadline_us The time (see JLGetTimeUs) by which the evaluation
+ *        must finish (0 for no limit).
+ * @param result Set to the result (NULL unless JL_BUDGET_DONE is
+ *        returned).  This value must be released if not used.
+ * @return JL_BUDGET_DONE, JL_BUDGET_ERROR, JL_BUDGET_STEPS or
+ *         JL_BUDGET_DEADLINE.
+ */
+
+int JLEvaluateWithBudget(struct JLContext *context,
+                         struct JLValue *value,
+                         unsigned long steps,
+                         uint64_t deadline_us,
+                         struct JLValue **result);
+
+/** Get the time used for evaluation deadlines.
+ * On the RP2040 this is time_us_64().
+ * @return A monotonic time in microseconds.
+ */
+
+uint64_t JLGetTimeUs();
+
+#ifndef RP2040
+
+/** Drive the simulated GPIO inputs, as the world outside the board would.
+ * Edges on pins with an on-edge handler are queued.
+ * @param mask The pins to drive.
+ * @param value The levels of those pins.
+ */
+void JLDriveGpio(uint32_t mask, uint32_t value);
+
+#endif
+
+#ifdef JL_SIMULATOR
+
+/** Set the time the simulator charges for each evaluation step.
+ * @param step_ns The time in nanoseconds.
+ */
+
+void JLSimSetStepCost(uint32_t step_ns);
+
+/** Schedule a change to the simulated GPIO inputs.
+ * @param time_us The time (see JLGetTimeUs) of the change.
+ * @param mask The pins to drive.
+ * @param value The levels to drive them to.
+ */
+
+void JLSimInputAt(uint64_t time_us, uint32_t mask, uint32_t value);
+
+/** Schedule data to arrive on the simulated UART.
+ * @param time_us The time (see JLGetTimeUs) the data arrives.
+ * @param data The data (copied).
+ * @param len The number of bytes.
+ */
+
+void JLSimUartAt(uint64_t time_us, const char *data, size_t len);
+
+/** Set where data sent on the simulated UART goes.
+ * @param func The output function (NULL to discard the data).
+ * @param arg Extra parameter to pass to func.
+ */
+
+void JLSimSetUartOutput(JLOutputFunction func, void *arg);
+
+/** Print the latency, jitter and response histograms.
+ * @param context The context to print to.
+ */
+
+void JLSimReport(struct JLContext *context);
+
+/** Clear the histograms and drop any scheduled events.
+ * The clock keeps running.
+ */
+
+void JLSimReset();
+
+#endif /* JL_SIMULATOR */
+
+/** Release a value if an error unwinds out of a special function.
+ * Errors raised during JLEvaluate unwind to the enclosing top-level
+ * evaluation (or catch) without returning through the special functions
+ * in between.  A special function that holds a value while evaluating
+ * something else can register the variable holding it; the variable
+ * must contain a value that is owned or NULL until the function returns.
+ * @param context The context.
+ * @param value The variable holding the value.
+ */
+
+void JLProtect(struct JLContext *context, struct JLValue **value);
+
 /** Determine if a value is a number.
  * @param value The value to check (NULL is allowed).
  * @return 1 if a number, 0 otherwise.
@@ -127,6 +380,7 @@ struct JLValue *JLEvaluate(struct JLContext *context, struct JLValue *value);
 char JLIsNumber(struct JLValue *value);
 
 /** Get the number representation of a value.
+ * For fixed point builds this is the raw scaled value.
  * @param value The value (must be a non-NULL number value).
  * @return The numeric value.
  */
@@ -147,6 +401,51 @@ char JLIsString(struct JLValue *value);
 
 const char *JLGetString(struct JLValue *value);
 
+/** Create a byte buffer.
+ * The buffer is zero-filled and its length starts at its capacity.
+ * @param context The context.
+ * @param capacity The fixed capacity of the buffer in bytes.
+ * @return The buffer.  This value must be released if not used.
+ */
+
+struct JLValue *JLCreateBytes(struct JLContext *context, size_t capacity);
+
+/** Determine if a value is a byte buffer.
+ * @param value The value to check (NULL is allowed).
+ * @return 1 if a byte buffer, 0 otherwise.
+ */
+
+char JLIsBytes(struct JLValue *value);
+
+/** Get the data of a byte buffer.
+ * The data may be read and written in place.
+ * @param value The value (must be a non-NULL byte buffer).
+ * @return The first byte of the buffer.
+ */
+
+unsigned char *JLGetBytes(struct JLValue *value);
+
+/** Get the length of a byte buffer.
+ * @param value The value (must be a non-NULL byte buffer).
+ * @return The number of bytes in use.
+ */
+
+size_t JLGetBytesLength(struct JLValue *value);
+
+/** Get the capacity of a byte buffer.
+ * @param value The value (must be a non-NULL byte buffer).
+ * @return The maximum length of the buffer.
+ */
+
+size_t JLGetBytesCapacity(struct JLValue *value);
+
+/** Set the length of a byte buffer.
+ * @param value The value (must be a non-NULL byte buffer).
+ * @param length The new length (limited to the capacity).
+ */
+
+void JLSetBytesLength(struct JLValue *value, size_t length);
+
 /** Determine if a value is a list.
  * @param value The value to check.
  * @return 1 if a list, 0 otherwise.
@@ -155,6 +454,7 @@ const char *JLGetString(struct JLValue *value);
 char JLIsList(struct JLValue *value);
 
 /** Get the first item of a list.
+ * Items may be passed to the other JLIs and JLGet functions.
  * @param value The list (must be a non-NULL list value).
  * @return The first item in the list (possibly NULL).
  */
@@ -169,10 +469,50 @@ struct JLValue *JLGetHead(struct JLValue *value);
 struct JLValue *JLGetNext(struct JLValue *value);
 
 /** Display a value.
+ * Output is buffered up to the next newline; use JLFlush to force it out.
  * @param context The context.
  * @param value The value to display.
  */
 
-void JLPrint(const struct JLContext *context, const struct JLValue *value);
+void JLPrint(struct JLContext *context, const struct JLValue *value);
+
+/** Render a value to a string.
+ * This produces the same text as JLPrint.
+ * @param context The context.
+ * @param value The value to render.
+ * @return A NULL-terminated string allocated with malloc.
+ */
+
+char *JLPrintToString(struct JLContext *context, const struct JLValue *value);
+
+/** Encode a value in the binary wire format.
+ * Numbers, strings, symbols, byte buffers and lists can be encoded.
+ * The output is written in small pieces as the value is walked.
+ * @param context The context.
+ * @param value The value to encode.
+ * @param flags JL_ENCODE_REFS or 0.
+ * @param func The output function (NULL to only count the bytes).
+ * @param arg Extra parameter to pass to func.
+ * @return The number of bytes encoded, or 0 on error.
+ */
+
+size_t JLEncode(struct JLContext *context, struct JLValue *value, int flags,
+                JLOutputFunction func, void *arg);
+
+/** Decode a value in the binary wire format.
+ * Exactly the bytes of one value are read, so values can follow each
+ * other on a stream.
+ * @param context The context.
+ * @param func The input function.
+ * @param arg Extra parameter to pass to func.
+ * @param max_length The most bytes in a string or buffer, which is
+ *        rejected as an error before memory is allocated for it (0 for
+ *        no limit).
+ * @param result Set to the value, which must be released if not used.
+ * @return 1 on success, 0 on error.
+ */
+
+int JLDecode(struct JLContext *context, JLInputFunction func, void *arg,
+             size_t max_length, struct JLValue **result);
 
 #endif /* JL_H */
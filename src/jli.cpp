@@ -29,12 +29,17 @@ const char eof = 255;           // EOF in stdio.h -is -1, but getchar returns in
 #define DUPLEX false
 #endif
 
+#ifdef JL_PRELUDE
+extern const struct JLRom jl_prelude;  // generated by jlrom
+#endif
+
 /*
  *  read a line of any  length from stdio (can grow to memory available)
  *
  *  @param fullDuplex input will echo on entry (terminal mode) when false
  *  @param linebreak defaults to "\n", but "\r" may be needed for terminals
  *  @return entered line on heap - don't forget calling free() to get memory back
+ *          (NULL at the end of input on the host)
  */
 static char * getLine(bool fullDuplex = DUPLEX, char lineBreak = LINE_END) {
     char * pStart = (char*)malloc(startLineLength); 
@@ -49,6 +54,12 @@ static char * getLine(bool fullDuplex = DUPLEX, char lineBreak = LINE_END) {
 
     while(1) {
          c = getchar(); // expect next character entry
+#ifndef RP2040
+         if(c == EOF && pPos == pStart) {
+            free(pStart);
+            return NULL; // end of input
+         }
+#endif
          if(c == eof || c == lineBreak) {
             break;     // non blocking exit
          } else if (c == '\b' && (pPos > pStart)) {
@@ -95,7 +106,8 @@ static struct JLValue *PrintFunc(struct JLContext *context,
    for(vp = JLGetNext(args); vp; vp = JLGetNext(vp)) {
       struct JLValue *result = JLEvaluate(context, vp);
       if(JLIsString(result)) {
-         printf("%s", JLGetString(result));
+         const char *str = JLGetString(result);
+         JLWrite(context, str, strlen(str));
       } else {
          JLPrint(context, result);
       }
@@ -124,35 +136,57 @@ int main(int argc, char *argv[])
    struct JLContext *context;
    struct JLValue *result;
    char *line = NULL;
-   size_t cap = 0;
-   char *filename = NULL;
+   int i;
 
 #ifdef RP2040
    stdio_init_all();
 #endif
-   printf("Pico JL Interpreter v%d.%d\n", JL_VERSION_MAJOR, JL_VERSION_MINOR);
-   printf("Type ^D to exit\n");
 
    context = JLCreateContext();
+#ifdef JL_PRELUDE
+   JLUseRom(context, &jl_prelude);
+#endif
    JLDefineSpecial(context, "print", PrintFunc, NULL);
 
+   /* Run any files given instead of starting the REPL.
+    * Stop at the first one that fails. */
+   if(argc > 1) {
+      int status = 0;
+      for(i = 1; i < argc && status == 0; i++) {
+         result = JLLoad(context, argv[i]);
+         JLRelease(context, result);
+         if(JLHasError(context)) {
+            status = 1;
+         }
+      }
+      JLDestroyContext(context);
+      return status;
+   }
+
+   printf("Pico JL Interpreter v%d.%d\n", JL_VERSION_MAJOR, JL_VERSION_MINOR);
+   printf("Type ^D to exit\n");
+
    for(;;) {
       printf("> "); 
       fflush(stdout);
-      const ssize_t len = 0;
 
       line = getLine();
+      if(line == NULL) {
+         break;
+      }
       if(strlen(line) > 0) {
          printf("\r\n");
          
          result = ProcessBuffer(context, line);
-         free(line);
 
-         printf("=> ");
+         JLWrite(context, "=> ", 3);
          JLPrint(context, result);
-         printf("\n");
+         JLWrite(context, "\n", 1);
+         JLFlush(context);
          JLRelease(context, result);
+         JLDrainReleases(context, 0);
       }
+      free(line);
    }
 
    JLDestroyContext(context);
@@ -0,0 +1,411 @@
+/**
+ * @file jlrom.cpp
+ *
+ * Put the bindings of a JL prelude in flash (see jl-rom.h).
+ * usage: jlrom prelude.jl prelude.cpp [name]
+ *
+ * The prelude is evaluated here and the globals it leaves are written out
+ * as constant values, with macros expanded and begin forms scanned so
+ * that nothing in them is changed at run time.  The result is a JLRom
+ * called name (jl_prelude by default) for JLUseRom.  Lambdas must be
+ * defined at the top level; built-in functions, byte buffers and memoized
+ * functions can't be constants.
+ */
+
+#include "jl.h"
+#include "jl-context.h"
+#include "jl-func.h"
+#include "jl-macro.h"
+#include "jl-rom.h"
+#include "jl-scope.h"
+#include "jl-value.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/** Values to write out, in order, with a table from value to index. */
+typedef struct RomBuilder {
+   JLContext *context;
+   JLValue **values;
+   size_t count;
+   size_t size;
+   JLValue **table;              /**< Open addressing, size * 2 slots. */
+   size_t *indexes;
+   const char **strings;         /**< Distinct strings. */
+   size_t string_count;
+   size_t string_size;
+} RomBuilder;
+
+static char *ReadText(const char *path);
+static char Evaluate(JLContext *context, const char *text);
+static size_t *FindIndex(RomBuilder *rom, const JLValue *value);
+static char AddValues(RomBuilder *rom, JLValue *value, const char *name);
+static void AddIndex(RomBuilder *rom, JLValue *value);
+static size_t AddString(RomBuilder *rom, const char *str);
+static void ExpandBody(JLContext *context, JLValue *lambda);
+static int CompareBindings(const void *a, const void *b);
+static void WriteString(FILE *fd, const char *str);
+static void WritePointer(FILE *fd, const char *name, RomBuilder *rom,
+                         const JLValue *value);
+static char WriteRom(RomBuilder *rom, GlobalNode **bindings, size_t count,
+                     const char *source, const char *path, const char *name);
+
+char *ReadText(const char *path)
+{
+   FILE *fd = fopen(path, "rb");
+   char *text = NULL;
+   long size;
+
+   if(fd == NULL) {
+      return NULL;
+   }
+   if(fseek(fd, 0, SEEK_END) != 0 || (size = ftell(fd)) < 0 ||
+      fseek(fd, 0, SEEK_SET) != 0) {
+      goto read_done;
+   }
+   text = (char*)malloc((size_t)size + 1);
+   if(text && fread(text, 1, (size_t)size, fd) != (size_t)size) {
+      free(text);
+      text = NULL;
+   } else if(text) {
+      text[size] = 0;
+   }
+read_done:
+   fclose(fd);
+   return text;
+}
+
+char Evaluate(JLContext *context, const char *text)
+{
+   while(*text) {
+      JLValue *value = JLParse(context, &text);
+      if(context->error) {
+         return 0;
+      }
+      if(value) {
+         JLRelease(context, JLEvaluate(context, value));
+         JLRelease(context, value);
+         if(context->error) {
+            return 0;
+         }
+      }
+   }
+   return 1;
+}
+
+size_t *FindIndex(RomBuilder *rom, const JLValue *value)
+{
+   size_t i;
+   if(rom->size == 0) {
+      return NULL;
+   }
+   i = ((uintptr_t)value / sizeof(JLValue)) & (rom->size * 2 - 1);
+   while(rom->table[i] && rom->table[i] != value) {
+      i = (i + 1) & (rom->size * 2 - 1);
+   }
+   return rom->table[i] ? &rom->indexes[i] : NULL;
+}
+
+void AddIndex(RomBuilder *rom, JLValue *value)
+{
+   size_t i;
+   if(rom->count == rom->size) {
+      JLValue **values = rom->values;
+      const size_t count = rom->count;
+      rom->size = rom->size ? rom->size * 2 : 256;
+      rom->values = (JLValue**)malloc(rom->size * sizeof(JLValue*));
+      free(rom->table);
+      free(rom->indexes);
+      rom->table = (JLValue**)calloc(rom->size * 2, sizeof(JLValue*));
+      rom->indexes = (size_t*)malloc(rom->size * 2 * sizeof(size_t));
+      rom->count = 0;
+      for(i = 0; i < count; i++) {
+         AddIndex(rom, values[i]);
+      }
+      free(values);
+   }
+   i = ((uintptr_t)value / sizeof(JLValue)) & (rom->size * 2 - 1);
+   while(rom->table[i]) {
+      i = (i + 1) & (rom->size * 2 - 1);
+   }
+   rom->table[i] = value;
+   rom->indexes[i] = rom->count;
+   rom->values[rom->count] = value;
+   rom->count += 1;
+}
+
+size_t AddString(RomBuilder *rom, const char *str)
+{
+   size_t i;
+   for(i = 0; i < rom->string_count; i++) {
+      if(!strcmp(rom->strings[i], str)) {
+         return i;
+      }
+   }
+   if(rom->string_count == rom->string_size) {
+      rom->string_size = rom->string_size ? rom->string_size * 2 : 64;
+      rom->strings = (const char**)realloc(rom->strings,
+                                           rom->string_size * sizeof(char*));
+   }
+   rom->strings[rom->string_count] = str;
+   rom->string_count += 1;
+   return i;
+}
+
+void ExpandBody(JLContext *context, JLValue *lambda)
+{
+   JLValue *params = lambda->value.lst->next;
+   JLValue *vp;
+
+   /* Walk the code even without macros so every list is marked. */
+   context->macro_count += 1;
+   for(vp = params ? params->next : NULL; vp; vp = vp->next) {
+      ExpandCode(context, vp);
+   }
+   context->macro_count -= 1;
+}
+
+char AddValues(RomBuilder *rom, JLValue *value, const char *name)
+{
+   for(; value && FindIndex(rom, value) == NULL; value = value->next) {
+      JLValue *head;
+      switch(value->tag) {
+      case JLVALUE_NIL:
+      case JLVALUE_NUMBER:
+         break;
+      case JLVALUE_STRING:
+      case JLVALUE_VARIABLE:
+         AddString(rom, value->value.str);
+         break;
+      case JLVALUE_LAMBDA:
+         if(value->value.lst->value.scope != rom->context->scope) {
+            fprintf(stderr, "%s: lambda not defined at the top level\n",
+                    name);
+            return 0;
+         }
+         ExpandBody(rom->context, value);
+         break;
+      case JLVALUE_LIST:
+         head = value->value.lst;
+         if(head && head->tag == JLVALUE_VARIABLE &&
+            !strcmp(head->value.str, "begin")) {
+            BeginNeedsScope(head);
+         }
+         break;
+      case JLVALUE_SCOPE:
+      case JLVALUE_CELL:
+      case JLVALUE_MACRO:
+         break;
+      default:
+         fprintf(stderr, "%s: value can't be a constant\n", name);
+         return 0;
+      }
+      AddIndex(rom, value);
+      if(value->tag != JLVALUE_SCOPE && value->tag != JLVALUE_NUMBER &&
+         value->tag != JLVALUE_STRING && value->tag != JLVALUE_VARIABLE &&
+         !AddValues(rom, value->value.lst, name)) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+int CompareBindings(const void *a, const void *b)
+{
+   const uint32_t ha = (*(GlobalNode* const*)a)->hash;
+   const uint32_t hb = (*(GlobalNode* const*)b)->hash;
+   return ha < hb ? -1 : (ha > hb ? 1 : 0);
+}
+
+void WriteString(FILE *fd, const char *str)
+{
+   fputc('"', fd);
+   for(; *str; str++) {
+      const unsigned char ch = (unsigned char)*str;
+      if(ch == '"' || ch == '\\') {
+         fprintf(fd, "\\%c", ch);
+      } else if(ch < 0x20 || ch >= 0x7F) {
+         fprintf(fd, "\\%03o", ch);
+      } else {
+         fputc(ch, fd);
+      }
+   }
+   fputc('"', fd);
+}
+
+void WritePointer(FILE *fd, const char *name, RomBuilder *rom,
+                  const JLValue *value)
+{
+   if(value) {
+      fprintf(fd, "&%s_values[%zu]", name, *FindIndex(rom, value));
+   } else {
+      fprintf(fd, "(const JLValue*)0");
+   }
+}
+
+char WriteRom(RomBuilder *rom, GlobalNode **bindings, size_t count,
+              const char *source, const char *path, const char *name)
+{
+   FILE *fd = fopen(path, "w");
+   unsigned int macros = 0;
+   size_t i;
+
+   if(fd == NULL) {
+      fprintf(stderr, "cannot write %s\n", path);
+      return 0;
+   }
+   static const char *const TAG_NAMES[] = {
+      "JLVALUE_NIL", "JLVALUE_NUMBER", "JLVALUE_STRING", "JLVALUE_LIST",
+      "JLVALUE_LAMBDA", "JLVALUE_SPECIAL", "JLVALUE_SCOPE",
+      "JLVALUE_VARIABLE", "JLVALUE_BYTES", "JLVALUE_CELL", "JLVALUE_MEMO",
+      "JLVALUE_MACRO"
+   };
+
+   fprintf(fd, "/* Generated by jlrom from %s; do not edit. */\n\n", source);
+   fprintf(fd, "#include \"jl-rom.h\"\n\n");
+   fprintf(fd, "static_assert(JL_NUMBER == %d, \"jlrom number type\");\n",
+           JL_NUMBER);
+#if JL_NUMBER == JL_NUMBER_FIXED
+   fprintf(fd, "static_assert(JL_FIXED_FRACTION_BITS == %d, "
+           "\"jlrom fraction bits\");\n", JL_FIXED_FRACTION_BITS);
+#endif
+   fprintf(fd, "\n");
+
+   for(i = 0; i < rom->string_count; i++) {
+      fprintf(fd, "static const char %s_s%zu[] = ", name, i);
+      WriteString(fd, rom->strings[i]);
+      fprintf(fd, ";\n");
+   }
+
+   fprintf(fd, "\nstatic const JLValue %s_values[%zu] = {\n",
+           name, rom->count ? rom->count : 1);
+   for(i = 0; i < rom->count; i++) {
+      const JLValue *value = rom->values[i];
+      fprintf(fd, "   JL_ROM_VALUE(");
+      switch(value->tag) {
+      case JLVALUE_NUMBER:
+         if((int64_t)value->value.number == INT64_MIN) {
+            fprintf(fd, "(NUMBER_TYPE)(-9223372036854775807LL - 1)");
+         } else {
+            fprintf(fd, "(NUMBER_TYPE)%" PRId64 "LL",
+                    (int64_t)value->value.number);
+         }
+         break;
+      case JLVALUE_STRING:
+      case JLVALUE_VARIABLE:
+         fprintf(fd, "%s_s%zu", name, AddString(rom, value->value.str));
+         break;
+      case JLVALUE_NIL:
+      case JLVALUE_SCOPE:
+         /* A null scope is the global scope (see GetLambdaScope). */
+         fprintf(fd, "(const JLValue*)0");
+         break;
+      default:
+         WritePointer(fd, name, rom, value->value.lst);
+         break;
+      }
+      fprintf(fd, ", ");
+      WritePointer(fd, name, rom, value->next);
+      fprintf(fd, ", %s, 0x%02x),\n", TAG_NAMES[(int)value->tag],
+              value->flags & ~JLVALUE_FLAG_INTERNED);
+   }
+   if(rom->count == 0) {
+      fprintf(fd, "   JL_ROM_VALUE((const JLValue*)0, "
+              "(const JLValue*)0, JLVALUE_NIL, 0)\n");
+   }
+   fprintf(fd, "};\n\n");
+
+   fprintf(fd, "static const JLRomBinding %s_bindings[%zu] = {\n",
+           name, count ? count : 1);
+   for(i = 0; i < count; i++) {
+      fprintf(fd, "   { ");
+      WriteString(fd, bindings[i]->name);
+      fprintf(fd, ", 0x%08" PRIx32 "u, ", bindings[i]->hash);
+      WritePointer(fd, name, rom, bindings[i]->value);
+      fprintf(fd, " },\n");
+      if(bindings[i]->value && bindings[i]->value->tag == JLVALUE_MACRO) {
+         macros += 1;
+      }
+   }
+   if(count == 0) {
+      fprintf(fd, "   { \"\", 0, (const JLValue*)0 }\n");
+   }
+   fprintf(fd, "};\n\n");
+   fprintf(fd, "extern const JLRom %s;\n", name);
+   fprintf(fd, "const JLRom %s = { %s_bindings, %zu, %u };\n",
+           name, name, count, macros);
+
+   if(fclose(fd) != 0) {
+      fprintf(stderr, "cannot write %s\n", path);
+      return 0;
+   }
+   return 1;
+}
+
+int main(int argc, char *argv[])
+{
+   const char *name = argc > 3 ? argv[3] : "jl_prelude";
+   RomBuilder rom = {};
+   GlobalNode **bindings = NULL;
+   JLContext *context;
+   CatchNode node;
+   char *text;
+   size_t count = 0;
+   size_t i;
+   int status = 1;
+
+   if(argc < 3 || argc > 4) {
+      fprintf(stderr, "usage: %s prelude.jl prelude.cpp [name]\n", argv[0]);
+      return 1;
+   }
+   text = ReadText(argv[1]);
+   if(text == NULL) {
+      fprintf(stderr, "cannot read %s\n", argv[1]);
+      return 1;
+   }
+
+   context = JLCreateContext();
+   rom.context = context;
+   if(!Evaluate(context, text)) {
+      goto done;
+   }
+
+   /* Expansion can raise errors; they end the run like any other. */
+   bindings = (GlobalNode**)malloc((context->global_size + 1)
+                                   * sizeof(GlobalNode*));
+   EnterCatch(context, &node);
+   if(setjmp(node.env) != 0) {
+      ReportError(context);
+      goto done;
+   }
+   for(i = 0; i < context->global_size; i++) {
+      GlobalNode *global = &context->globals[i];
+      if(global->name == NULL || !strcmp(global->name, "nil")) {
+         continue;
+      }
+      if(!AddValues(&rom, global->value, global->name)) {
+         LeaveCatch(context, &node);
+         goto done;
+      }
+      bindings[count] = global;
+      count += 1;
+   }
+   LeaveCatch(context, &node);
+
+   qsort(bindings, count, sizeof(GlobalNode*), CompareBindings);
+   if(WriteRom(&rom, bindings, count, argv[1], argv[2], name)) {
+      status = 0;
+   }
+
+done:
+   free(bindings);
+   free(rom.values);
+   free(rom.table);
+   free(rom.indexes);
+   free(rom.strings);
+   JLDestroyContext(context);
+   free(text);
+   return status;
+}